@@ -13,16 +13,37 @@
 // You should have received a copy of the GNU General Public License along with Composure.
 // If not, see <http://www.gnu.org/licenses/>.
 
+#include <audio.hh>
+#include <cache.hh>
+#include <file_writer.hh>
+#include <generator.hh>
+#include <midi.hh>
+#include <note_ring.hh>
+#include <notes.hh>
 #include <phrase.hh>
 #include <random.hh>
+#include <server.hh>
+#include <soundfont.hh>
+#include <thread_pool.hh>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <optional>
@@ -31,24 +52,37 @@
 
 static std::string version = "1.1.1";
 
+/// The range of MIDI notes for random keys: F# below middle C to F above.
+constexpr int low_key = 54;
+constexpr int high_key = 65;
+
 double beat_to_sec(double beats, double tempo)
 {
     return beats * 60.0 / tempo;
 }
 
-std::string size_and_time(const std::vector<Note>& notes, int tempo)
+/// @return The time in beats at the end of the last note.
+double end_beats(std::span<const Note> notes)
+{
+    return notes.empty() ? 0.0 : notes.back().time + notes.back().duration;
+}
+
+std::string size_and_time(std::size_t size, double beats, int tempo)
 {
     // Convert note times from beats to seconds.
-    auto sec = notes.empty()
-        ? 0
-        : static_cast<int>(beat_to_sec(notes.back().time + notes.back().duration, tempo));
+    auto sec = static_cast<int>(beat_to_sec(beats, tempo));
     std::ostringstream os;
-    os << std::setw(4) << notes.size() << " notes "
+    os << std::setw(4) << size << " notes "
        << std::setw(2) << sec/60 << ':'
        << std::setw(2) << std::setfill('0') << sec % 60;
     return os.str();
 }
 
+std::string size_and_time(std::span<const Note> notes, int tempo)
+{
+    return size_and_time(notes.size(), end_beats(notes), tempo);
+}
+
 /// The command-line options and defaults. Optional entries are set randomly if not
 /// specified.
 struct Options
@@ -62,8 +96,57 @@ struct Options
     std::optional<unsigned int> seed;
     bool monophonic = false;
     bool chromatic = false;
+    std::optional<std::string> cache;
+    bool retempo = false;
+    bool all_keys = false;
+    bool binary = false;
+    std::optional<std::string> load;
+    int edits = 0;
+    bool tracks = false;
+    bool compact = false;
+    std::optional<int> duration; ///< Minutes of long-form output.
+    std::size_t budget = Note_Budget().total;
+    std::optional<int> batch; ///< The number of pieces to compose.
+    std::optional<unsigned> wav; ///< Bits per sample of WAV output.
+    /// Where to play long-form output as real-time PCM.  "-" for standard output.
+    std::optional<std::string> pcm;
+    /// Where to send raw MIDI messages in real time for long-form output.  "-" for
+    /// standard output.
+    std::optional<std::string> live;
+    /// The shared memory object to publish long-form notes to.
+    std::optional<std::string> ring;
+    std::optional<std::string> soundfont; ///< An SF2 file for rendering WAV output.
+    int program = 0; ///< The soundfont preset in bank 0.
+    std::optional<std::string> serve; ///< The socket for serving compose requests.
 };
 
+/// @return A string with every setting that affects composition.  Settings that only
+/// affect rendering, like tempo and key, are left out so re-renders share a cache entry.
+/// Picking a random key advances the random number generator, so whether the key was
+/// random does affect composition.
+std::string cache_key(const Options& opt, bool random_key)
+{
+    std::ostringstream os;
+    os << "version=" << version
+       << " seed=" << *opt.seed
+       << " random-key=" << random_key
+       << " voices=" << opt.voices
+       << " range=" << opt.range
+       << " passes=" << opt.passes
+       << " chromatic=" << opt.chromatic
+       << " budget=" << opt.budget;
+    return os.str();
+}
+
+/// @return The cache key without the number of passes.  Pieces with the same key can be
+/// snapshots of the same series of passes.
+std::string sharing_key(const Options& opt, bool random_key)
+{
+    auto all_passes = opt;
+    all_passes.passes = 0;
+    return cache_key(all_passes, random_key);
+}
+
 /// If a log file was passed as an argument, set the command-line options from the
 /// settings in the file.
 void read_options(int argc, char* argv[], Options& opt)
@@ -86,12 +169,34 @@ void read_options(int argc, char* argv[], Options& opt)
             opt.tempo = std::stoi(value);
         else if (label == "seed")
             opt.seed = std::stoul(value);
+        else if (label == "key" && value == "all")
+            opt.all_keys = true;
         else if (label == "key")
             opt.key = std::stoi(value);
         else if (label == "monophonic")
             opt.monophonic = value == "yes";
         else if (label == "chromatic")
             opt.chromatic = value == "yes";
+        else if (label == "tracks")
+            opt.tracks = value == "yes";
+        else if (label == "compact")
+            opt.compact = value == "yes";
+        else if (label == "duration")
+            opt.duration = std::stoi(value);
+        else if (label == "budget")
+            opt.budget = std::stoul(value);
+        else if (label == "wav")
+            opt.wav = std::stoul(value);
+        else if (label == "pcm")
+            opt.pcm = value;
+        else if (label == "live")
+            opt.live = value;
+        else if (label == "ring")
+            opt.ring = value;
+        else if (label == "soundfont")
+            opt.soundfont = value;
+        else if (label == "program")
+            opt.program = std::stoi(value);
         else
             assert(false); // Unknown label/value pair in log file.
     };
@@ -107,24 +212,566 @@ void read_options(int argc, char* argv[], Options& opt)
             // key: 60
             // key (random): 60
             std::regex label_val_re("^([a-z]+)(.*): ([a-z0-9]+)$");
+            // The values of these are paths or names, which may have any characters.
+            std::regex label_path_re("^(pcm|soundfont|live|ring): (.+)$");
             std::smatch match;
             while (log)
             {
                 std::getline(log, line);
-                if (std::regex_match(line, match, label_val_re) && match.size() >= 3)
+                if (std::regex_match(line, match, label_path_re))
+                    set(match[1].str(), match[2].str(), false);
+                else if (std::regex_match(line, match, label_val_re) && match.size() >= 3)
                     set(match[1].str(), match[3].str(), match[2].length() != 0);
             }
         }
     }
 }
 
-/// Make a new composition and write it to a MIDI file.
-int main(int argc, char* argv[])
+/// Change the tempo of the output files from a previous run without composing.  The
+/// tempo in the MIDI file is patched in place, and the times in the .notes file are
+/// scaled.
+int retempo(const Options& opt)
 {
-    Options opt;
-    // Set default options from the log file if specified. They may be overridden by
-    // command-line options parsed below.
-    read_options(argc, argv, opt);
+    double old_tempo;
+    try
+    {
+        old_tempo = write_midi_tempo(opt.output + ".midi", opt.tempo);
+
+        // Times in the binary notes file are in beats.  Only the tempo changes.
+        auto binary_file = opt.output + ".bnotes";
+        if (std::filesystem::exists(binary_file))
+        {
+            auto file = load_binary_notes(binary_file);
+            std::ofstream os(binary_file, std::ios::binary);
+            write_binary_notes(os, file.notes, opt.tempo, file.tonic);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    // Prefer the tempo in the log.  The one in the MIDI file was rounded to whole
+    // microseconds per beat.
+    auto log_file = opt.output + ".log";
+    std::vector<std::string> log_lines;
+    {
+        std::ifstream is(log_file);
+        std::string line;
+        while (std::getline(is, line))
+        {
+            if (line.starts_with("tempo: "))
+                old_tempo = std::stoi(line.substr(7));
+            log_lines.push_back(line);
+        }
+    }
+
+    // Times in the .notes file are in seconds.  Reading them at the old tempo recovers
+    // the times in beats.
+    auto notes_file = opt.output + ".notes";
+    if (std::filesystem::exists(notes_file))
+    {
+        try
+        {
+            std::ifstream is(notes_file);
+            std::string text(std::istreambuf_iterator<char>(is), {});
+            auto notes = read_text_notes(text, old_tempo, 0);
+            std::ofstream os(notes_file);
+            write_text_notes(os, notes, opt.tempo, 0);
+        }
+        catch (const Bad_Notes_File& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    // Record the new tempo in the log and scale the pass times.  The times were truncated
+    // to whole seconds, so the scaled times may be a second less than they would be if the
+    // piece was composed at the new tempo.
+    if (!std::filesystem::exists(log_file))
+        return 0;
+    std::regex time_re("^(.* notes )([ 0-9]{2}):([0-9]{2})$");
+    std::smatch match;
+    std::ofstream log(log_file);
+    for (auto line : log_lines)
+    {
+        if (line.starts_with("tempo: "))
+            line = "tempo: " + std::to_string(opt.tempo);
+        else if (std::regex_match(line, match, time_re))
+        {
+            auto sec = static_cast<int>((60*std::stoi(match[2].str())
+                                         + std::stoi(match[3].str()))*old_tempo/opt.tempo);
+            std::ostringstream os;
+            os << match[1].str() << std::setw(2) << sec/60 << ':'
+               << std::setw(2) << std::setfill('0') << sec % 60;
+            line = os.str();
+        }
+        log << line << '\n';
+    }
+    return 0;
+}
+
+/// Compose a phrase with compose/edit passes, or read it from the cache.
+/// @param composer Shares passes with other threads composing the same piece.
+Phrase compose_phrase(const Options& opt, bool random_key, std::ostream& log,
+                      std::pmr::memory_resource* memory, Shared_Composer& composer)
+{
+    // Reuse a cached composition if there is one.  Otherwise, start with an empty phrase
+    // and iterate.
+    std::optional<Composition_Cache> cache;
+    if (opt.cache)
+        cache.emplace(*opt.cache);
+    auto key = cache_key(opt, random_key);
+    auto entry = cache ? cache->load(key) : std::nullopt;
+    if (!entry)
+    {
+        entry = composer.compose(sharing_key(opt, random_key), opt.passes,
+                                 {double(opt.tempo), opt.voices, opt.range, opt.chromatic,
+                                  {.total = opt.budget}});
+        if (cache)
+            cache->store(key, *entry);
+    }
+
+    for (std::size_t i = 0; i < entry->passes.size(); ++i)
+    {
+        const auto& pass = entry->passes[i];
+        log << "pass " << i + 1 << '/' << opt.passes << '\n'
+            << "  compose: " << size_and_time(pass.compose_size, pass.compose_beats, opt.tempo)
+            << '\n'
+            << "  edit   : " << size_and_time(pass.edit_size, pass.edit_beats, opt.tempo)
+            << '\n';
+    }
+    return Phrase(opt.tempo, entry->notes, memory);
+}
+
+/// Load a phrase from a file and run edit passes on it.  No new notes are composed.
+Phrase load_phrase(const Options& opt, int tonic, std::ostream& log,
+                   std::pmr::memory_resource* memory)
+{
+    Phrase phrase(*opt.load, opt.tempo, tonic, memory);
+    log << "loaded : " << size_and_time(phrase.notes(), opt.tempo) << '\n';
+    for (int i = 0; i < opt.edits; ++i)
+    {
+        phrase.edit();
+        log << "edit " << i + 1 << '/' << opt.edits << ": "
+            << size_and_time(phrase.notes(), opt.tempo) << '\n';
+    }
+    return phrase;
+}
+
+/// Write the log file and print the summary.
+/// @param writer If given, the log is written in the background.
+int finish(const Options& opt, const std::string& log_text, const std::string& summary,
+           File_Writer* writer = nullptr)
+{
+    if (writer)
+        writer->write(opt.output + ".log", log_text);
+    else
+        std::ofstream(opt.output + ".log").write(log_text.data(), log_text.size());
+
+    // Print out the number of notes, total time, and random seed.  Write the line at once
+    // so lines from batch workers don't interleave.  Keep standard output clean if audio
+    // was written to it.
+    auto& os = opt.pcm == "-" || opt.live == "-" ? std::cerr : std::cout;
+    os << summary + "  " + std::to_string(*opt.seed) + '\n' << std::flush;
+    return 0;
+}
+
+/// Totals for a piece written in segments.
+struct Long_Form_Totals
+{
+    std::size_t segments = 0;
+    std::size_t notes = 0;
+    double beats = 0.0; ///< The end of the last note.
+};
+
+/// Write each segment to the notes file as it's composed and pass its notes on to the
+/// MIDI writer.
+Generator<Note> spill_notes(Generator<std::vector<Note>> segments, std::ostream& os,
+                            int tempo, int tonic, Long_Form_Totals& totals)
+{
+    for (const auto& segment : segments)
+    {
+        write_text_notes(os, segment, tempo, tonic);
+        ++totals.segments;
+        totals.notes += segment.size();
+        for (const auto& note : segment)
+        {
+            totals.beats = std::max(totals.beats, note.time + note.duration);
+            co_yield note;
+        }
+    }
+}
+
+/// Publish notes to a shared memory ring as they're composed and pass them on.
+Generator<Note> publish_notes(Generator<Note> notes, Note_Publisher& publisher, int tempo,
+                              int tonic)
+{
+    auto seconds = 60.0/tempo;
+    for (const auto& note : notes)
+    {
+        publisher.publish({note.time*seconds, float(note.duration*seconds),
+                           float(tonic + note.pitch), float(note.volume), note.generation});
+        co_yield note;
+    }
+    publisher.finish();
+}
+
+/// Open a file or named pipe for real-time output.  Opening a pipe waits for a reader.
+/// @param path The file, or "-" for standard output.
+/// @return The file descriptor, or -1 on failure.
+int open_output(const std::string& path)
+{
+    if (path == "-")
+        return STDOUT_FILENO;
+    return ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+/// Play notes as real-time PCM as they're composed.  Throws Audio_Not_Written if the
+/// output can't be opened or written.
+void play_long_form(const Options& opt, Generator<Note> notes, int tonic, std::ostream& log)
+{
+    constexpr unsigned sample_rate = 44100;
+    auto fd = open_output(*opt.pcm);
+    if (fd < 0)
+        throw Audio_Not_Written(*opt.pcm + ": " + std::strerror(errno));
+    // Report a closed pipe as a write error instead of quitting.
+    std::signal(SIGPIPE, SIG_IGN);
+    // Keep the mix in range when every voice sounds at once.
+    auto gain = 1.0/opt.voices;
+    auto stats = play_pcm(stream_audio(std::move(notes), opt.tempo, tonic, opt.monophonic,
+                                       sample_rate),
+                          fd, sample_rate, gain);
+    if (fd != STDOUT_FILENO)
+        ::close(fd);
+    log << "pcm stats: " << stats.samples << " samples, " << stats.underruns
+        << " underruns, " << stats.max_fill << " of " << stats.capacity
+        << " buffered at most\n";
+}
+
+/// Send notes as raw MIDI messages in real time as they're composed.  Throws
+/// Live_Midi_Not_Written if the output can't be opened or written.
+void play_live(const Options& opt, Generator<Note> notes, int tonic, std::ostream& log)
+{
+    auto fd = open_output(*opt.live);
+    if (fd < 0)
+        throw Live_Midi_Not_Written(*opt.live + ": " + std::strerror(errno));
+    // Report a closed pipe as a write error instead of quitting.
+    std::signal(SIGPIPE, SIG_IGN);
+    auto stats = play_midi(stream_events(std::move(notes), opt.tempo, tonic, opt.monophonic),
+                           fd);
+    if (fd != STDOUT_FILENO)
+        ::close(fd);
+    auto us = [](double seconds) { return std::lround(seconds*1e6); };
+    log << "live stats: " << stats.messages << " messages, " << stats.missed
+        << " missed, lateness p50 " << us(stats.p50) << " us, p99 " << us(stats.p99)
+        << " us, max " << us(stats.max) << " us\n";
+}
+
+/// Compose a piece of the given duration in segments.  The .midi and .notes files are
+/// written as the piece is composed, so memory use doesn't grow with the duration.  If
+/// PCM or live output was requested, it's played instead of writing the .midi file.
+/// @return The summary line.
+std::string write_long_form(const Options& opt, int tonic, std::ostream& log)
+{
+    Long_Form_Totals totals;
+    std::ofstream note_log(opt.output + ".notes");
+    auto midi_file = opt.output + ".midi";
+    auto segments = compose_segments(opt.tempo, opt.voices, opt.range, opt.chromatic,
+                                     opt.passes, *opt.duration*opt.tempo,
+                                     {.total = opt.budget});
+    auto notes = spill_notes(std::move(segments), note_log, opt.tempo, tonic, totals);
+    // Enough for several segments so readers can fall behind by a few seconds.
+    constexpr std::size_t ring_capacity = 1 << 16;
+    std::optional<Note_Publisher> publisher;
+    if (opt.ring)
+    {
+        publisher.emplace(*opt.ring, ring_capacity);
+        notes = publish_notes(std::move(notes), *publisher, opt.tempo, tonic);
+    }
+    std::size_t savings = 0;
+    if (opt.pcm)
+        play_long_form(opt, std::move(notes), tonic, log);
+    else if (opt.live)
+        play_live(opt, std::move(notes), tonic, log);
+    else
+        savings = stream_midi(std::move(notes), midi_file, opt.tempo, tonic, opt.monophonic,
+                              opt.compact);
+    log << "long form: " << totals.segments << " segments, "
+        << size_and_time(totals.notes, totals.beats, opt.tempo) << '\n';
+    if (opt.compact && !opt.pcm && !opt.live)
+        log << "midi: " << midi_file << ' ' << std::filesystem::file_size(midi_file)
+            << " bytes, " << savings << " saved by compact encoding\n";
+    return size_and_time(totals.notes, totals.beats, opt.tempo);
+}
+
+/// Compose a piece, or load one, and write the output files.
+/// @param command The command line for the log.
+/// @param writer If given, files are built in memory and written in the background.
+///     Long-form output is always written as it's composed.
+/// @return The exit status.
+int run(Options opt, const std::string& command, File_Writer* writer = nullptr)
+{
+    // The notes and composition temporaries are released together at the end.
+    std::pmr::monotonic_buffer_resource arena;
+
+    // Accumulate the log in memory and write it all at once at the end.
+    std::ostringstream log;
+    log << command << '\n';
+    log << "version: " << version << '\n'
+        << "output: " << opt.output << '\n'
+        << "voices: " << opt.voices << '\n'
+        << "passes: " << opt.passes << '\n'
+        << "range: "  << opt.range << '\n'
+        << "budget: " << opt.budget << '\n'
+        << "tempo: "  << opt.tempo << '\n';
+
+    log << "seed" << (opt.seed ? "" : " (random)") << ": ";
+    std::random_device random;
+    if (!opt.seed)
+        opt.seed = random();
+    log << *opt.seed << '\n';
+
+    set_random_seed(*opt.seed);
+
+    // Pick a random key from MIDI note 54 to 65: F# below middle C to F above.  If all
+    // keys are written, no key is picked so that the composition is the same as one where
+    // the key is given.
+    std::vector<int> keys;
+    bool random_key = !opt.key && !opt.all_keys;
+    if (opt.all_keys)
+    {
+        for (int k = low_key; k <= high_key; ++k)
+            keys.push_back(k);
+        log << "key: all\n";
+    }
+    else
+    {
+        log << "key" << (opt.key ? "" : " (random)") << ": ";
+        if (!opt.key)
+            opt.key = pick(low_key, high_key);
+        keys.push_back(*opt.key);
+        log << *opt.key << '\n';
+    }
+    log << "monophonic: " << (opt.monophonic ? "yes" : "no") << '\n'
+        << "chromatic: " << (opt.chromatic  ? "yes" : "no") << '\n'
+        << "tracks: " << (opt.tracks ? "yes" : "no") << '\n'
+        << "compact: " << (opt.compact ? "yes" : "no") << '\n';
+    if (opt.wav)
+        log << "wav: " << *opt.wav << '\n';
+    if (opt.soundfont)
+        log << "soundfont: " << *opt.soundfont << '\n'
+            << "program: " << opt.program << '\n';
+
+    // Long-form pieces are written as they're composed.
+    if (opt.duration)
+    {
+        log << "duration: " << *opt.duration << '\n';
+        if (opt.pcm)
+            log << "pcm: " << *opt.pcm << '\n';
+        if (opt.live)
+            log << "live: " << *opt.live << '\n';
+        if (opt.ring)
+            log << "ring: " << *opt.ring << '\n';
+        try
+        {
+            auto summary = write_long_form(opt, keys.front(), log);
+            return finish(opt, log.str(), summary);
+        }
+        catch (const std::runtime_error& e)
+        {
+            // Midi_Not_Written, Live_Midi_Not_Written, Audio_Not_Written, or
+            // Note_Ring_Error
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    // Read the soundfont before composing so a bad file is reported right away.
+    std::optional<Soundfont> font;
+    if (opt.soundfont)
+    {
+        try
+        {
+            font.emplace(*opt.soundfont);
+        }
+        catch (const std::runtime_error& e)
+        {
+            // File_Not_Mapped or Bad_Soundfont
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    std::optional<Phrase> loaded;
+    if (opt.load)
+    {
+        try
+        {
+            loaded.emplace(load_phrase(opt, opt.key.value_or(keys.front()), log, &arena));
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    Shared_Composer composer;
+    auto phrase = loaded ? std::move(*loaded)
+        : compose_phrase(opt, random_key, log, &arena, composer);
+
+    // Write a file now, or build it in memory for the writer.
+    auto save = [writer](const std::string& file, const auto& write) {
+        if (writer)
+        {
+            std::ostringstream os;
+            write(os);
+            writer->write(file, std::move(os).str());
+        }
+        else
+        {
+            std::ofstream os(file, std::ios::binary);
+            write(os);
+        }
+    };
+
+    // Rendering is cheap compared to composing, so writing the same composition in every
+    // key costs little more than writing it once.
+    for (auto tonic : keys)
+    {
+        auto output = opt.all_keys ? opt.output + '-' + std::to_string(tonic) : opt.output;
+        auto midi_file = output + ".midi";
+        std::size_t savings = 0;
+        std::size_t midi_size = 0; ///< Only known here if the writer has the file.
+        if (writer)
+        {
+            std::ostringstream midi;
+            savings = opt.tracks
+                ? phrase.write_midi_tracks(midi, tonic, opt.monophonic, opt.compact)
+                : phrase.write_midi(midi, tonic, opt.monophonic, opt.compact);
+            auto data = std::move(midi).str();
+            midi_size = data.size();
+            writer->write(midi_file, std::move(data));
+        }
+        else if (opt.tracks)
+        {
+            std::ofstream file(midi_file);
+            savings = phrase.write_midi_tracks(file, tonic, opt.monophonic, opt.compact);
+        }
+        else
+        {
+            try
+            {
+                savings = phrase.stream_midi(midi_file, tonic, opt.monophonic, opt.compact);
+            }
+            catch (const Midi_Not_Written& e)
+            {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        }
+        if (opt.compact)
+            log << "midi: " << midi_file << ' '
+                << (writer ? midi_size : std::filesystem::file_size(midi_file))
+                << " bytes, " << savings << " saved by compact encoding\n";
+        if (opt.wav && font)
+        {
+            constexpr unsigned sample_rate = 44100;
+            try
+            {
+                auto samples = font->render(phrase.audio_notes(tonic, opt.monophonic),
+                                            opt.program, 0, sample_rate);
+                save(output + ".wav", [&](std::ostream& os) {
+                    write_wav(os, samples, sample_rate, *opt.wav);
+                });
+            }
+            catch (const Bad_Soundfont& e)
+            {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        }
+        else if (opt.wav)
+            save(output + ".wav", [&](std::ostream& os) {
+                phrase.write_wav(os, tonic, opt.monophonic, *opt.wav);
+            });
+
+        if (opt.binary)
+        {
+            save(output + ".bnotes", [&](std::ostream& os) {
+                write_binary_notes(os, phrase.notes(), opt.tempo, tonic);
+            });
+            continue;
+        }
+
+        // Write a text file with information about each note.
+        save(output + ".notes", [&](std::ostream& os) {
+            write_text_notes(os, phrase.notes(), opt.tempo, tonic);
+        });
+    }
+
+    return finish(opt, log.str(), size_and_time(phrase.notes(), opt.tempo), writer);
+}
+
+/// Compose pieces with consecutive seeds in the standard thread pool.  Each piece is the
+/// same as a run with its seed, written to <output>-<seed>.  The files are written in the
+/// background so the workers go on to the next piece right away.
+/// @return The exit status.  Nonzero if any piece failed.
+int run_batch(const Options& opt, const std::string& command)
+{
+    File_Writer writer;
+    std::random_device random;
+    auto first_seed = opt.seed.value_or(random());
+    std::atomic<int> status = 0;
+    // Pieces are independent tasks.  Their track encoding and rendering run in the same
+    // pool.
+    Thread_Pool::standard().parallel_for(*opt.batch, [&](std::size_t i) {
+        auto piece = opt;
+        piece.batch.reset();
+        piece.seed = first_seed + i;
+        piece.output = opt.output + '-' + std::to_string(*piece.seed);
+        // Report a failed piece and go on with the others.
+        try
+        {
+            if (run(piece, command, &writer) != 0)
+                status = 1;
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << *piece.seed << ": " << e.what() << std::endl;
+            status = 1;
+        }
+    });
+    try
+    {
+        writer.wait();
+    }
+    catch (const Output_Not_Written& e)
+    {
+        std::cerr << e.what() << std::endl;
+        status = 1;
+    }
+    return status;
+}
+
+/// The outcome of parse_args().
+enum class Parse_Result
+{
+    ok,
+    help, ///< The help option was given.
+    error, ///< An option wasn't recognized or was missing its argument.
+};
+
+/// Set options from command-line arguments.  Throws std::invalid_argument or
+/// std::out_of_range if a numeric argument is bad.  Not thread-safe.
+/// @param quiet If true, getopt doesn't print messages about bad options.
+Parse_Result parse_args(int argc, char* argv[], Options& opt, bool quiet = false)
+{
+    // Start over in case arguments were parsed before.
+    optind = 0;
+    opterr = quiet ? 0 : 1;
     while (true)
     {
         static struct option options[] = {
@@ -137,10 +784,28 @@ int main(int argc, char* argv[])
             {"seed", required_argument, nullptr, 's'},
             {"monophonic", no_argument, nullptr, 'm'},
             {"chromatic", no_argument, nullptr, 'c'},
+            {"cache", required_argument, nullptr, 'C'},
+            {"retempo", no_argument, nullptr, 'T'},
+            {"all-keys", no_argument, nullptr, 'a'},
+            {"binary", no_argument, nullptr, 'b'},
+            {"load", required_argument, nullptr, 'l'},
+            {"edits", required_argument, nullptr, 'e'},
+            {"tracks", no_argument, nullptr, 'g'},
+            {"compact", no_argument, nullptr, 'z'},
+            {"duration", required_argument, nullptr, 'd'},
+            {"budget", required_argument, nullptr, 'n'},
+            {"batch", required_argument, nullptr, 'B'},
+            {"wav", required_argument, nullptr, 'w'},
+            {"pcm", required_argument, nullptr, 'P'},
+            {"live", required_argument, nullptr, 'L'},
+            {"ring", required_argument, nullptr, 'R'},
+            {"soundfont", required_argument, nullptr, 'f'},
+            {"program", required_argument, nullptr, 'i'},
+            {"serve", required_argument, nullptr, 'S'},
             {"help", no_argument, nullptr, 'h'},
             {0, 0, 0, 0}};
         int index;
-        int c = getopt_long(argc, argv, "o:v:p:r:t:k:s:mc", options, &index);
+        int c = getopt_long(argc, argv, "o:v:p:r:t:k:s:mcC:Tabl:e:gzd:n:B:w:P:f:i:L:R:S:", options, &index);
 
         if (c == -1)
             break;
@@ -175,83 +840,291 @@ int main(int argc, char* argv[])
         case 'c':
             opt.chromatic = true;
             break;
+        case 'C':
+            opt.cache = optarg;
+            break;
+        case 'T':
+            opt.retempo = true;
+            break;
+        case 'a':
+            opt.all_keys = true;
+            break;
+        case 'b':
+            opt.binary = true;
+            break;
+        case 'l':
+            opt.load = optarg;
+            break;
+        case 'e':
+            opt.edits = std::stoi(optarg);
+            break;
+        case 'g':
+            opt.tracks = true;
+            break;
+        case 'z':
+            opt.compact = true;
+            break;
+        case 'd':
+            opt.duration = std::stoi(optarg);
+            break;
+        case 'n':
+            opt.budget = std::stoul(optarg);
+            break;
+        case 'B':
+            opt.batch = std::stoi(optarg);
+            break;
+        case 'w':
+            opt.wav = std::stoul(optarg);
+            break;
+        case 'P':
+            opt.pcm = optarg;
+            break;
+        case 'L':
+            opt.live = optarg;
+            break;
+        case 'R':
+            opt.ring = optarg;
+            break;
+        case 'f':
+            opt.soundfont = optarg;
+            break;
+        case 'i':
+            opt.program = std::stoi(optarg);
+            break;
+        case 'S':
+            opt.serve = optarg;
+            break;
         case 'h':
-            std::cerr << "Composure: Naive music composition\n"
-                      << "Version " << version << " © 2021 Sam Varner\n"
-                      << "https://github.com/snick-a-doo/composure\n";
-            // Fall through
+            return Parse_Result::help;
         default:
-            std::cerr << "\nUsage: composure [log] [options]\n"
-                      << "    -c --chromatic  (false)\n"
-                      << "    -h --help       Display this help and exit.\n"
-                      << "    -k --key=       60 for middle C (random 54 to 65)\n"
-                      << "    -m --monophonic (false)\n"
-                      << "    -o --output=    Output file name (" << opt.output << ")\n"
-                      << "    -p --passes=    Number of compose/edit passes (" << opt.passes << ")\n"
-                      << "    -r --range=     Maximum range of notes (" << opt.range << ")\n"
-                      << "    -s --seed=      Random seed (random)\n"
-                      << "    -t --tempo=     Beats per minute (" << opt.tempo << ")\n"
-                      << "    -v --voices=    Number of voices (" << opt.voices << ")\n"
-                      << "\n"
-                      << "If a log file is passed, its settings are used unless overridden\n"
-                      << "by command-line options.\n"
-                      << std::endl;
-            exit(c == 'h' ? 0 : 1);
+            return Parse_Result::error;
         }
     }
+    return Parse_Result::ok;
+}
 
-    std::ofstream log(opt.output + ".log");
-    for (int i = 0; i < argc; ++i)
-        log << argv[i] << ' ';
-    log << '\n';
-    log << "version: " << version << '\n'
-        << "output: " << opt.output << '\n'
-        << "voices: " << opt.voices << '\n'
-        << "passes: " << opt.passes << '\n'
-        << "range: "  << opt.range << '\n'
-        << "tempo: "  << opt.tempo << '\n';
+/// Exception thrown for a request the server can't answer.
+class Bad_Request : public std::runtime_error
+{
+public:
+    Bad_Request(const std::string& what)
+        : std::runtime_error(what)
+    {}
+};
 
-    log << "seed" << (opt.seed ? "" : " (random)") << ": ";
-    std::random_device random;
-    if (!opt.seed)
-        opt.seed = random();
-    log << *opt.seed << '\n';
+/// Compose a piece for a request to the server.  The request has command-line options
+/// separated by spaces.  They override the options the server was started with.
+/// @return "ok <seed> <key> <MIDI size> <notes size>" and a newline, followed by the
+///     MIDI file and the .notes or .bnotes text.  The same files as a command-line run
+///     with the seed.  For a bad request, "error <message>" and a newline.
+/// @param composer Shares passes between concurrent requests for the same piece.
+std::string answer_request(const Options& defaults, const std::string& request,
+                           Shared_Composer& composer)
+{
+    // getopt keeps its state in globals.
+    static std::mutex getopt_mutex;
+    try
+    {
+        auto opt = defaults;
+        {
+            std::vector<std::string> words{"composure"};
+            std::istringstream is(request);
+            for (std::string word; is >> word;)
+                words.push_back(word);
+            std::vector<char*> args;
+            for (auto& word : words)
+                args.push_back(word.data());
+            args.push_back(nullptr);
+            std::lock_guard lock(getopt_mutex);
+            Parse_Result result;
+            try
+            {
+                result = parse_args(words.size(), args.data(), opt, true);
+            }
+            catch (const std::logic_error&)
+            {
+                // std::invalid_argument or std::out_of_range from a number
+                result = Parse_Result::error;
+            }
+            if (result != Parse_Result::ok || optind != static_cast<int>(words.size()))
+                throw Bad_Request("Bad option in: " + request);
+        }
+        if (opt.duration || opt.batch || opt.pcm || opt.live || opt.ring || opt.wav
+            || opt.soundfont || opt.load || opt.all_keys || opt.retempo
+            || opt.serve != defaults.serve)
+            throw Bad_Request("The server can't do all-keys, batch, duration, live, load, "
+                              "pcm, retempo, ring, serve, soundfont, or wav.");
 
-    set_random_seed(*opt.seed);
+        // The same sequence of random numbers as run().
+        if (!opt.seed)
+            opt.seed = std::random_device()();
+        set_random_seed(*opt.seed);
+        bool random_key = !opt.key;
+        if (random_key)
+            opt.key = pick(low_key, high_key);
+
+        std::pmr::monotonic_buffer_resource arena;
+        std::ostringstream log;
+        auto phrase = compose_phrase(opt, random_key, log, &arena, composer);
+        std::ostringstream midi;
+        if (opt.tracks)
+            phrase.write_midi_tracks(midi, *opt.key, opt.monophonic, opt.compact);
+        else
+            phrase.write_midi(midi, *opt.key, opt.monophonic, opt.compact);
+        std::ostringstream notes;
+        if (opt.binary)
+            write_binary_notes(notes, phrase.notes(), opt.tempo, *opt.key);
+        else
+            write_text_notes(notes, phrase.notes(), opt.tempo, *opt.key);
 
-    // Pick a random key from MIDI note 54 to 65: F# below middle C to F above.
-    log << "key" << (opt.key ? "" : " (random)") << ": ";
-    if (!opt.key)
-        opt.key = pick(54, 65);
-    log << *opt.key << '\n'
-        << "monophonic: " << (opt.monophonic ? "yes" : "no") << '\n'
-        << "chromatic: " << (opt.chromatic  ? "yes" : "no") << '\n';
-
-    // Start with an empty phrase and iterate.
-    Phrase phrase(opt.tempo);
-    for (int i = 0; i < opt.passes; ++i)
+        auto midi_data = std::move(midi).str();
+        auto notes_data = std::move(notes).str();
+        return "ok " + std::to_string(*opt.seed) + ' ' + std::to_string(*opt.key) + ' '
+            + std::to_string(midi_data.size()) + ' ' + std::to_string(notes_data.size())
+            + '\n' + midi_data + notes_data;
+    }
+    catch (const std::exception& e)
     {
-        log << "pass " << i + 1 << '/' << opt.passes << '\n';
-        phrase.compose(*opt.key, opt.voices, opt.range, opt.chromatic);
-        log << "  compose: " << size_and_time(phrase.notes(), opt.tempo) << '\n';
-        phrase.edit();
-        log << "  edit   : " << size_and_time(phrase.notes(), opt.tempo) << '\n';
+        // Bad_Request or cache errors
+        return std::string("error ") + e.what() + '\n';
     }
+}
 
-    std::ofstream file(opt.output + ".midi");
-    phrase.write_midi(file, opt.monophonic);
+/// The server that's running, for the signal handler.
+Socket_Server* running_server = nullptr;
 
-    // Write a text file with information about each note.
-    std::ofstream note_log(opt.output + ".notes");
-    for (const auto& note : phrase.notes())
+/// Answer compose requests on a UNIX socket until interrupted.
+/// @return The exit status.
+int serve(const Options& opt)
+{
+    try
     {
-        note_log << beat_to_sec(note.time, opt.tempo) << ' '
-                 << beat_to_sec(note.time + note.duration, opt.tempo) << ' '
-                 << note.pitch << ' ' << note.generation << std::endl;
+        // Concurrent requests for the same piece share passes.
+        Shared_Composer composer;
+        Socket_Server server(*opt.serve, [&](const std::string& request) {
+            return answer_request(opt, request, composer);
+        });
+        running_server = &server;
+        auto stop = [](int) { running_server->stop(); };
+        std::signal(SIGINT, stop);
+        std::signal(SIGTERM, stop);
+        std::signal(SIGPIPE, SIG_IGN);
+        // Put the default handlers back before the server is cleared, even if run()
+        // throws, so a late signal can't reach a null or destroyed server.
+        struct Restore
+        {
+            ~Restore()
+            {
+                std::signal(SIGINT, SIG_DFL);
+                std::signal(SIGTERM, SIG_DFL);
+                running_server = nullptr;
+            }
+        } restore;
+        std::cerr << "Serving on " << *opt.serve << " with " << server.workers()
+                  << " workers" << std::endl;
+        server.run();
+        std::cerr << composer.shared() << " requests shared another's passes" << std::endl;
+    }
+    catch (const Server_Error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
-
-    // Print out the number of notes, total time, and random seed.
-    std::cout << size_and_time(phrase.notes(), opt.tempo) << "  "
-              << *opt.seed << std::endl;
     return 0;
 }
+
+/// Print the version for the help option, and usage for help or an error.
+void print_usage(const Options& opt, bool help)
+{
+    if (help)
+        std::cerr << "Composure: Naive music composition\n"
+                  << "Version " << version << " © 2021 Sam Varner\n"
+                  << "https://github.com/snick-a-doo/composure\n";
+    std::cerr << "\nUsage: composure [log] [options]\n"
+              << "    -a --all-keys   Write output in each key from 54 to 65 (false)\n"
+              << "    -b --binary     Write .bnotes instead of .notes (false)\n"
+              << "    -B --batch=     Compose this many pieces from consecutive seeds (1)\n"
+              << "    -c --chromatic  (false)\n"
+              << "    -C --cache=     Directory for caching compositions (none)\n"
+              << "    -d --duration=  Minutes of long-form output (none)\n"
+              << "    -e --edits=     Number of edit passes on a loaded piece (0)\n"
+              << "    -f --soundfont= Render WAV output with an SF2 file (built-in voice)\n"
+              << "    -g --tracks     One MIDI track per generation (false)\n"
+              << "    -h --help       Display this help and exit.\n"
+              << "    -i --program=   Preset in bank 0 of the soundfont (0)\n"
+              << "    -k --key=       60 for middle C (random 54 to 65)\n"
+              << "    -l --load=      Load a .notes, .bnotes or .midi file instead of composing\n"
+              << "    -L --live=      Send long-form output as live MIDI to a file, pipe, or - (none)\n"
+              << "    -m --monophonic (false)\n"
+              << "    -n --budget=    Stop composing at this many notes (" << opt.budget << ")\n"
+              << "    -o --output=    Output file name (" << opt.output << ")\n"
+              << "    -p --passes=    Number of compose/edit passes (" << opt.passes << ")\n"
+              << "    -P --pcm=       Play long-form output as PCM to a file, pipe, or - (none)\n"
+              << "    -r --range=     Maximum range of notes (" << opt.range << ")\n"
+              << "    -R --ring=      Publish long-form notes to a shared memory ring (none)\n"
+              << "    -s --seed=      Random seed (random)\n"
+              << "    -S --serve=     Answer compose requests on a UNIX socket (none)\n"
+              << "    -t --tempo=     Beats per minute (" << opt.tempo << ")\n"
+              << "    -T --retempo    Change the tempo of existing output (false)\n"
+              << "    -v --voices=    Number of voices (" << opt.voices << ")\n"
+              << "    -w --wav=       Also write a WAV file with 16 or 24-bit samples (none)\n"
+              << "    -z --compact    Use running status for all MIDI note events (false)\n"
+              << "\n"
+              << "If a log file is passed, its settings are used unless overridden\n"
+              << "by command-line options.\n"
+              << std::endl;
+}
+
+/// Make a new composition and write it to a MIDI file.
+int main(int argc, char* argv[])
+{
+    Options opt;
+    // Set default options from the log file if specified. They may be overridden by
+    // command-line options parsed below.
+    read_options(argc, argv, opt);
+    if (auto result = parse_args(argc, argv, opt); result != Parse_Result::ok)
+    {
+        print_usage(opt, result == Parse_Result::help);
+        return result == Parse_Result::help ? 0 : 1;
+    }
+
+    if (opt.retempo)
+        return retempo(opt);
+    if (opt.serve)
+        return serve(opt);
+    if (opt.duration
+        && (opt.all_keys || opt.tracks || opt.binary || opt.load || opt.cache || opt.wav))
+    {
+        std::cerr << "Long-form output can't be combined with all-keys, tracks, binary, "
+                  << "load, cache, or wav." << std::endl;
+        return 1;
+    }
+    if ((opt.pcm || opt.live || opt.ring) && (!opt.duration || opt.batch))
+    {
+        std::cerr << "PCM, live, and ring output need the duration option and can't be "
+                  << "combined with batch." << std::endl;
+        return 1;
+    }
+    if (opt.pcm && opt.live)
+    {
+        std::cerr << "PCM and live output can't be combined." << std::endl;
+        return 1;
+    }
+    if (opt.soundfont && !opt.wav)
+    {
+        std::cerr << "The soundfont option needs the wav option." << std::endl;
+        return 1;
+    }
+    if (opt.wav && *opt.wav != 16 && *opt.wav != 24)
+    {
+        std::cerr << "WAV samples must be 16 or 24 bits." << std::endl;
+        return 1;
+    }
+
+    std::ostringstream command;
+    for (int i = 0; i < argc; ++i)
+        command << argv[i] << ' ';
+    if (opt.batch)
+        return run_batch(opt, command.str());
+    return run(opt, command.str());
+}
@@ -0,0 +1,77 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+// Time a batch of pieces composed from consecutive seeds in thread pools of 1 thread up to
+// one per core.  Each piece is composed and edited like a run of composure and encoded
+// with one MIDI track per generation, so track encoding runs nested in the same pool.
+
+#include <phrase.hh>
+#include <random.hh>
+#include <thread_pool.hh>
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+int main()
+{
+    using Clock = std::chrono::steady_clock;
+    constexpr int pieces = 64;
+    constexpr int passes = 8;
+
+    std::vector<unsigned> counts;
+    auto cores = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned n = 1; n < cores; n *= 2)
+        counts.push_back(n);
+    counts.push_back(cores);
+
+    std::cout << std::setw(8) << "threads" << std::setw(10) << "notes" << std::setw(10) << "ms"
+              << std::setw(10) << "pieces/s" << std::setw(10) << "speedup"
+              << std::setw(12) << "efficiency" << '\n';
+    double one_thread = 0.0;
+    for (auto n : counts)
+    {
+        Thread_Pool pool(n);
+        std::atomic<std::size_t> notes = 0;
+        auto start = Clock::now();
+        pool.parallel_for(pieces, [&](std::size_t i) {
+            set_random_seed(i + 1);
+            Phrase phrase(60);
+            for (int p = 0; p < passes; ++p)
+            {
+                phrase.compose(6, 24, false);
+                phrase.edit();
+            }
+            std::ostringstream os;
+            phrase.write_midi_tracks(os, 60, false);
+            notes += phrase.notes().size();
+        });
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        if (n == 1)
+            one_thread = elapsed.count();
+        auto speedup = one_thread/elapsed.count();
+        std::cout << std::setw(8) << n << std::setw(10) << notes
+                  << std::setw(10) << std::fixed << std::setprecision(1)
+                  << 1e3*elapsed.count()
+                  << std::setw(10) << std::setprecision(0) << pieces/elapsed.count()
+                  << std::setw(10) << std::setprecision(2) << speedup
+                  << std::setw(12) << std::setprecision(2) << speedup/n << '\n';
+    }
+    return 0;
+}
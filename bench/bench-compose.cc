@@ -0,0 +1,46 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+// Time single compose passes with large note budgets.
+
+#include <phrase.hh>
+#include <random.hh>
+
+#include <chrono>
+#include <climits>
+#include <iomanip>
+#include <iostream>
+
+int main()
+{
+    using Clock = std::chrono::steady_clock;
+    std::cout << std::setw(10) << "budget" << std::setw(10) << "notes"
+              << std::setw(10) << "ms" << std::setw(14) << "notes/s" << '\n';
+    for (std::size_t budget : {10'000, 100'000, 1'000'000})
+    {
+        set_random_seed(1);
+        Phrase phrase(60);
+        auto start = Clock::now();
+        // The range never stops composition, so the budget does.
+        phrase.compose(6, INT_MAX, false, {.pass = budget, .total = budget});
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        std::cout << std::setw(10) << budget << std::setw(10) << phrase.notes().size()
+                  << std::setw(10) << std::fixed << std::setprecision(1)
+                  << 1e3*elapsed.count()
+                  << std::setw(14) << std::setprecision(0)
+                  << phrase.notes().size()/elapsed.count() << '\n';
+    }
+    return 0;
+}
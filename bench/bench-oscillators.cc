@@ -0,0 +1,58 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+// Time the oscillator bank with each instruction set the CPU supports.  The headroom is
+// the number of oscillators that could be played in real time.
+
+#include <oscillator.hh>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+int main()
+{
+    using Clock = std::chrono::steady_clock;
+    constexpr double rate = 44100.0;
+    constexpr double seconds = 10.0;
+    const char* names[] = {"scalar", "avx2", "avx512"};
+
+    std::cout << std::setw(8) << "simd" << std::setw(8) << "oscs" << std::setw(10) << "ms"
+              << std::setw(12) << "× realtime" << std::setw(12) << "headroom" << '\n';
+    for (auto simd : {Simd::scalar, Simd::avx2, Simd::avx512})
+    {
+        if (!simd_supported(simd))
+            continue;
+        for (int n : {64, 256, 1024})
+        {
+            // Every oscillator sounds for the whole time.
+            std::vector<Partial> partials;
+            for (int k = 0; k < n; ++k)
+                partials.push_back({0.0, seconds, 0.0, 55.0 + 3.0*k, 1.0/n, 0.1});
+            std::vector<float> out(seconds*rate);
+            auto start = Clock::now();
+            render_partials(partials, rate, 0, out, simd);
+            std::chrono::duration<double> elapsed = Clock::now() - start;
+            auto speed = seconds/elapsed.count();
+            std::cout << std::setw(8) << names[static_cast<int>(simd)] << std::setw(8) << n
+                      << std::setw(10) << std::fixed << std::setprecision(1)
+                      << 1e3*elapsed.count()
+                      << std::setw(12) << std::setprecision(1) << speed
+                      << std::setw(12) << std::setprecision(0) << n*speed << '\n';
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,352 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "audio.hh"
+#include "oscillator.hh"
+#include "ring_buffer.hh"
+#include "thread_pool.hh"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <ostream>
+#include <thread>
+
+namespace
+{
+    /// Envelope times in seconds.
+    constexpr double attack = 0.002; ///< Time constant of the rise.
+    constexpr double decay = 0.8; ///< Time constant of the fundamental's decay.
+    constexpr double release = 0.03; ///< Time constant after the stop time.
+    /// Notes are cut off after this many release time constants.
+    constexpr double release_length = 5.0;
+    /// Notes are cut off when the decay reaches this level, about -80 dB.
+    constexpr double min_level = 1e-4;
+    /// The relative levels of the harmonics.  Harmonic k decays k times as fast as the
+    /// fundamental, so the tone gets purer as it fades.
+    constexpr double harmonics[] = {1.0, 0.4, 0.15};
+    /// Envelope terms below this level are left out.  It's less than the smallest step of
+    /// a 24-bit sample.
+    constexpr double negligible = 1e-8;
+    /// The number of samples in a block rendered by one thread.
+    constexpr std::size_t block_size = 1 << 15;
+    /// The level of the loudest sample: -1 dBFS.
+    constexpr double peak_level = 0.89;
+    /// The number of samples in the PCM ring buffer, about 6 seconds at 44.1 kHz.  It
+    /// must cover the longest pause between blocks.
+    constexpr std::size_t pcm_ring_size = 1 << 18;
+    /// The number of samples written to the PCM output at once.
+    constexpr std::size_t pcm_write_size = 1024;
+    /// How far ahead of the clock real-time PCM is written.
+    constexpr std::chrono::milliseconds pcm_lead(100);
+
+    /// @return The time after the start when a note is silent.
+    double length(const Audio_Note& note)
+    {
+        return std::min(note.stop - note.start + release_time(), -decay*std::log(min_level));
+    }
+
+    /// Add the partials that play a note.  Each harmonic's envelope is
+    ///     exp(-t/τ) - exp(-t(1/τ + 1/attack))
+    /// while the note is held.  After it's released, each term decays faster by
+    /// exp(-(t - held)/release).  Every term is a decaying sine, so the note is a sum of
+    /// partials.  Harmonics above the Nyquist frequency are left out.
+    void add_partials(const Audio_Note& note, double sample_rate, std::vector<Partial>& out)
+    {
+        auto held = note.stop - note.start;
+        auto end = note.start + length(note);
+        for (std::size_t k = 0; k < std::size(harmonics); ++k)
+        {
+            auto frequency = (k + 1)*note.frequency;
+            if (frequency >= 0.5*sample_rate)
+                break;
+            auto rate = (k + 1)/decay;
+            for (auto [sign, extra] : {std::pair{1.0, 0.0}, std::pair{-1.0, 1.0/attack}})
+            {
+                Partial p{note.start, std::min(note.start + held, end), note.start,
+                          frequency, sign*harmonics[k]*note.amplitude, rate + extra};
+                if (p.decay > 1.0/decay)
+                    // Cut off the attack term when it's too small to matter.
+                    p.end = std::min(p.end, note.start - std::log(negligible)/p.decay);
+                out.push_back(p);
+                auto level = p.amplitude*std::exp(-p.decay*held);
+                if (held < length(note) && std::abs(level) > negligible)
+                    out.push_back({note.start + held, end, note.start, frequency, level,
+                                   p.decay + 1.0/release});
+            }
+        }
+    }
+
+    /// Write all of the bytes, retrying partial writes.  Throws Audio_Not_Written on error.
+    void write_all(int fd, const void* data, std::size_t size)
+    {
+        auto p = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            auto n = ::write(fd, p, size);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw Audio_Not_Written(std::strerror(errno));
+            }
+            p += n;
+            size -= n;
+        }
+    }
+
+    /// Append a little-endian value to a buffer.
+    void put_le(std::string& out, std::uint32_t x, std::size_t bytes)
+    {
+        for (std::size_t i = 0; i < bytes; ++i)
+            out.push_back(static_cast<char>((x >> 8*i) & 0xff));
+    }
+}
+
+double midi_frequency(double note)
+{
+    return 440.0*std::pow(2.0, (note - 69.0)/12.0);
+}
+
+double release_time()
+{
+    return release_length*release;
+}
+
+void render_blocks(std::span<float> samples, unsigned threads,
+                   const std::function<void(std::size_t, std::span<float>)>& render)
+{
+    // Each thread takes the next block until they're all done.
+    auto blocks = (samples.size() + block_size - 1)/block_size;
+    std::atomic<std::size_t> next = 0;
+    auto work = [&] {
+        for (auto b = next++; b < blocks; b = next++)
+        {
+            auto first = b*block_size;
+            render(first, samples.subspan(first, std::min(block_size, samples.size() - first)));
+        }
+    };
+    auto& pool = Thread_Pool::current();
+    if (threads == 0)
+        threads = pool.concurrency();
+    pool.parallel_for(std::min<std::size_t>(threads, blocks), [&](std::size_t) { work(); });
+}
+
+void normalize(std::span<float> samples)
+{
+    float peak = 0.0f;
+    for (auto x : samples)
+        peak = std::max(peak, std::abs(x));
+    if (peak > 0.0f)
+        for (auto& x : samples)
+            x *= peak_level/peak;
+}
+
+std::vector<float> render_notes(std::span<const Audio_Note> notes, unsigned sample_rate,
+                                unsigned threads)
+{
+    double end = 0.0;
+    std::vector<Partial> partials;
+    for (const auto& n : notes)
+    {
+        end = std::max(end, n.start + length(n));
+        add_partials(n, sample_rate, partials);
+    }
+    std::vector<float> samples(static_cast<std::size_t>(std::ceil(end*sample_rate)));
+
+    render_blocks(samples, threads, [&](std::size_t first, std::span<float> out) {
+        auto t1 = double(first)/sample_rate;
+        auto t2 = double(first + out.size())/sample_rate;
+        std::vector<Partial> sounding;
+        std::copy_if(partials.begin(), partials.end(), std::back_inserter(sounding),
+                     [&](const auto& p) { return p.begin < t2 && p.end > t1; });
+        render_partials(sounding, sample_rate, first, out);
+    });
+    normalize(samples);
+    return samples;
+}
+
+Audio_Stream::Audio_Stream(unsigned sample_rate)
+    : m_sample_rate(sample_rate)
+{}
+
+std::size_t Audio_Stream::start(double time, double frequency, double amplitude)
+{
+    // The stop time isn't known yet.  Until it is, the note is held until it decays.
+    m_notes[m_next_id] = {time, std::numeric_limits<double>::infinity(), frequency, amplitude};
+    return m_next_id++;
+}
+
+void Audio_Stream::stop(std::size_t id, double time)
+{
+    if (auto it = m_notes.find(id); it != m_notes.end())
+        it->second.stop = time;
+}
+
+void Audio_Stream::render(std::span<float> out)
+{
+    std::fill(out.begin(), out.end(), 0.0f);
+    m_partials.clear();
+    for (const auto& [id, note] : m_notes)
+        add_partials(note, m_sample_rate, m_partials);
+    render_partials(m_partials, m_sample_rate, m_position, out);
+    m_position += out.size();
+    std::erase_if(m_notes, [this](const auto& entry) {
+        const auto& note = entry.second;
+        return (note.start + length(note))*m_sample_rate <= m_position;
+    });
+}
+
+std::size_t Audio_Stream::position() const
+{
+    return m_position;
+}
+
+bool Audio_Stream::sounding() const
+{
+    return !m_notes.empty();
+}
+
+Pcm_Stats play_pcm(Generator<std::span<const float>> blocks, int fd, unsigned sample_rate,
+                   double gain, bool real_time)
+{
+    using Clock = std::chrono::steady_clock;
+
+    Spsc_Ring<std::int16_t> ring(pcm_ring_size);
+    std::atomic<bool> done = false; ///< Set by the producer when it's finished.
+    std::atomic<bool> quit = false; ///< Set by the writer if it can't go on.
+    std::exception_ptr error;
+    std::jthread producer([&] {
+        try
+        {
+            std::vector<std::int16_t> pcm;
+            for (auto block : blocks)
+            {
+                pcm.clear();
+                for (auto x : block)
+                    pcm.push_back(std::lround(std::clamp(gain*x, -1.0, 1.0)*32767.0));
+                for (std::span<const std::int16_t> rest(pcm); !rest.empty() && !quit;)
+                {
+                    rest = rest.subspan(ring.push(rest));
+                    if (!rest.empty())
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                if (quit)
+                    break;
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        done = true;
+    });
+
+    Pcm_Stats stats;
+    stats.capacity = ring.capacity();
+    std::vector<std::int16_t> buffer(pcm_write_size);
+    // Start the clock when there's something to play so the time spent composing the
+    // first segment doesn't count as an underrun.
+    while (ring.size() < pcm_write_size && !done)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    // The time when a sample is played.
+    auto start = Clock::now();
+    auto play_time = [&](std::size_t sample) {
+        return start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(double(sample)/sample_rate));
+    };
+    try
+    {
+        while (true)
+        {
+            if (real_time)
+                std::this_thread::sleep_until(play_time(stats.samples) - pcm_lead);
+            stats.max_fill = std::max(stats.max_fill, ring.size());
+            // Check before popping so samples pushed just before the end aren't missed.
+            bool finished = done;
+            auto n = ring.pop(buffer);
+            if (n == 0)
+            {
+                if (finished)
+                    break;
+                if (!real_time || Clock::now() < play_time(stats.samples))
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    continue;
+                }
+                // The output is about to run dry.  Keep it going with silence.
+                ++stats.underruns;
+                std::fill(buffer.begin(), buffer.end(), 0);
+                n = buffer.size();
+            }
+            if constexpr (std::endian::native == std::endian::big)
+                for (std::size_t i = 0; i < n; ++i)
+                    buffer[i] = static_cast<std::int16_t>(
+                        (std::uint16_t(buffer[i]) << 8) | (std::uint16_t(buffer[i]) >> 8));
+            write_all(fd, buffer.data(), n*sizeof(std::int16_t));
+            stats.samples += n;
+        }
+    }
+    catch (...)
+    {
+        quit = true;
+        throw;
+    }
+    producer.join();
+    if (error)
+        std::rethrow_exception(error);
+    return stats;
+}
+
+void write_wav(std::ostream& os, std::span<const float> samples, unsigned sample_rate,
+               unsigned bits)
+{
+    if (bits != 16 && bits != 24)
+        throw Bad_Audio_Format(std::to_string(bits) + "-bit samples");
+    const std::uint32_t bytes = bits/8;
+    const std::uint32_t data_size = samples.size()*bytes;
+
+    std::string out;
+    out.reserve(44 + data_size);
+    out.append("RIFF");
+    put_le(out, 36 + data_size, 4);
+    out.append("WAVEfmt ");
+    put_le(out, 16, 4); // Format chunk size
+    put_le(out, 1, 2); // PCM
+    put_le(out, 1, 2); // Mono
+    put_le(out, sample_rate, 4);
+    put_le(out, sample_rate*bytes, 4); // Bytes per second
+    put_le(out, bytes, 2); // Bytes per sample frame
+    put_le(out, bits, 2);
+    out.append("data");
+    put_le(out, data_size, 4);
+
+    const double full_scale = (1 << (bits - 1)) - 1;
+    for (auto x : samples)
+    {
+        auto q = std::lround(std::clamp(double(x), -1.0, 1.0)*full_scale);
+        put_le(out, static_cast<std::uint32_t>(q), bytes);
+    }
+    os.write(out.data(), out.size());
+}
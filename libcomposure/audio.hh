@@ -0,0 +1,146 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_AUDIO_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_AUDIO_HH_INCLUDED
+
+#include "generator.hh"
+#include "oscillator.hh"
+
+#include <cstddef>
+#include <functional>
+#include <iosfwd>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Exception thrown for an unsupported WAV sample format.
+class Bad_Audio_Format : public std::runtime_error
+{
+public:
+    Bad_Audio_Format(const std::string& what)
+        : std::runtime_error("Bad audio format: " + what)
+    {}
+};
+
+/// Exception thrown when real-time audio can't be written.
+class Audio_Not_Written : public std::runtime_error
+{
+public:
+    Audio_Not_Written(const std::string& what)
+        : std::runtime_error("Audio not written: " + what)
+    {}
+};
+
+/// A note to be rendered as audio.
+struct Audio_Note
+{
+    double start; ///< seconds
+    double stop; ///< seconds, when the key is released.
+    double frequency; ///< Hz
+    double amplitude; ///< 0 to 1
+};
+
+/// @return The frequency in Hz of a MIDI note number with A above middle C at 440 Hz.
+double midi_frequency(double note);
+
+/// @return The time in seconds that a note keeps sounding after its stop time.
+double release_time();
+
+/// Split samples into blocks of time and render them in parallel on the current thread
+/// pool.  Each task takes the next block until they're all done.
+/// @param threads The most blocks rendered at once.  0 for the pool's concurrency.
+/// @param render Called with the index of the first sample of a block and the block's
+///     samples.  It's called concurrently, so it must only write to the block.
+void render_blocks(std::span<float> samples, unsigned threads,
+                   const std::function<void(std::size_t, std::span<float>)>& render);
+
+/// Scale samples so the peak is at -1 dBFS.  Silence is left alone.
+void normalize(std::span<float> samples);
+
+/// Render notes with a plucked voice: a few harmonics that decay exponentially, the higher
+/// ones faster, so the tone gets purer as it fades.  The notes are played by the
+/// oscillator bank in oscillator.hh.  The output is split into blocks of time that are
+/// rendered in parallel.
+/// Each sample only depends on the notes, so the result doesn't depend on the number of
+/// threads.  The mix is scaled so the peak is at -1 dBFS.
+/// @param threads The most blocks rendered at once.  0 for the pool's concurrency.
+/// @return Mono samples from -1 to 1, up to the end of the last note's release.
+std::vector<float> render_notes(std::span<const Audio_Note> notes, unsigned sample_rate,
+                                unsigned threads = 0);
+
+/// Render notes block by block as they're played.  Notes are started without knowing
+/// when they'll stop, so the output can be produced before the whole piece is known.  The
+/// samples match the ones render_notes() gives, before normalization, up to rounding.
+class Audio_Stream
+{
+public:
+    Audio_Stream(unsigned sample_rate);
+
+    /// Start a note.  It sounds until stop() is called or it decays.  Notes can't start
+    /// before the samples that have already been rendered.
+    /// @return An ID for stop().
+    std::size_t start(double time, double frequency, double amplitude);
+    /// Release a note.  Does nothing if the note has already decayed.
+    void stop(std::size_t id, double time);
+    /// Render the next out.size() samples.
+    void render(std::span<float> out);
+    /// @return The number of samples rendered so far.
+    std::size_t position() const;
+    /// @return True if any note is sounding at the current position.
+    bool sounding() const;
+
+private:
+    unsigned m_sample_rate;
+    std::size_t m_position = 0;
+    std::size_t m_next_id = 0;
+    /// Notes that are still sounding, by ID.
+    std::unordered_map<std::size_t, Audio_Note> m_notes;
+    std::vector<Partial> m_partials; ///< Scratch space for the sounding partials.
+};
+
+/// Statistics from play_pcm().
+struct Pcm_Stats
+{
+    std::size_t samples = 0; ///< The number of samples written.
+    /// The number of times the ring buffer was empty when the output needed samples.
+    /// Silence was written instead.
+    std::size_t underruns = 0;
+    std::size_t max_fill = 0; ///< The most samples waiting in the ring buffer.
+    std::size_t capacity = 0; ///< The size of the ring buffer.
+};
+
+/// Write blocks of samples as raw signed 16-bit little-endian PCM.  The blocks are pulled
+/// from the generator on a separate thread, so work done between blocks, such as
+/// composing the next segment, runs while the buffered samples are written.  The
+/// threads communicate through a lock-free ring buffer that holds a few seconds of audio.
+/// Throws Audio_Not_Written if a write fails, e.g. if the reader of a pipe goes away.
+/// @param fd Where to write, e.g. standard output or a named pipe.
+/// @param gain Samples are multiplied by this, then clipped to full scale.
+/// @param real_time If true, samples are written at the pace they're played, a little
+///     ahead of the clock.  If the ring buffer runs dry, silence is written to keep the
+///     output going.  Otherwise, samples are written as fast as they're rendered.
+Pcm_Stats play_pcm(Generator<std::span<const float>> blocks, int fd, unsigned sample_rate,
+                   double gain, bool real_time = true);
+
+/// Write mono samples as a PCM WAV file.  The file is built in memory and written with a
+/// single call.  Throws Bad_Audio_Format if bits isn't 16 or 24.
+/// @param samples Values from -1 to 1.  Values outside are clipped.
+void write_wav(std::ostream& os, std::span<const float> samples, unsigned sample_rate,
+               unsigned bits);
+
+#endif // COMPOSURE_COMPOSURE_AUDIO_HH_INCLUDED
@@ -0,0 +1,288 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "cache.hh"
+#include "midi.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    /// Identifies a cache file.
+    constexpr std::uint32_t cache_magic = 0x434d5043; // "CMPC"
+    /// Incremented when the layout of the cache file changes.
+    constexpr std::uint16_t cache_format = 1;
+    /// The sizes of a pass record and a note in the file.
+    constexpr std::size_t pass_bytes = 24;
+    constexpr std::size_t note_bytes = 36;
+
+    void write_double(std::ostream& os, double x)
+    {
+        write_be(os, std::bit_cast<std::uint64_t>(x));
+    }
+
+    /// @return The time in beats at the end of the last note.
+    double end_beats(std::span<const Note> notes)
+    {
+        return notes.empty() ? 0.0 : notes.back().time + notes.back().duration;
+    }
+
+    double read_double(std::istream& is)
+    {
+        return std::bit_cast<double>(read_be<std::uint64_t>(is));
+    }
+
+    /// @return The 64-bit FNV-1a hash of a string.  Unlike std::hash, it's the same for
+    /// every build, so cache files stay valid across compilers.
+    std::uint64_t fnv1a(const std::string& s)
+    {
+        std::uint64_t hash = 0xcbf29ce484222325;
+        for (auto c : s)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 0x100000001b3;
+        }
+        return hash;
+    }
+
+    /// @return The number of bytes from the read position to the end of the stream, or
+    /// the largest size if the stream can't seek.
+    std::size_t bytes_left(std::istream& is)
+    {
+        auto here = is.tellg();
+        if (here < 0)
+            return std::numeric_limits<std::size_t>::max();
+        is.seekg(0, std::ios::end);
+        auto end = is.tellg();
+        is.seekg(here);
+        return end < here ? 0 : static_cast<std::size_t>(end - here);
+    }
+}
+
+void write_cache_entry(std::ostream& os, const std::string& key, const Cache_Entry& entry)
+{
+    write_be(os, cache_magic);
+    write_be(os, cache_format);
+    write_be(os, std::uint32_t(key.size()));
+    os.write(key.data(), key.size());
+
+    write_be(os, std::uint32_t(entry.passes.size()));
+    for (const auto& p : entry.passes)
+    {
+        write_be(os, std::uint32_t(p.compose_size));
+        write_double(os, p.compose_beats);
+        write_be(os, std::uint32_t(p.edit_size));
+        write_double(os, p.edit_beats);
+    }
+
+    write_be(os, std::uint32_t(entry.notes.size()));
+    for (const auto& n : entry.notes)
+    {
+        write_double(os, n.time);
+        write_double(os, n.duration);
+        write_double(os, n.volume);
+        write_double(os, n.pitch);
+        write_be(os, std::uint32_t(n.generation));
+    }
+}
+
+std::optional<Cache_Entry> read_cache_entry(std::istream& is, const std::string& key)
+{
+    if (read_be<std::uint32_t>(is) != cache_magic
+        || read_be<std::uint16_t>(is) != cache_format
+        || read_be<std::uint32_t>(is) != key.size())
+        return std::nullopt;
+    std::string file_key(key.size(), '\0');
+    is.read(file_key.data(), file_key.size());
+    if (!is || file_key != key)
+        return std::nullopt;
+
+    // Reject counts that are larger than the rest of the file before allocating.
+    Cache_Entry entry;
+    auto passes = read_be<std::uint32_t>(is);
+    if (!is || passes > bytes_left(is)/pass_bytes)
+        return std::nullopt;
+    entry.passes.resize(passes);
+    for (auto& p : entry.passes)
+    {
+        p.compose_size = read_be<std::uint32_t>(is);
+        p.compose_beats = read_double(is);
+        p.edit_size = read_be<std::uint32_t>(is);
+        p.edit_beats = read_double(is);
+    }
+
+    auto size = read_be<std::uint32_t>(is);
+    if (!is || size > bytes_left(is)/note_bytes)
+        return std::nullopt;
+    entry.notes.reserve(size);
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        auto time = read_double(is);
+        auto duration = read_double(is);
+        auto volume = read_double(is);
+        auto pitch = read_double(is);
+        auto generation = static_cast<int>(read_be<std::uint32_t>(is));
+        entry.notes.emplace_back(time, duration, volume, pitch, generation);
+    }
+    if (!is)
+        return std::nullopt;
+    return entry;
+}
+
+Composition_Cache::Composition_Cache(const fs::path& dir)
+    : m_dir(dir)
+{
+    fs::create_directories(m_dir);
+}
+
+fs::path Composition_Cache::path(const std::string& key) const
+{
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << fnv1a(key) << ".cache";
+    return m_dir / name.str();
+}
+
+std::optional<Cache_Entry> Composition_Cache::load(const std::string& key) const
+{
+    std::ifstream is(path(key), std::ios::binary);
+    if (!is)
+        return std::nullopt;
+    return read_cache_entry(is, key);
+}
+
+bool Composition_Cache::store(const std::string& key, const Cache_Entry& entry) const
+{
+    // Write to a temporary file and rename so that a concurrent reader never sees a
+    // partial entry.  The temporary file's name is unique so that writers of the same
+    // entry in other processes or threads don't write to the same file.
+    static std::atomic<unsigned> count = 0;
+    auto file = path(key);
+    auto temp = file;
+    temp += ".tmp." + std::to_string(::getpid()) + '.' + std::to_string(count++);
+    {
+        std::ofstream os(temp, std::ios::binary);
+        write_cache_entry(os, key, entry);
+        if (!os)
+            return false;
+    }
+    std::error_code ec;
+    fs::rename(temp, file, ec);
+    return !ec;
+}
+
+Cache_Entry Shared_Composer::compose(const std::string& key, int passes,
+                                     const Compose_Settings& settings)
+{
+    if (passes <= 0)
+        return {};
+
+    std::unique_lock lock(m_mutex);
+    auto& run = m_runs[key];
+    if (run)
+        ++m_shared;
+    else
+    {
+        run = std::make_shared<Run>();
+        run->random = random_state();
+    }
+    auto current = run;
+    current->target = std::max(current->target, passes);
+    while (true)
+    {
+        m_progress.wait(lock, [&] {
+            return current->error || current->snapshots.size() >= std::size_t(passes)
+                || !current->composing;
+        });
+        if (current->error)
+            std::rethrow_exception(current->error);
+        if (current->snapshots.size() >= std::size_t(passes))
+            break;
+        // No one is composing and this request needs more passes.
+        current->composing = true;
+        lock.unlock();
+        run_passes(key, *current, passes, settings);
+        lock.lock();
+    }
+    return {{current->passes.begin(), current->passes.begin() + passes},
+            current->snapshots[passes - 1]};
+}
+
+std::size_t Shared_Composer::shared() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_shared;
+}
+
+void Shared_Composer::run_passes(const std::string& key, Run& run, int passes,
+                                 const Compose_Settings& settings)
+{
+    auto caller_random = random_state();
+    set_random_state(run.random);
+    try
+    {
+        if (!run.phrase)
+            run.phrase.emplace(settings.tempo, &run.memory);
+        auto& composition = *run.phrase;
+        while (true)
+        {
+            {
+                std::lock_guard lock(m_mutex);
+                if (run.snapshots.size() >= std::size_t(passes))
+                {
+                    // Hand off to a waiting request that needs more, if any.  Requests
+                    // that find the run after it's removed start a new one.
+                    run.random = random_state();
+                    run.composing = false;
+                    if (run.snapshots.size() >= std::size_t(run.target))
+                        m_runs.erase(key);
+                    break;
+                }
+            }
+            Pass_Record pass;
+            composition.compose(settings.voices, settings.max_range, settings.chromatic,
+                                settings.budget);
+            pass.compose_size = composition.notes().size();
+            pass.compose_beats = end_beats(composition.notes());
+            composition.edit();
+            pass.edit_size = composition.notes().size();
+            pass.edit_beats = end_beats(composition.notes());
+            std::vector<Note> snapshot(composition.notes().begin(), composition.notes().end());
+            {
+                std::lock_guard lock(m_mutex);
+                run.passes.push_back(pass);
+                run.snapshots.push_back(std::move(snapshot));
+            }
+            m_progress.notify_all();
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard lock(m_mutex);
+        run.error = std::current_exception();
+        m_runs.erase(key);
+    }
+    m_progress.notify_all();
+    set_random_state(caller_random);
+}
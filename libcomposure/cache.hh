@@ -0,0 +1,136 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_CACHE_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_CACHE_HH_INCLUDED
+
+#include "phrase.hh"
+#include "random.hh"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+/// The size of the phrase after the compose and edit steps of a pass.
+struct Pass_Record
+{
+    std::size_t compose_size; ///< Number of notes after compose().
+    double compose_beats; ///< End of the last note after compose().
+    std::size_t edit_size; ///< Number of notes after edit().
+    double edit_beats; ///< End of the last note after edit().
+};
+
+/// The result of a complete set of compose/edit passes.
+struct Cache_Entry
+{
+    std::vector<Pass_Record> passes;
+    std::vector<Note> notes;
+};
+
+/// Write an entry in the binary cache format.  The key is stored so that a lookup can
+/// reject a file that belongs to a different key with the same hash.
+void write_cache_entry(std::ostream& os, const std::string& key, const Cache_Entry& entry);
+/// @return The entry read from the stream, or no value if the stream is not a cache
+/// entry for key.  A truncated or corrupt entry gives no value.
+std::optional<Cache_Entry> read_cache_entry(std::istream& is, const std::string& key);
+
+/// A directory of composed phrases.  Entries are addressed by a hash of a key that
+/// describes everything that affects composition.  Tempo and the monophonic option only
+/// affect rendering, so they are not part of the key.
+class Composition_Cache
+{
+public:
+    /// @param dir The cache directory.  It's created if it doesn't exist.
+    Composition_Cache(const std::filesystem::path& dir);
+
+    /// @return The cached entry for key, or no value if there isn't one.
+    std::optional<Cache_Entry> load(const std::string& key) const;
+    /// Add an entry to the cache, replacing any existing entry for key.
+    /// @return True if the entry was written.
+    bool store(const std::string& key, const Cache_Entry& entry) const;
+
+    /// @return The file where the entry for key is stored.
+    std::filesystem::path path(const std::string& key) const;
+
+private:
+    std::filesystem::path m_dir;
+};
+
+/// The settings for a series of compose/edit passes.
+struct Compose_Settings
+{
+    double tempo;
+    int voices;
+    int max_range; ///< See Phrase::compose().
+    bool chromatic;
+    Note_Budget budget;
+};
+
+/// Runs compose/edit passes and shares them between threads.  Each pass continues from
+/// the one before, so the result of n passes is a snapshot of any longer run.  While
+/// passes are running for a key, another request for the same key waits for the pass it
+/// needs instead of composing again.  Each request returns as soon as its pass is done.
+/// If a waiting request needs more passes than the one composing, it takes over the
+/// phrase and continues.  Requests that come after the last pass start a new run.
+class Shared_Composer
+{
+public:
+    /// @return The result of the given number of passes.  A new run starts from the
+    ///     calling thread's random number generator, which must be in the state the key
+    ///     describes.  Passes that run on the calling thread continue the run's sequence,
+    ///     and the thread's generator is restored afterward.
+    /// @param key Describes the random number state and settings.  Requests with the same
+    ///     key must have the same settings.
+    Cache_Entry compose(const std::string& key, int passes, const Compose_Settings& settings);
+
+    /// @return The number of requests that were answered from another request's passes.
+    std::size_t shared() const;
+
+private:
+    /// Passes running for a key.
+    struct Run
+    {
+        int target = 0; ///< The most passes needed so far.
+        bool composing = false; ///< True while a thread is running passes.
+        std::vector<Pass_Record> passes;
+        std::vector<std::vector<Note>> snapshots; ///< The notes after each pass.
+        std::exception_ptr error;
+        /// The state of the run, handed from thread to thread.  The phrase's memory is
+        /// released with the run.
+        Random_State random;
+        std::pmr::monotonic_buffer_resource memory;
+        std::optional<Phrase> phrase;
+    };
+
+    /// Run passes on the calling thread until there are at least the given number.
+    void run_passes(const std::string& key, Run& run, int passes,
+                    const Compose_Settings& settings);
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_progress; ///< Notified after each pass and each hand-off.
+    std::map<std::string, std::shared_ptr<Run>> m_runs; ///< Runs in progress by key.
+    std::size_t m_shared = 0;
+};
+
+#endif // COMPOSURE_COMPOSURE_CACHE_HH_INCLUDED
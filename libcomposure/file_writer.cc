@@ -0,0 +1,477 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "file_writer.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+    /// The number of submission queue entries.  Each file has one operation in flight at
+    /// a time, and one entry is kept for the wake-up read.
+    constexpr unsigned ring_entries = 64;
+    /// The number of fallback threads.  Small writes mostly wait on the file system, so a
+    /// few threads keep it busy without using a core each.
+    constexpr unsigned blocking_threads = 4;
+    constexpr int open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    constexpr mode_t open_mode = 0644;
+
+    /// Write a whole file with blocking calls.
+    /// @return The reason it failed, or empty on success.
+    std::string write_blocking(const std::string& file, const std::string& data)
+    {
+        auto fd = ::open(file.c_str(), open_flags, open_mode);
+        if (fd < 0)
+            return std::strerror(errno);
+        for (std::size_t written = 0; written < data.size();)
+        {
+            auto n = ::write(fd, data.data() + written, data.size() - written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                std::string error = std::strerror(errno);
+                ::close(fd);
+                return error;
+            }
+            written += n;
+        }
+        return ::close(fd) == 0 ? "" : std::strerror(errno);
+    }
+}
+
+/// A minimal io_uring set up with raw system calls, so liburing isn't needed.  Only used
+/// by the I/O thread.
+class File_Writer::Ring
+{
+public:
+    /// Throws std::runtime_error if io_uring isn't available or doesn't support the
+    /// operations used.
+    Ring()
+    {
+        io_uring_params params{};
+        m_fd = ::syscall(__NR_io_uring_setup, ring_entries, &params);
+        if (m_fd < 0)
+            throw std::runtime_error(std::strerror(errno));
+        try
+        {
+            map(params);
+            check_ops();
+        }
+        catch (...)
+        {
+            unmap();
+            ::close(m_fd);
+            throw;
+        }
+    }
+    ~Ring()
+    {
+        unmap();
+        ::close(m_fd);
+    }
+
+    /// @return An entry to fill in, or nullptr if the queue is full.  The entry is
+    ///     submitted by the next call to enter().
+    io_uring_sqe* get_sqe()
+    {
+        auto head = std::atomic_ref(*m_sq_head).load(std::memory_order_acquire);
+        if (m_sq_tail - head >= m_sq_entries)
+            return nullptr;
+        auto index = m_sq_tail & *m_sq_mask;
+        m_sq_array[index] = index;
+        auto* sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof *sqe);
+        ++m_sq_tail;
+        ++m_to_submit;
+        return sqe;
+    }
+
+    /// Submit the new entries and wait for at least one completion.
+    void enter()
+    {
+        std::atomic_ref(*m_sq_tail_shared).store(m_sq_tail, std::memory_order_release);
+        while (::syscall(__NR_io_uring_enter, m_fd, m_to_submit, 1, IORING_ENTER_GETEVENTS,
+                         nullptr, 0) < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                throw std::runtime_error(std::strerror(errno));
+        }
+        m_to_submit = 0;
+    }
+
+    /// Wait a while for a completion without submitting.  Used after enter() fails, when
+    /// operations may still be in flight.
+    void wait()
+    {
+        pollfd ring{m_fd, POLLIN, 0};
+        ::poll(&ring, 1, 100);
+    }
+
+    /// @return The number of entries the kernel hasn't taken from the submission queue.
+    ///     They won't run unless enter() is called again.
+    unsigned unsubmitted() const
+    {
+        return m_sq_tail - std::atomic_ref(*m_sq_head).load(std::memory_order_acquire);
+    }
+
+    /// Call f(const io_uring_cqe&) for each completion.
+    template <typename F> void reap(F&& f)
+    {
+        auto head = *m_cq_head;
+        auto tail = std::atomic_ref(*m_cq_tail).load(std::memory_order_acquire);
+        for (; head != tail; ++head)
+        {
+            // Copy the entry so f() can add entries.
+            auto cqe = m_cqes[head & *m_cq_mask];
+            std::atomic_ref(*m_cq_head).store(head + 1, std::memory_order_release);
+            f(cqe);
+        }
+    }
+
+private:
+    void map(const io_uring_params& params)
+    {
+        m_sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+        m_cq_size = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+        m_sq_ptr = ::mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sq_ptr == MAP_FAILED)
+            throw std::runtime_error(std::strerror(errno));
+        m_cq_ptr = single ? m_sq_ptr
+            : ::mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED)
+            throw std::runtime_error(std::strerror(errno));
+        m_sqes_size = params.sq_entries*sizeof(io_uring_sqe);
+        auto sqes = ::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            throw std::runtime_error(std::strerror(errno));
+        m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+        auto sq = static_cast<char*>(m_sq_ptr);
+        m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_sq_tail_shared = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        m_sq_entries = params.sq_entries;
+        m_sq_tail = *m_sq_tail_shared;
+        auto cq = static_cast<char*>(m_cq_ptr);
+        m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    void unmap()
+    {
+        if (m_sqes)
+            ::munmap(m_sqes, m_sqes_size);
+        if (m_cq_ptr && m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+            ::munmap(m_cq_ptr, m_cq_size);
+        if (m_sq_ptr && m_sq_ptr != MAP_FAILED)
+            ::munmap(m_sq_ptr, m_sq_size);
+    }
+
+    /// Throw if the kernel doesn't have the operations used.  They came in Linux 5.6.
+    void check_ops()
+    {
+        constexpr unsigned ops = 256;
+        std::vector<char> buffer(sizeof(io_uring_probe) + ops*sizeof(io_uring_probe_op));
+        auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, ops) < 0)
+            throw std::runtime_error(std::strerror(errno));
+        for (auto op : {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_READ})
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                throw std::runtime_error("unsupported operation");
+    }
+
+    int m_fd;
+    void* m_sq_ptr = nullptr;
+    void* m_cq_ptr = nullptr;
+    std::size_t m_sq_size = 0;
+    std::size_t m_cq_size = 0;
+    std::size_t m_sqes_size = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    // Pointers into the shared rings.
+    unsigned* m_sq_head = nullptr;
+    unsigned* m_sq_tail_shared = nullptr;
+    unsigned* m_sq_mask = nullptr;
+    unsigned* m_sq_array = nullptr;
+    unsigned* m_cq_head = nullptr;
+    unsigned* m_cq_tail = nullptr;
+    unsigned* m_cq_mask = nullptr;
+    io_uring_cqe* m_cqes = nullptr;
+    unsigned m_sq_entries = 0;
+    unsigned m_sq_tail = 0; ///< The tail including entries that aren't published yet.
+    unsigned m_to_submit = 0;
+};
+
+File_Writer::File_Writer(Backend backend)
+{
+    if (backend == Backend::io_uring)
+    {
+        try
+        {
+            m_ring = std::make_unique<Ring>();
+            m_wake = ::eventfd(0, EFD_CLOEXEC);
+            if (m_wake < 0)
+                m_ring.reset();
+        }
+        catch (const std::runtime_error&)
+        {
+            // Not available.  Fall back to threads.
+        }
+    }
+    if (m_ring)
+        m_threads.emplace_back([this] { run_ring(); });
+    else
+        for (unsigned i = 0; i < blocking_threads; ++i)
+            m_threads.emplace_back([this] { run_blocking(); });
+}
+
+File_Writer::~File_Writer()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_queued.notify_all();
+    if (m_wake >= 0)
+    {
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto n = ::write(m_wake, &one, sizeof one);
+    }
+    m_threads.clear();
+    if (m_wake >= 0)
+        ::close(m_wake);
+}
+
+void File_Writer::write(std::string file, std::string data)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_queue.push_back(std::make_unique<Job>(Job{std::move(file), std::move(data)}));
+        ++m_pending;
+    }
+    m_queued.notify_one();
+    if (m_ring)
+    {
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto n = ::write(m_wake, &one, sizeof one);
+    }
+}
+
+void File_Writer::wait()
+{
+    std::unique_lock lock(m_mutex);
+    m_done.wait(lock, [this] { return m_pending == 0; });
+    if (m_errors.empty())
+        return;
+    auto [file, error] = m_errors.front();
+    m_errors.clear();
+    throw Output_Not_Written(file, error);
+}
+
+File_Writer::Backend File_Writer::backend() const
+{
+    return m_ring ? Backend::io_uring : Backend::threads;
+}
+
+void File_Writer::finish(const Job& job, const std::string& error)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        if (!error.empty())
+            m_errors.emplace_back(job.file, error);
+        if (--m_pending > 0)
+            return;
+    }
+    m_done.notify_all();
+}
+
+void File_Writer::run_blocking()
+{
+    while (true)
+    {
+        std::unique_ptr<Job> job;
+        {
+            std::unique_lock lock(m_mutex);
+            m_queued.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+            if (m_queue.empty())
+                return;
+            job = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        finish(*job, write_blocking(job->file, job->data));
+    }
+}
+
+void File_Writer::run_ring()
+{
+    // Each job moves from open to write to close.  The user data of an entry is the
+    // job's address.  0 is the read of the wake-up eventfd.
+    enum class Stage { open, write, close };
+    std::map<Job*, std::pair<std::unique_ptr<Job>, Stage>> active;
+    std::uint64_t wake_count;
+    auto& ring = *m_ring;
+
+    auto read_wake = [&] {
+        auto sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = m_wake;
+        sqe->addr = reinterpret_cast<std::uintptr_t>(&wake_count);
+        sqe->len = sizeof wake_count;
+        sqe->user_data = 0;
+    };
+    auto submit = [&](Job* job, Stage stage) {
+        auto sqe = ring.get_sqe();
+        active[job].second = stage;
+        sqe->user_data = reinterpret_cast<std::uintptr_t>(job);
+        switch (stage)
+        {
+        case Stage::open:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<std::uintptr_t>(job->file.c_str());
+            sqe->len = open_mode;
+            sqe->open_flags = open_flags;
+            break;
+        case Stage::write:
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = job->fd;
+            sqe->addr = reinterpret_cast<std::uintptr_t>(job->data.data() + job->written);
+            sqe->len = job->data.size() - job->written;
+            sqe->off = job->written;
+            break;
+        case Stage::close:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = job->fd;
+            break;
+        }
+    };
+    auto fail = [&](Job* job, int error) {
+        if (job->fd >= 0)
+            ::close(job->fd);
+        finish(*job, std::strerror(error));
+        active.erase(job);
+    };
+
+    read_wake();
+    try
+    {
+        while (true)
+        {
+            {
+                // Start queued jobs while there's room in the ring.
+                std::lock_guard lock(m_mutex);
+                while (!m_queue.empty() && active.size() + 1 < ring_entries)
+                {
+                    auto job = m_queue.front().get();
+                    active[job].first = std::move(m_queue.front());
+                    m_queue.pop_front();
+                    submit(job, Stage::open);
+                }
+                if (m_stopping && m_queue.empty() && active.empty())
+                    return;
+            }
+            ring.enter();
+            ring.reap([&](const io_uring_cqe& cqe) {
+                if (cqe.user_data == 0)
+                {
+                    read_wake();
+                    return;
+                }
+                auto job = reinterpret_cast<Job*>(cqe.user_data);
+                auto stage = active[job].second;
+                // The descriptor is released even if the close fails.
+                if (stage == Stage::close)
+                    job->fd = -1;
+                if (cqe.res < 0)
+                    return fail(job, -cqe.res);
+                switch (stage)
+                {
+                case Stage::open:
+                    job->fd = cqe.res;
+                    submit(job, job->data.empty() ? Stage::close : Stage::write);
+                    break;
+                case Stage::write:
+                    // Write the rest after a short write.
+                    job->written += cqe.res;
+                    submit(job, job->written < job->data.size() ? Stage::write : Stage::close);
+                    break;
+                case Stage::close:
+                    finish(*job, "");
+                    active.erase(job);
+                    break;
+                }
+            });
+        }
+    }
+    catch (const std::runtime_error&)
+    {
+        // The ring failed.  Each active job and the wake-up read have an operation that
+        // was either never taken by the kernel or may still be running and using the
+        // job's name, data, and descriptor.  Wait for the running ones before the jobs
+        // are written again or freed.  The others never run since enter() isn't called
+        // again.
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto n = ::write(m_wake, &one, sizeof one);
+        auto running = active.size() + 1 - ring.unsubmitted();
+        while (running > 0)
+        {
+            ring.reap([&](const io_uring_cqe& cqe) {
+                --running;
+                if (cqe.user_data == 0)
+                    return;
+                auto job = reinterpret_cast<Job*>(cqe.user_data);
+                auto stage = active[job].second;
+                if (stage == Stage::open && cqe.res >= 0)
+                    job->fd = cqe.res;
+                else if (stage == Stage::close)
+                    job->fd = -1;
+            });
+            if (running > 0)
+                ring.wait();
+        }
+
+        // Write the rest of the files with blocking calls.
+        for (auto& [job, entry] : active)
+        {
+            if (job->fd >= 0)
+                ::close(job->fd);
+            finish(*job, write_blocking(job->file, job->data));
+        }
+        active.clear();
+        run_blocking();
+    }
+}
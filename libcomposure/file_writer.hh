@@ -0,0 +1,102 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_FILE_WRITER_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_FILE_WRITER_HH_INCLUDED
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// Exception thrown by File_Writer::wait() if a file couldn't be written.
+class Output_Not_Written : public std::runtime_error
+{
+public:
+    Output_Not_Written(const std::string& file, const std::string& what)
+        : std::runtime_error("Can't write " + file + ": " + what)
+    {}
+};
+
+/// Writes whole files in the background so the threads that make them don't wait for the
+/// file system.  With io_uring, a single I/O thread submits the open, write, and close of
+/// every queued file to the kernel and handles them as they complete, so many small files
+/// are in flight at once.  If io_uring isn't available, e.g. on an old kernel or in a
+/// sandbox that blocks it, a few threads write the files with blocking calls instead.
+class File_Writer
+{
+public:
+    enum class Backend
+    {
+        io_uring,
+        threads,
+    };
+
+    /// Start the I/O thread or threads.
+    /// @param backend The preferred backend.  If io_uring is asked for but isn't
+    ///     available, threads are used.
+    File_Writer(Backend backend = Backend::io_uring);
+    /// Wait for the queued files to be written.  Errors are ignored.
+    ~File_Writer();
+    File_Writer(const File_Writer&) = delete;
+    File_Writer& operator=(const File_Writer&) = delete;
+
+    /// Queue a file to be created or replaced with the given contents.  Returns right
+    /// away.  Safe to call from any thread.
+    void write(std::string file, std::string data);
+    /// Wait until every queued file is written.  Throws Output_Not_Written for the first
+    /// file that failed since the last call.
+    void wait();
+
+    /// @return The backend in use.
+    Backend backend() const;
+
+private:
+    struct Job
+    {
+        std::string file;
+        std::string data;
+        int fd = -1;
+        std::size_t written = 0;
+    };
+    class Ring;
+
+    /// The io_uring I/O thread's loop.
+    void run_ring();
+    /// A fallback thread's loop.
+    void run_blocking();
+    /// Record that a job is finished.
+    /// @param error The reason it failed, or empty on success.
+    void finish(const Job& job, const std::string& error);
+
+    std::unique_ptr<Ring> m_ring; ///< Set if io_uring is used.
+    int m_wake = -1; ///< An eventfd that tells the I/O thread there are new jobs.
+    std::mutex m_mutex;
+    std::condition_variable m_queued; ///< Notified when a job is queued.
+    std::condition_variable m_done; ///< Notified when the last pending job finishes.
+    std::deque<std::unique_ptr<Job>> m_queue; ///< Jobs that haven't been started.
+    std::size_t m_pending = 0; ///< Queued and running jobs.
+    bool m_stopping = false;
+    std::vector<std::pair<std::string, std::string>> m_errors; ///< Files and reasons.
+    std::vector<std::jthread> m_threads;
+};
+
+#endif // COMPOSURE_COMPOSURE_FILE_WRITER_HH_INCLUDED
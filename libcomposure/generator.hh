@@ -0,0 +1,134 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_GENERATOR_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_GENERATOR_HH_INCLUDED
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <optional>
+#include <utility>
+
+/// A lazy sequence of values produced by a coroutine.  The coroutine runs until its next
+/// co_yield each time the iterator is advanced.  A generator can be iterated once.
+///
+///     Generator<int> count(int n)
+///     {
+///         for (int i = 0; i < n; ++i)
+///             co_yield i;
+///     }
+template <typename T>
+class Generator
+{
+public:
+    struct promise_type
+    {
+        Generator get_return_object()
+        {
+            return Generator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(T value)
+        {
+            m_value = std::move(value);
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() { m_exception = std::current_exception(); }
+
+        std::optional<T> m_value; ///< The most recently yielded value.
+        std::exception_ptr m_exception; ///< Thrown by the coroutine body.
+    };
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    /// Input iterator over the yielded values.  Exceptions thrown by the coroutine are
+    /// rethrown when the iterator is advanced.
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = T;
+        using reference = const T&;
+        using pointer = const T*;
+
+        iterator() = default;
+        explicit iterator(Handle handle)
+            : m_handle(handle)
+        {
+            advance();
+        }
+
+        reference operator*() const { return *m_handle.promise().m_value; }
+        pointer operator->() const { return &*m_handle.promise().m_value; }
+        iterator& operator++()
+        {
+            advance();
+            return *this;
+        }
+        void operator++(int) { advance(); }
+        friend bool operator==(const iterator& it, std::default_sentinel_t)
+        {
+            return !it.m_handle || it.m_handle.done();
+        }
+
+    private:
+        void advance()
+        {
+            m_handle.resume();
+            if (m_handle.done() && m_handle.promise().m_exception)
+                std::rethrow_exception(m_handle.promise().m_exception);
+        }
+
+        Handle m_handle;
+    };
+
+    Generator(Generator&& other) noexcept
+        : m_handle(std::exchange(other.m_handle, {}))
+    {}
+    Generator& operator=(Generator&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_handle)
+                m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, {});
+        }
+        return *this;
+    }
+    Generator(const Generator&) = delete;
+    Generator& operator=(const Generator&) = delete;
+    ~Generator()
+    {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    /// Start the coroutine and run it to the first value.
+    iterator begin() { return iterator(m_handle); }
+    std::default_sentinel_t end() { return {}; }
+
+private:
+    explicit Generator(Handle handle)
+        : m_handle(handle)
+    {}
+
+    Handle m_handle;
+};
+
+#endif // COMPOSURE_COMPOSURE_GENERATOR_HH_INCLUDED
@@ -0,0 +1,60 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "mapped_file.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Mapped_File::Mapped_File(const std::filesystem::path& file)
+{
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw File_Not_Mapped(file);
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        throw File_Not_Mapped(file);
+    }
+    m_size = st.st_size;
+    // mmap() fails for zero-length mappings.  An empty file is an empty span.
+    if (m_size > 0)
+    {
+        auto p = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            ::close(fd);
+            throw File_Not_Mapped(file);
+        }
+        ::madvise(p, m_size, MADV_SEQUENTIAL);
+        m_data = static_cast<const unsigned char*>(p);
+    }
+    // The mapping stays valid after the descriptor is closed.
+    ::close(fd);
+}
+
+Mapped_File::~Mapped_File()
+{
+    if (m_data)
+        ::munmap(const_cast<unsigned char*>(m_data), m_size);
+}
+
+std::span<const unsigned char> Mapped_File::data() const
+{
+    return {m_data, m_size};
+}
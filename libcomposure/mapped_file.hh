@@ -0,0 +1,51 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_MAPPED_FILE_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_MAPPED_FILE_HH_INCLUDED
+
+#include <filesystem>
+#include <span>
+#include <stdexcept>
+
+/// Exception thrown if a file can't be opened and mapped into memory.
+class File_Not_Mapped : public std::runtime_error
+{
+public:
+    File_Not_Mapped(const std::filesystem::path& file)
+        : std::runtime_error("Can't map file: " + file.string())
+    {}
+};
+
+/// A read-only view of a whole file mapped into memory.  The mapping is released when
+/// the object is destroyed.
+class Mapped_File
+{
+public:
+    /// Map a file.  Throws File_Not_Mapped on failure.
+    Mapped_File(const std::filesystem::path& file);
+    ~Mapped_File();
+    Mapped_File(const Mapped_File&) = delete;
+    Mapped_File& operator=(const Mapped_File&) = delete;
+
+    /// @return The file's contents.
+    std::span<const unsigned char> data() const;
+
+private:
+    const unsigned char* m_data = nullptr;
+    std::size_t m_size = 0;
+};
+
+#endif // COMPOSURE_COMPOSURE_MAPPED_FILE_HH_INCLUDED
@@ -14,10 +14,79 @@
 // If not, see <http://www.gnu.org/licenses/>.
 
 #include "midi.hh"
+#include "mapped_file.hh"
+#include "ring_buffer.hh"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <cstring>
+#include <exception>
 #include <fstream>
+#include <iterator>
+#include <optional>
+#include <string_view>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+    /// Offset of the "set tempo" meta-event written by Midi_File::write_track(): the
+    /// 14-byte header chunk plus the 8-byte track chunk header.
+    constexpr off_t tempo_event_offset = 22;
+    /// Delta time, meta-event, "set tempo", and length.
+    constexpr unsigned char tempo_event[] = {0x00, 0xff, 0x51, 0x03};
+
+    /// The most messages buffered between the composer and the live writer.
+    constexpr std::size_t live_ring_size = 1 << 14;
+    /// The live writer stops sleeping this long before a deadline and spins the rest of
+    /// the way.  Sleeps can overshoot by the timer slack plus the time to be scheduled.
+    constexpr auto spin_time = std::chrono::microseconds(500);
+    /// How long the live writer waits before checking an empty ring buffer again.
+    constexpr auto poll_time = std::chrono::microseconds(100);
+    /// The time between starting the clock and the start of the performance.
+    constexpr auto start_lead = std::chrono::milliseconds(5);
+
+    /// Convert between beats per minute and µs per quarter note.
+    std::uint32_t tempo_to_us(double tempo)
+    {
+        return 60e6/tempo;
+    }
+
+    /// Wrap a file descriptor so it's closed on exit.
+    struct File_Descriptor
+    {
+        File_Descriptor(const std::filesystem::path& file, int flags)
+            : fd(::open(file.c_str(), flags))
+        {}
+        ~File_Descriptor()
+        {
+            if (fd >= 0)
+                ::close(fd);
+        }
+        int fd;
+    };
+
+    /// Read the 24-bit tempo from an open file.
+    std::uint32_t read_tempo_us(int fd, const std::filesystem::path& file)
+    {
+        unsigned char head[4];
+        unsigned char bytes[sizeof tempo_event + 3];
+        if (fd < 0
+            || ::pread(fd, head, sizeof head, 0) != sizeof head
+            || std::string_view((char*)head, 4) != "MThd"
+            || ::pread(fd, bytes, sizeof bytes, tempo_event_offset) != sizeof bytes
+            || !std::equal(tempo_event, tempo_event + sizeof tempo_event, bytes))
+            throw Unexpected_Midi_Layout(file);
+        auto us = bytes + sizeof tempo_event;
+        return (us[0] << 16) | (us[1] << 8) | us[2];
+    }
+}
 
 void write_var_be(std::ostream& os, std::uint32_t x)
 {
@@ -34,6 +103,189 @@ void write_var_be(std::ostream& os, std::uint32_t x)
     return write_be(os, std::uint8_t(x & 0x7f));
 }
 
+std::uint32_t read_var_be(std::istream& is)
+{
+    std::uint32_t x = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        auto b = read_be<std::uint8_t>(is);
+        x = (x << 7) | (b & 0x7f);
+        if (!(b & 0x80))
+            return x;
+    }
+    throw Bad_Midi_File("variable-length value too long");
+}
+
+Midi_Reader::Midi_Reader(std::span<const unsigned char> data)
+    : m_data(data)
+{
+    read_chunks();
+}
+
+Midi_Reader::Midi_Reader(const std::filesystem::path& file)
+    : m_file(std::make_unique<Mapped_File>(file)),
+      m_data(m_file->data())
+{
+    read_chunks();
+}
+
+Midi_Reader::~Midi_Reader() = default;
+
+std::uint16_t Midi_Reader::format() const
+{
+    return m_format;
+}
+
+std::uint16_t Midi_Reader::divisions() const
+{
+    return m_divisions;
+}
+
+std::size_t Midi_Reader::tracks() const
+{
+    return m_tracks.size();
+}
+
+void Midi_Reader::read_chunks()
+{
+    auto be = [](const unsigned char* p, int n) {
+        std::uint32_t x = 0;
+        for (int i = 0; i < n; ++i)
+            x = (x << 8) | p[i];
+        return x;
+    };
+    auto type = [](const unsigned char* p) {
+        return std::string_view(reinterpret_cast<const char*>(p), 4);
+    };
+
+    auto p = m_data.data();
+    auto end = p + m_data.size();
+    need(p, end, 14);
+    if (type(p) != "MThd")
+        throw Bad_Midi_File("no header chunk");
+    auto header_size = be(p + 4, 4);
+    if (header_size < 6)
+        throw Bad_Midi_File("short header chunk");
+    m_format = be(p + 8, 2);
+    auto tracks = be(p + 10, 2);
+    m_divisions = be(p + 12, 2);
+    if (m_divisions & 0x8000)
+        throw Bad_Midi_File("SMPTE time division is not supported");
+    if (m_divisions == 0)
+        throw Bad_Midi_File("zero divisions");
+    need(p, end, 8 + header_size);
+    p += 8 + header_size;
+
+    while (m_tracks.size() < tracks)
+    {
+        if (end - p < 8)
+            throw Bad_Midi_File("missing track");
+        auto size = be(p + 4, 4);
+        need(p + 8, end, size);
+        // Skip unknown chunks.
+        if (type(p) == "MTrk")
+            m_tracks.emplace_back(p + 8, size);
+        p += 8 + size;
+    }
+}
+
+std::uint32_t Midi_Reader::get_var(const unsigned char*& p, const unsigned char* end)
+{
+    std::uint32_t x = 0;
+    for (int i = 0; i < 4 && p < end; ++i)
+    {
+        auto b = *p++;
+        x = (x << 7) | (b & 0x7f);
+        if (!(b & 0x80))
+            return x;
+    }
+    throw Bad_Midi_File("bad variable-length value");
+}
+
+void Midi_Reader::need(const unsigned char* p, const unsigned char* end, std::size_t n)
+{
+    if (std::size_t(end - p) < n)
+        throw Bad_Midi_File("unexpected end of data");
+}
+
+std::vector<Midi_Note> Midi_Reader::notes() const
+{
+    // Indexes into notes for notes that have started but not stopped, by track, channel
+    // and pitch.  A repeated note-on for the same key is queued.
+    std::vector<Midi_Note> notes;
+    std::vector<std::vector<std::size_t>> sounding(16*128);
+    std::vector<std::uint32_t> track_end(m_tracks.size(), 0);
+    auto stop = [&](std::size_t i, std::uint32_t ticks) {
+        notes[i].duration = double(ticks)/m_divisions - notes[i].time;
+    };
+    auto finish_track = [&](std::size_t track) {
+        // Stop any notes left sounding at the last event in the track.
+        for (auto& queue : sounding)
+        {
+            for (auto i : queue)
+                stop(i, track_end[track]);
+            queue.clear();
+        }
+    };
+
+    std::size_t track = 0;
+    for_each_event([&](const Midi_Event& e) {
+        if (e.track != track)
+        {
+            finish_track(track);
+            track = e.track;
+        }
+        track_end[track] = e.ticks;
+        auto kind = e.status & 0xf0;
+        if (kind != 0x80 && kind != 0x90)
+            return;
+        auto channel = e.status & 0x0f;
+        auto& queue = sounding[128*channel + (e.data1 & 0x7f)];
+        if (kind == 0x90 && e.data2 > 0)
+        {
+            queue.push_back(notes.size());
+            notes.push_back({double(e.ticks)/m_divisions, 0.0, e.data1, e.data2, channel});
+        }
+        else if (!queue.empty())
+        {
+            stop(queue.front(), e.ticks);
+            queue.erase(queue.begin());
+        }
+    });
+    if (!m_tracks.empty())
+        finish_track(track);
+
+    std::stable_sort(notes.begin(), notes.end(), [](const auto& n1, const auto& n2) {
+        return n1.time < n2.time;
+    });
+    return notes;
+}
+
+std::vector<Midi_Note> read_midi_notes(std::istream& is)
+{
+    std::string data(std::istreambuf_iterator<char>(is), {});
+    return Midi_Reader({reinterpret_cast<const unsigned char*>(data.data()), data.size()})
+        .notes();
+}
+
+double read_midi_tempo(const std::filesystem::path& file)
+{
+    File_Descriptor f(file, O_RDONLY);
+    return 60e6/read_tempo_us(f.fd, file);
+}
+
+double write_midi_tempo(const std::filesystem::path& file, double tempo)
+{
+    File_Descriptor f(file, O_RDWR);
+    auto old_us = read_tempo_us(f.fd, file);
+    auto us = tempo_to_us(tempo);
+    unsigned char bytes[] = {std::uint8_t(us >> 16), std::uint8_t(us >> 8), std::uint8_t(us)};
+    if (::pwrite(f.fd, bytes, sizeof bytes, tempo_event_offset + sizeof tempo_event)
+        != sizeof bytes)
+        throw Unexpected_Midi_Layout(file);
+    return 60e6/old_us;
+}
+
 /// Trivial type for values intended to represented as 24-bit quantities.
 struct Uint24
 {
@@ -48,67 +300,403 @@ void write_be(std::ostream& os, Uint24 x)
     write_be(os, std::uint8_t(x.x));
 }
 
-Midi_File::Midi_File(double tempo, std::uint16_t divisions)
-    : m_tempo(tempo),
-      m_divisions(divisions)
+namespace
 {
-}
+    /// The number of bytes Midi_Stream buffers before writing.
+    constexpr std::size_t stream_block_size = 1 << 16;
+    /// Offset of the track length: the 14-byte header chunk plus "MTrk".
+    constexpr off_t track_length_offset = 18;
 
-double Midi_File::duration() const
-{
-    return m_last_time;
+    /// Write the MIDI file header chunk.
+    void write_header(std::ostream& os, std::uint16_t format, std::uint16_t tracks,
+                      std::uint16_t divisions)
+    {
+        os.write("MThd", 4);
+        write_be(os, std::uint32_t(6));
+        write_be(os, format);
+        write_be(os, tracks);
+        write_be(os, divisions);
+    }
+
+    /// Write the tempo and time signature events that start a track.
+    void write_track_start(std::ostream& os, double tempo)
+    {
+        write_be(os, std::uint32_t(0x00ff5103)); // Time and "set tempo" meta-event.
+        write_be(os, Uint24(tempo_to_us(tempo))); // µs/quarter note
+        write_be(os, std::uint32_t(0x00ff5804)); // Time signature meta-event.
+        write_be(os, std::uint32_t(0x04021808)); // 4/4
+    }
+
+    /// Write the end of a track.
+    void write_track_end(std::ostream& os)
+    {
+        write_be(os, std::uint32_t(0x0)); //! Timidity says the file is too short without it.
+        write_be(os, std::uint16_t(0xff2f));
+        write_be(os, std::uint8_t(0));
+    }
+
+    /// Write all of a buffer, retrying after partial writes and interruptions.
+    /// @return True on success.
+    bool write_all(int fd, const char* buffer, std::size_t size)
+    {
+        while (size > 0)
+        {
+            auto n = ::write(fd, buffer, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            buffer += n;
+            size -= n;
+        }
+        return true;
+    }
 }
 
-std::size_t Midi_File::size() const
+Note_Encoder::Note_Encoder(std::uint16_t divisions, std::uint8_t channel, bool compact)
+    : m_divisions(divisions),
+      m_channel(channel & 0x0f),
+      m_compact(compact)
 {
-    return m_num_notes;
 }
 
-void Midi_File::add_note(double time, bool on, double pitch, double velocity)
+void Note_Encoder::add_note(std::ostream& os, double time, bool on, double pitch,
+                            double velocity)
 {
     assert(time >= 0.0);
-    write_var_be(m_note_buffer, std::round(m_divisions*(time - m_last_time)));
+    write_var_be(os, std::round(m_divisions*(time - m_last_time)));
     m_last_time = time;
 
-    if (on != m_last_note_on)
-        write_be(m_note_buffer, std::uint8_t(on ? 0x90 : 0x80));
+    // The standard encoding needs a status byte whenever the event switches between on
+    // and off.  The compact encoding needs one only for the first event.
+    auto first = m_num_notes == 0 && on;
+    auto status_change = on != m_last_note_on;
+    if (status_change && !first)
+        ++m_compact_savings;
     m_last_note_on = on;
 
-    write_be(m_note_buffer, std::uint8_t(pitch));
-    write_be(m_note_buffer, std::uint8_t(velocity*127));
+    if (m_compact ? first : status_change)
+        write_be(os, std::uint8_t((on || m_compact ? 0x90 : 0x80) | m_channel));
+    write_be(os, std::uint8_t(pitch));
+    write_be(os, std::uint8_t(on || !m_compact ? velocity*127 : 0));
 
     if (on)
         ++m_num_notes;
 }
 
+double Note_Encoder::duration() const
+{
+    return m_last_time;
+}
+
+std::size_t Note_Encoder::size() const
+{
+    return m_num_notes;
+}
+
+std::size_t Note_Encoder::compact_savings() const
+{
+    return m_compact_savings;
+}
+
+Midi_File::Midi_File(double tempo, std::uint16_t divisions, std::uint8_t channel,
+                     bool compact)
+    : m_tempo(tempo),
+      m_divisions(divisions),
+      m_encoder(divisions, channel, compact)
+{
+}
+
+double Midi_File::duration() const
+{
+    return m_encoder.duration();
+}
+
+std::size_t Midi_File::size() const
+{
+    return m_encoder.size();
+}
+
+std::size_t Midi_File::compact_savings() const
+{
+    return m_encoder.compact_savings();
+}
+
+void Midi_File::add_note(double time, bool on, double pitch, double velocity)
+{
+    m_encoder.add_note(m_note_buffer, time, on, pitch, velocity);
+}
+
 bool Midi_File::write(std::ostream& os) const
 {
-    write_header(os);
+    write_header(os, 0, 1, m_divisions);
     write_track(os, m_note_buffer.str().c_str(), m_note_buffer.str().size());
     return bool(os);
 }
 
-void Midi_File::write_header(std::ostream& os) const
+bool Midi_File::write_tracks(std::ostream& os, const std::vector<Midi_File>& tracks)
 {
-    os.write("MThd", 4);
-    write_be(os, std::uint32_t(6));
-    write_be(os, std::uint16_t(0));
-    write_be(os, std::uint16_t(1));
-    write_be(os, m_divisions);
+    if (tracks.empty())
+        return false;
+    const auto& first = tracks.front();
+    write_header(os, 1, tracks.size() + 1, first.m_divisions);
+
+    // The first track has the tempo and time signature.  It's the same as the start of
+    // the track written by write_track(), so write_midi_tempo() works on either format.
+    os.write("MTrk", 4);
+    write_be(os, std::uint32_t(19));
+    write_track_start(os, first.m_tempo);
+    write_be(os, std::uint32_t(0x00ff2f00)); // End of track
+
+    for (const auto& track : tracks)
+    {
+        auto buffer = track.m_note_buffer.str();
+        os.write("MTrk", 4);
+        write_be(os, std::uint32_t(buffer.size() + 4));
+        os.write(buffer.data(), buffer.size());
+        write_be(os, std::uint32_t(0x00ff2f00));
+    }
+    return bool(os);
 }
 
 void Midi_File::write_track(std::ostream& os, const char* buffer, std::uint32_t size) const
 {
     os.write("MTrk", 4);
     write_be(os, size + 22); // Add bytes written before and after the buffer.
-    write_be(os, std::uint32_t(0x00ff5103)); // Time and "set tempo" meta-event.
-    write_be(os, Uint24(60e6/m_tempo)); // µs/quarter note
-    write_be(os, std::uint32_t(0x00ff5804)); // Time signature meta-event.
-    write_be(os, std::uint32_t(0x04021808)); // 4/4
+    write_track_start(os, m_tempo);
     os.write(buffer, size);
+    write_track_end(os);
+}
+
+Midi_Stream::Midi_Stream(const std::filesystem::path& file, double tempo,
+                         std::uint16_t divisions, std::uint8_t channel, bool compact)
+    : m_file(file),
+      m_fd(::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)),
+      m_encoder(divisions, channel, compact)
+{
+    if (m_fd < 0)
+        throw Midi_Not_Written(file);
+    // The same layout as Midi_File::write().  The track length is patched by close().
+    write_header(m_buffer, 0, 1, divisions);
+    m_buffer.write("MTrk", 4);
+    write_be(m_buffer, std::uint32_t(0));
+    write_track_start(m_buffer, tempo);
+}
+
+Midi_Stream::~Midi_Stream()
+{
+    try
+    {
+        close();
+    }
+    catch (const Midi_Not_Written&)
+    {
+    }
+}
+
+void Midi_Stream::add_note(double time, bool on, double pitch, double velocity)
+{
+    assert(m_fd >= 0);
+    m_encoder.add_note(m_buffer, time, on, pitch, velocity);
+    if (static_cast<std::size_t>(m_buffer.tellp()) >= stream_block_size)
+        flush();
+}
+
+void Midi_Stream::close()
+{
+    if (m_fd < 0)
+        return;
+    write_track_end(m_buffer);
+    flush();
+    // The track length doesn't include the chunk header.
+    auto length = m_bytes_written - track_length_offset - 4;
+    unsigned char bytes[] = {std::uint8_t(length >> 24), std::uint8_t(length >> 16),
+                             std::uint8_t(length >> 8), std::uint8_t(length)};
+    auto ok = length <= UINT32_MAX
+        && ::pwrite(m_fd, bytes, sizeof bytes, track_length_offset) == sizeof bytes;
+    ok = ::close(m_fd) == 0 && ok;
+    m_fd = -1;
+    if (!ok)
+        throw Midi_Not_Written(m_file);
+}
+
+double Midi_Stream::duration() const
+{
+    return m_encoder.duration();
+}
+
+std::size_t Midi_Stream::size() const
+{
+    return m_encoder.size();
+}
+
+std::size_t Midi_Stream::compact_savings() const
+{
+    return m_encoder.compact_savings();
+}
+
+void Midi_Stream::flush()
+{
+    auto block = m_buffer.str();
+    if (!write_all(m_fd, block.data(), block.size()))
+    {
+        ::close(m_fd);
+        m_fd = -1;
+        throw Midi_Not_Written(m_file);
+    }
+    m_bytes_written += block.size();
+    m_buffer.str("");
+}
+
+namespace
+{
+    /// A histogram of lateness with 1 µs bins for finding percentiles.  Memory use doesn't
+    /// depend on the number of messages.
+    class Lateness
+    {
+    public:
+        void add(double seconds)
+        {
+            m_max = std::max(m_max, seconds);
+            auto us = static_cast<std::size_t>(std::max(seconds, 0.0)*1e6);
+            ++m_counts[std::min(us, m_counts.size() - 1)];
+            ++m_total;
+        }
+        /// @return The lateness in seconds that the given fraction of messages don't
+        ///     exceed, rounded up to the µs.
+        double percentile(double fraction) const
+        {
+            auto rank = static_cast<std::size_t>(std::ceil(fraction*m_total));
+            std::size_t count = 0;
+            for (std::size_t us = 0; us + 1 < m_counts.size(); ++us)
+            {
+                count += m_counts[us];
+                if (count >= rank)
+                    return std::min((us + 1)*1e-6, m_max);
+            }
+            return m_max;
+        }
+        double max() const
+        {
+            return m_max;
+        }
+
+    private:
+        /// Counts up to 10 ms.  The last bin has everything later.
+        std::vector<std::size_t> m_counts = std::vector<std::size_t>(10000);
+        std::size_t m_total = 0;
+        double m_max = 0.0;
+    };
+}
+
+Live_Stats play_midi(Generator<Midi_Message> messages, int fd, bool real_time)
+{
+    using Clock = std::chrono::steady_clock;
+
+    Spsc_Ring<Midi_Message> ring(live_ring_size);
+    std::atomic<bool> done = false; ///< Set by the producer when it's finished.
+    std::atomic<bool> quit = false; ///< Set by the writer if it can't go on.
+    std::exception_ptr error;
+    std::jthread producer([&] {
+        try
+        {
+            for (const auto& message : messages)
+            {
+                while (ring.push(std::span(&message, 1)) == 0 && !quit)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                if (quit)
+                    break;
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        done = true;
+    });
+
+    Live_Stats stats;
+    Lateness lateness;
+    // Start the clock when there's something to play so the time spent composing the
+    // first segment doesn't count against the first message.
+    while (ring.size() == 0 && !done)
+        std::this_thread::sleep_for(poll_time);
+    auto start = Clock::now() + start_lead;
+    auto deadline = [&](const Midi_Message& message) {
+        return start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(message.time));
+    };
+    std::optional<Midi_Message> next; ///< The next message to write.
+    std::vector<Clock::time_point> deadlines; ///< For the messages in the buffer.
+    std::string buffer;
+    try
+    {
+        bool waited = false; ///< True if the ring was empty when the next message was needed.
+        while (true)
+        {
+            if (!next)
+            {
+                // Check before popping so messages pushed just before the end aren't missed.
+                bool finished = done;
+                Midi_Message message;
+                if (ring.pop(std::span(&message, 1)) == 0)
+                {
+                    if (finished)
+                        break;
+                    waited = true;
+                    std::this_thread::sleep_for(poll_time);
+                    continue;
+                }
+                if (real_time && waited && Clock::now() > deadline(message))
+                    ++stats.missed;
+                waited = false;
+                next = message;
+            }
+
+            if (real_time)
+            {
+                auto when = deadline(*next);
+                std::this_thread::sleep_until(when - spin_time);
+                while (Clock::now() < when)
+                    ;
+            }
+
+            // Write the message along with any others that are due.
+            auto now = Clock::now();
+            buffer.clear();
+            deadlines.clear();
+            do
+            {
+                buffer.append(next->bytes.begin(), next->bytes.end());
+                deadlines.push_back(deadline(*next));
+                Midi_Message message;
+                if (ring.pop(std::span(&message, 1)) == 0)
+                    next.reset();
+                else
+                    next = message;
+            } while (next && (!real_time || deadline(*next) <= now));
 
-    // End of track
-    write_be(os, std::uint32_t(0x0)); //! Timidity says the file is too short without it.
-    write_be(os, std::uint16_t(0xff2f));
-    write_be(os, std::uint8_t(0));
+            if (real_time)
+                for (auto when : deadlines)
+                    lateness.add(std::chrono::duration<double>(now - when).count());
+            if (!write_all(fd, buffer.data(), buffer.size()))
+                throw Live_Midi_Not_Written(std::strerror(errno));
+            stats.messages += deadlines.size();
+        }
+    }
+    catch (...)
+    {
+        quit = true;
+        throw;
+    }
+    producer.join();
+    if (error)
+        std::rethrow_exception(error);
+    if (real_time)
+    {
+        stats.p50 = lateness.percentile(0.5);
+        stats.p99 = lateness.percentile(0.99);
+        stats.max = lateness.max();
+    }
+    return stats;
 }
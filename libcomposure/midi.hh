@@ -16,11 +16,19 @@
 #ifndef COMPOSURE_COMPOSURE_MIDI_HH_INCLUDED
 #define COMPOSURE_COMPOSURE_MIDI_HH_INCLUDED
 
+#include "generator.hh"
+
+#include <array>
 #include <bit>
 #include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <memory>
 #include <ostream>
+#include <span>
 #include <sstream>
 #include <stdexcept>
+#include <vector>
 
 /// Exception thrown if there's an attempt to write a value with more than 28 bits as a
 /// variable-length quantity.
@@ -32,6 +40,24 @@ public:
     {}
 };
 
+/// Exception thrown if a file doesn't have the layout written by Midi_File.
+class Unexpected_Midi_Layout : public std::runtime_error
+{
+public:
+    Unexpected_Midi_Layout(const std::filesystem::path& file)
+        : std::runtime_error("Not a MIDI file written by Composure: " + file.string())
+    {}
+};
+
+/// Exception thrown if a MIDI file can't be read.
+class Bad_Midi_File : public std::runtime_error
+{
+public:
+    Bad_Midi_File(const std::string& what)
+        : std::runtime_error("Bad MIDI file: " + what)
+    {}
+};
+
 /// Write a fixed-length value most significant first.
 template <typename T>
 void write_be(std::ostream& os, T x)
@@ -50,18 +76,191 @@ void write_be(std::ostream& os, T x)
     os.write((char*)&y, sizeof y);
 }
 
+/// Read a fixed-length value written by write_be().
+template <typename T>
+T read_be(std::istream& is)
+{
+    unsigned char bytes[sizeof(T)] = {};
+    is.read((char*)bytes, sizeof bytes);
+    T x = 0;
+    for (auto b : bytes)
+        x = (x << 8) | b;
+    return x;
+}
+
 /// Write a variable-length value as 1 to 4 bytes, most significant first.
 /// @param x The value to write.  Must fit in 28 bits or throws
 /// Variable_Length_Value_Too_Large.
 void write_var_be(std::ostream& os, std::uint32_t x);
 
-/// A class to accumulate notes and write a single-track MIDI file.
+/// Read a variable-length value written by write_var_be().
+std::uint32_t read_var_be(std::istream& is);
+
+/// A note read from a MIDI file.
+struct Midi_Note
+{
+    double time; ///< Start time in beats.
+    double duration; ///< beats
+    int pitch; ///< MIDI note number
+    int velocity; ///< 1 to 127
+    int channel; ///< 0 to 15
+};
+
+/// A channel event read from a MIDI file.
+struct Midi_Event
+{
+    std::uint32_t ticks; ///< Time since the start of the track.
+    std::uint8_t status; ///< The kind of event in the high nibble, channel in the low.
+    std::uint8_t data1; ///< For note events, the MIDI note number.
+    std::uint8_t data2; ///< For note events, the velocity.  0 for 1-byte events.
+    std::uint16_t track; ///< The index of the track that has the event.
+};
+
+class Mapped_File;
+
+/// A reader for standard MIDI files.  The data is decoded in place, either from a
+/// memory-mapped file or from a buffer owned by the caller.
+class Midi_Reader
+{
+public:
+    /// Read from a buffer.  The buffer must outlive the reader.  Throws Bad_Midi_File if
+    /// the header is malformed or uses SMPTE time division.
+    Midi_Reader(std::span<const unsigned char> data);
+    /// Map a file into memory and read from it.  Throws File_Not_Mapped if the file can't
+    /// be read.
+    Midi_Reader(const std::filesystem::path& file);
+    ~Midi_Reader();
+
+    /// @return 0 for a single track, 1 for simultaneous tracks, 2 for independent tracks.
+    std::uint16_t format() const;
+    /// @return The number of ticks in a beat.
+    std::uint16_t divisions() const;
+    /// @return The number of track chunks.
+    std::size_t tracks() const;
+
+    /// Call f(const Midi_Event&) for each channel event in the file, track by track.  Meta
+    /// and system exclusive events are skipped.  Running status is handled.  Throws
+    /// Bad_Midi_File if a track is malformed.
+    template <typename F> void for_each_event(F&& f) const;
+
+    /// @return The notes from all tracks.  Note-on events with zero velocity are treated
+    /// as note-off events.  Notes are sorted by start time.  Simultaneous notes are in file
+    /// order.
+    std::vector<Midi_Note> notes() const;
+
+private:
+    /// Find the track chunks.
+    void read_chunks();
+    /// Decode a variable-length value and advance p.
+    static std::uint32_t get_var(const unsigned char*& p, const unsigned char* end);
+    /// Throw Bad_Midi_File if there are fewer than n bytes from p to end.
+    static void need(const unsigned char* p, const unsigned char* end, std::size_t n);
+
+    std::unique_ptr<Mapped_File> m_file; ///< Set if the reader mapped the file.
+    std::span<const unsigned char> m_data;
+    std::uint16_t m_format = 0;
+    std::uint16_t m_divisions = 0;
+    std::vector<std::span<const unsigned char>> m_tracks; ///< The data in each MTrk chunk.
+};
+
+template <typename F> void Midi_Reader::for_each_event(F&& f) const
+{
+    for (std::size_t track = 0; track < m_tracks.size(); ++track)
+    {
+        auto p = m_tracks[track].data();
+        auto end = p + m_tracks[track].size();
+        std::uint32_t ticks = 0;
+        std::uint8_t status = 0;
+        while (p < end)
+        {
+            ticks += get_var(p, end);
+            need(p, end, 1);
+            // If the high bit isn't set, the byte is data and the last status is reused.
+            if (*p & 0x80)
+                status = *p++;
+            else if (status == 0)
+                throw Bad_Midi_File("running status without a status byte");
+
+            if (status >= 0xf0)
+            {
+                // Meta or system exclusive events.  These cancel running status.
+                if (status == 0xff)
+                {
+                    need(p, end, 1);
+                    ++p; // Meta-event type
+                }
+                auto size = get_var(p, end);
+                need(p, end, size);
+                p += size;
+                status = 0;
+                continue;
+            }
+
+            // Program change and channel pressure have 1 data byte.  The others have 2.
+            std::size_t size = (status & 0xe0) == 0xc0 ? 1 : 2;
+            need(p, end, size);
+            f(Midi_Event{ticks, status, p[0], std::uint8_t(size == 2 ? p[1] : 0),
+                         std::uint16_t(track)});
+            p += size;
+        }
+    }
+}
+
+/// Read the notes from all tracks of a standard MIDI file.  The stream is read into
+/// memory and decoded with Midi_Reader.
+/// @return Notes sorted by start time.  Simultaneous notes are in file order.
+std::vector<Midi_Note> read_midi_notes(std::istream& is);
+
+/// @return The tempo in beats per minute of a file written by Midi_File.  Throws
+/// Unexpected_Midi_Layout if the file doesn't have a "set tempo" event where Midi_File puts
+/// it.
+double read_midi_tempo(const std::filesystem::path& file);
+/// Change the tempo of a file written by Midi_File in place.  Only the 3 bytes of the
+/// "set tempo" event are rewritten.  Throws Unexpected_Midi_Layout if the file doesn't
+/// have the expected layout.
+/// @return The previous tempo.
+double write_midi_tempo(const std::filesystem::path& file, double tempo);
+
+/// Encoder for the note events of a track.  It keeps the state needed for delta times
+/// and running status.  Used by Midi_File and Midi_Stream.
+class Note_Encoder
+{
+public:
+    /// See Midi_File::Midi_File().
+    Note_Encoder(std::uint16_t divisions, std::uint8_t channel, bool compact);
+    /// Write a note event to a stream.  See Midi_File::add_note().
+    void add_note(std::ostream& os, double time, bool on, double pitch, double velocity);
+
+    /// @return The time of the last event.
+    double duration() const;
+    /// @return The number of note-on events.
+    std::size_t size() const;
+    /// @return See Midi_File::compact_savings().
+    std::size_t compact_savings() const;
+
+private:
+    std::uint16_t m_divisions; ///< The number of ticks in a beat.
+    std::uint8_t m_channel; ///< The channel for note events.
+    bool m_compact; ///< True if note-offs are written as zero-velocity note-ons.
+    bool m_last_note_on = false;
+    double m_last_time = 0.0;
+    std::size_t m_num_notes = 0;
+    /// Status bytes in the standard encoding less those in the compact encoding.
+    std::size_t m_compact_savings = 0;
+};
+
+/// A class to accumulate notes and write a single-track MIDI file.  Several objects can
+/// also be written together as the tracks of a multi-track file.
 class Midi_File
 {
 public:
     /// @param tempo The number beats per second.
     /// @param divisions The number of ticks in a beat.
-    Midi_File(double tempo, std::uint16_t divisions);
+    /// @param channel The MIDI channel for note events, 0 to 15.
+    /// @param compact If true, write note-offs as note-ons with zero velocity.  Every note
+    /// event then has the same status byte, so running status holds for the whole track.
+    Midi_File(double tempo, std::uint16_t divisions, std::uint8_t channel = 0,
+              bool compact = false);
     /// Add a single note-on or note-off event.
     /// @param delta_t Time since the last event, possibly zero.
     /// @param on True for note-on events, false for note-off.
@@ -70,24 +269,119 @@ public:
     void add_note(double delta_t, bool on, double pitch, double velocity);
     /// Write the MIDI file to a stream.
     bool write(std::ostream& os) const;
+    /// Write a format 1 MIDI file with one track for each element of tracks, plus a first
+    /// track with the tempo and time signature.  The tempo and divisions of the first
+    /// element are used.
+    static bool write_tracks(std::ostream& os, const std::vector<Midi_File>& tracks);
 
     /// @return The total length of the performance.
     double duration() const;
     /// @return The number of notes in the performance.
     std::size_t size() const;
+    /// @return The number of bytes the compact encoding saves, or would save, over the
+    /// standard encoding for the events added so far.
+    std::size_t compact_savings() const;
 
 private:
-    /// Write the MIDI file header chunk.
-    void write_header(std::ostream& os) const;
     /// Write the MIDI file track checkn.
     void write_track(std::ostream& os, const char* buffer, std::uint32_t size) const;
 
     double m_tempo; ///< Quarter beats per second.
     std::uint16_t m_divisions; ///< The number of ticks in a beat.
     std::ostringstream m_note_buffer;
-    bool m_last_note_on = false;
-    double m_last_time = 0.0;
-    std::size_t m_num_notes = 0;
+    Note_Encoder m_encoder;
+};
+
+/// Exception thrown if a streamed MIDI file can't be written.
+class Midi_Not_Written : public std::runtime_error
+{
+public:
+    Midi_Not_Written(const std::filesystem::path& file)
+        : std::runtime_error("Can't write MIDI file: " + file.string())
+    {}
+};
+
+/// A single-track MIDI file that's written as notes are added.  Events go to the file in
+/// blocks, so memory use doesn't grow with the length of the piece.  The track length
+/// isn't known until the end.  It's patched in by close().  The file is the same as the
+/// one Midi_File::write() gives for the same notes.
+class Midi_Stream
+{
+public:
+    /// Create the file and write the header.  The parameters are the same as for
+    /// Midi_File.  Throws Midi_Not_Written if the file can't be created.
+    Midi_Stream(const std::filesystem::path& file, double tempo, std::uint16_t divisions,
+                std::uint8_t channel = 0, bool compact = false);
+    /// Close the file if close() wasn't called.  Errors are ignored.
+    ~Midi_Stream();
+    Midi_Stream(const Midi_Stream&) = delete;
+    Midi_Stream& operator=(const Midi_Stream&) = delete;
+
+    /// Add a single note-on or note-off event.  See Midi_File::add_note().  Throws
+    /// Midi_Not_Written if a block can't be written.
+    void add_note(double time, bool on, double pitch, double velocity);
+    /// Write the end of the track, patch the track length, and close the file.  Throws
+    /// Midi_Not_Written on failure.  No more notes may be added.
+    void close();
+
+    /// @return The total length of the performance.
+    double duration() const;
+    /// @return The number of notes in the performance.
+    std::size_t size() const;
+    /// @return See Midi_File::compact_savings().
+    std::size_t compact_savings() const;
+
+private:
+    /// Write the buffered bytes to the file.
+    void flush();
+
+    std::filesystem::path m_file;
+    int m_fd; ///< The open file, or -1 after close().
+    Note_Encoder m_encoder;
+    std::ostringstream m_buffer; ///< Events not yet written.
+    std::uint64_t m_bytes_written = 0;
+};
+
+/// A channel message to send at a given time.
+struct Midi_Message
+{
+    double time; ///< Seconds from the start of the performance.
+    std::array<std::uint8_t, 3> bytes; ///< Status and 2 data bytes.
 };
 
+/// Exception thrown when live MIDI messages can't be written.
+class Live_Midi_Not_Written : public std::runtime_error
+{
+public:
+    Live_Midi_Not_Written(const std::string& what)
+        : std::runtime_error("Live MIDI not written: " + what)
+    {}
+};
+
+/// Statistics from play_midi().  Lateness is the time from a message's deadline to when
+/// it was written.
+struct Live_Stats
+{
+    std::size_t messages = 0; ///< The number of messages written.
+    /// The number of messages that weren't ready until after their deadlines because
+    /// composition fell behind.
+    std::size_t missed = 0;
+    double p50 = 0.0; ///< Median lateness in seconds.
+    double p99 = 0.0; ///< 99th percentile lateness in seconds.
+    double max = 0.0; ///< The greatest lateness in seconds.
+};
+
+/// Write raw MIDI messages as the clock reaches their times, e.g. to a bridge that drives
+/// a hardware synthesizer.  The messages are pulled from the generator on a separate
+/// thread, so composing the next segment runs ahead of playback.  The threads
+/// communicate through a lock-free ring buffer.  To keep lateness well under a
+/// millisecond, the writer sleeps until shortly before each deadline and then spins.
+/// Messages that are due together are written with one call.  Throws
+/// Live_Midi_Not_Written if a write fails, e.g. if the reader of a pipe goes away.
+/// @param messages Messages in time order.
+/// @param fd Where to write, e.g. standard output or a named pipe.
+/// @param real_time If false, messages are written as soon as they're ready, and the
+///     lateness statistics are zero.
+Live_Stats play_midi(Generator<Midi_Message> messages, int fd, bool real_time = true);
+
 #endif // COMPOSURE_COMPOSURE_MIDI_HH_INCLUDED
@@ -0,0 +1,260 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "note_ring.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr std::uint32_t magic = 0x4e504d43; // "CMPN" in little-endian order
+    constexpr std::uint16_t version = 1;
+
+    struct Header
+    {
+        std::uint32_t magic;
+        std::uint16_t version;
+        std::uint16_t record_size;
+        std::uint32_t capacity;
+        std::uint32_t finished;
+        std::byte pad1[48];
+        std::uint64_t published; ///< On its own cache line, away from the fixed fields.
+        std::byte pad2[56];
+    };
+
+    /// The fields are stored as bit patterns so they can be read and written atomically.
+    struct Record
+    {
+        std::uint64_t sequence;
+        std::uint64_t time;
+        std::uint32_t duration;
+        std::uint32_t pitch;
+        std::uint32_t volume;
+        std::uint32_t generation;
+    };
+
+    static_assert(sizeof(Header) == 128 && offsetof(Header, published) == 64);
+    static_assert(sizeof(Record) == 32 && offsetof(Record, duration) == 16);
+    static_assert(std::endian::native == std::endian::little);
+
+    Header& header(void* memory)
+    {
+        return *static_cast<Header*>(memory);
+    }
+
+    Record& record(void* memory, std::uint64_t n)
+    {
+        auto records = reinterpret_cast<Record*>(static_cast<std::byte*>(memory)
+                                                 + sizeof(Header));
+        return records[n & (header(memory).capacity - 1)];
+    }
+
+    /// Atomic access to a field in shared memory.  The subscriber's mapping is read-only,
+    /// but it's only loaded from.
+    template <typename T> std::atomic_ref<T> at(const T& field)
+    {
+        return std::atomic_ref<T>(const_cast<T&>(field));
+    }
+
+    std::string error_text(const std::string& what, const std::string& name)
+    {
+        return what + ' ' + name + ": " + std::strerror(errno);
+    }
+
+    std::string shm_name(const std::string& name)
+    {
+        return name.starts_with('/') ? name : '/' + name;
+    }
+}
+
+Note_Publisher::Note_Publisher(const std::string& name, std::size_t capacity)
+    : m_name(shm_name(name))
+{
+    if (capacity > std::numeric_limits<std::uint32_t>::max()/2)
+        throw Note_Ring_Error("capacity is too large: " + std::to_string(capacity));
+    auto records = std::bit_ceil(std::max<std::size_t>(capacity, 1));
+    m_size = sizeof(Header) + records*sizeof(Record);
+
+    // Readers that have the old ring open keep it.  New readers get this one.
+    ::shm_unlink(m_name.c_str());
+    auto fd = ::shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        throw Note_Ring_Error(error_text("can't create", m_name));
+    if (::ftruncate(fd, m_size) != 0)
+    {
+        auto error = error_text("can't size", m_name);
+        ::close(fd);
+        ::shm_unlink(m_name.c_str());
+        throw Note_Ring_Error(error);
+    }
+    m_memory = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m_memory == MAP_FAILED)
+    {
+        auto error = error_text("can't map", m_name);
+        ::shm_unlink(m_name.c_str());
+        throw Note_Ring_Error(error);
+    }
+
+    // The new object is zero-filled.  Readers check the magic number, so write it last.
+    auto& head = header(m_memory);
+    head.version = version;
+    head.record_size = sizeof(Record);
+    head.capacity = records;
+    at(head.magic).store(magic, std::memory_order_release);
+}
+
+Note_Publisher::~Note_Publisher()
+{
+    finish();
+    ::munmap(m_memory, m_size);
+    ::shm_unlink(m_name.c_str());
+}
+
+void Note_Publisher::publish(const Published_Note& note)
+{
+    auto n = m_published;
+    auto& rec = record(m_memory, n);
+    // Mark the record as being written before any field changes.
+    at(rec.sequence).store(2*n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    at(rec.time).store(std::bit_cast<std::uint64_t>(note.time), std::memory_order_relaxed);
+    at(rec.duration).store(std::bit_cast<std::uint32_t>(note.duration),
+                           std::memory_order_relaxed);
+    at(rec.pitch).store(std::bit_cast<std::uint32_t>(note.pitch), std::memory_order_relaxed);
+    at(rec.volume).store(std::bit_cast<std::uint32_t>(note.volume),
+                         std::memory_order_relaxed);
+    at(rec.generation).store(std::bit_cast<std::uint32_t>(note.generation),
+                             std::memory_order_relaxed);
+    at(rec.sequence).store(2*n + 2, std::memory_order_release);
+    m_published = n + 1;
+    at(header(m_memory).published).store(m_published, std::memory_order_release);
+}
+
+void Note_Publisher::finish()
+{
+    at(header(m_memory).finished).store(1, std::memory_order_release);
+}
+
+const std::string& Note_Publisher::name() const
+{
+    return m_name;
+}
+
+Note_Subscriber::Note_Subscriber(const std::string& name)
+{
+    auto path = shm_name(name);
+    auto fd = ::shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        throw Note_Ring_Error(error_text("can't open", path));
+    struct stat status;
+    if (::fstat(fd, &status) != 0)
+    {
+        auto error = error_text("can't stat", path);
+        ::close(fd);
+        throw Note_Ring_Error(error);
+    }
+    m_size = status.st_size;
+    if (m_size < sizeof(Header))
+    {
+        ::close(fd);
+        throw Note_Ring_Error(path + " is not a note ring");
+    }
+    m_memory = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m_memory == MAP_FAILED)
+        throw Note_Ring_Error(error_text("can't map", path));
+
+    const auto& head = header(m_memory);
+    auto check = [&](bool good, const std::string& problem) {
+        if (!good)
+        {
+            ::munmap(m_memory, m_size);
+            throw Note_Ring_Error(path + ": " + problem);
+        }
+    };
+    check(at(head.magic).load(std::memory_order_acquire) == magic, "not a note ring");
+    check(head.version == version, "version " + std::to_string(head.version)
+          + " is not supported");
+    check(head.record_size == sizeof(Record), "unexpected record size");
+    check(std::has_single_bit(head.capacity)
+          && m_size >= sizeof(Header) + std::size_t(head.capacity)*sizeof(Record),
+          "bad capacity");
+
+    auto published = at(head.published).load(std::memory_order_acquire);
+    m_next = published > head.capacity ? published - head.capacity : 0;
+}
+
+Note_Subscriber::~Note_Subscriber()
+{
+    ::munmap(m_memory, m_size);
+}
+
+std::optional<Published_Note> Note_Subscriber::next()
+{
+    const auto& head = header(m_memory);
+    while (true)
+    {
+        auto published = at(head.published).load(std::memory_order_acquire);
+        if (m_next >= published)
+            return std::nullopt;
+        // Skip notes that have certainly been overwritten.
+        if (published - m_next > head.capacity)
+        {
+            m_lost += published - head.capacity - m_next;
+            m_next = published - head.capacity;
+        }
+
+        const auto& rec = record(m_memory, m_next);
+        auto expected = 2*m_next + 2;
+        auto before = at(rec.sequence).load(std::memory_order_acquire);
+        Published_Note note{
+            std::bit_cast<double>(at(rec.time).load(std::memory_order_relaxed)),
+            std::bit_cast<float>(at(rec.duration).load(std::memory_order_relaxed)),
+            std::bit_cast<float>(at(rec.pitch).load(std::memory_order_relaxed)),
+            std::bit_cast<float>(at(rec.volume).load(std::memory_order_relaxed)),
+            std::bit_cast<std::int32_t>(at(rec.generation).load(std::memory_order_relaxed))};
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto after = at(rec.sequence).load(std::memory_order_relaxed);
+        ++m_next;
+        if (before == expected && after == expected)
+            return note;
+        // The writer reused the record while it was read.
+        ++m_lost;
+    }
+}
+
+bool Note_Subscriber::finished() const
+{
+    const auto& head = header(m_memory);
+    return at(head.finished).load(std::memory_order_acquire) != 0
+        && m_next >= at(head.published).load(std::memory_order_acquire);
+}
+
+std::uint64_t Note_Subscriber::lost() const
+{
+    return m_lost;
+}
@@ -0,0 +1,131 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_NOTE_RING_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_NOTE_RING_HH_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+// Notes are published to a POSIX shared memory object so that any number of local
+// processes can read them without sockets or copies through the kernel.  There's one
+// writer.  It never waits for readers.  A reader that falls more than a ring behind
+// loses the oldest notes and can tell how many it lost.
+//
+// The layout is little-endian with natural alignment:
+//
+//   Header, 128 bytes
+//     0  u32 magic        0x4e504d43, "CMPN"
+//     4  u16 version      1
+//     6  u16 record size  32
+//     8  u32 capacity     The number of records.  A power of 2.
+//    12  u32 finished     Set to 1 after the last note.
+//    64  u64 published    The number of notes written so far.
+//   Records from offset 128.  Note n is in record n mod capacity.
+//     0  u64 sequence     2n + 1 while note n is written, 2n + 2 when it's done.
+//     8  f64 time         Seconds from the start of the piece.
+//    16  f32 duration     seconds
+//    20  f32 pitch        MIDI note number
+//    24  f32 volume       0 to 1
+//    28  i32 generation   The compose pass that made the note.
+//
+// The writer sets a record's sequence to odd, writes the fields, sets the sequence to
+// even with release ordering, then increments the published count with release
+// ordering.  To read note n, a reader waits until published > n, then reads the sequence
+// with acquire ordering, copies the fields, and reads the sequence again after an
+// acquire fence.  The copy is good if both reads are 2n + 2.  If the sequence is
+// greater, the record has been reused and the note is lost.
+
+/// Exception thrown if a shared memory ring can't be created or opened, or doesn't have
+/// the expected layout.
+class Note_Ring_Error : public std::runtime_error
+{
+public:
+    Note_Ring_Error(const std::string& what)
+        : std::runtime_error("Note ring: " + what)
+    {}
+};
+
+/// A note as it's published.
+struct Published_Note
+{
+    double time; ///< Seconds from the start of the piece.
+    float duration; ///< seconds
+    float pitch; ///< MIDI note number
+    float volume; ///< 0 to 1
+    std::int32_t generation;
+};
+
+/// The writer of a ring.  Creates the shared memory object and removes it when destroyed.
+/// Readers that have it open can go on reading.
+class Note_Publisher
+{
+public:
+    /// Create the shared memory object, replacing one with the same name.  Throws
+    /// Note_Ring_Error on failure.
+    /// @param name The object's name, e.g. "/composure".  A leading slash is added if
+    ///     there isn't one.
+    /// @param capacity The number of records.  Rounded up to a power of 2.
+    Note_Publisher(const std::string& name, std::size_t capacity);
+    /// Mark the stream finished and remove the name.
+    ~Note_Publisher();
+    Note_Publisher(const Note_Publisher&) = delete;
+    Note_Publisher& operator=(const Note_Publisher&) = delete;
+
+    void publish(const Published_Note& note);
+    /// Tell readers there are no more notes.
+    void finish();
+
+    /// @return The name of the shared memory object.
+    const std::string& name() const;
+
+private:
+    std::string m_name;
+    void* m_memory;
+    std::size_t m_size;
+    std::uint64_t m_published = 0;
+};
+
+/// A reader of a ring.  Each reader keeps its own position, so readers don't affect each
+/// other or the writer.
+class Note_Subscriber
+{
+public:
+    /// Map an existing ring.  Reading starts with the oldest note still in the ring.
+    /// Throws Note_Ring_Error if there's no ring with the name or its layout is wrong.
+    Note_Subscriber(const std::string& name);
+    ~Note_Subscriber();
+    Note_Subscriber(const Note_Subscriber&) = delete;
+    Note_Subscriber& operator=(const Note_Subscriber&) = delete;
+
+    /// @return The next note, or no value if it hasn't been published yet.  If the
+    ///     writer has lapped the reader, the lost notes are skipped and counted.
+    std::optional<Published_Note> next();
+    /// @return True if the writer is done and every note has been read or lost.
+    bool finished() const;
+    /// @return The number of notes that were overwritten before they were read.
+    std::uint64_t lost() const;
+
+private:
+    void* m_memory;
+    std::size_t m_size;
+    std::uint64_t m_next = 0; ///< The sequence number of the next note to read.
+    std::uint64_t m_lost = 0;
+};
+
+#endif // COMPOSURE_COMPOSURE_NOTE_RING_HH_INCLUDED
@@ -0,0 +1,241 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "notes.hh"
+#include "mapped_file.hh"
+#include "midi.hh"
+
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <ostream>
+#include <string>
+#include <type_traits>
+
+namespace
+{
+    constexpr std::uint32_t notes_magic = 0x434e4f54; // "CNOT"
+    constexpr std::uint16_t notes_format = 1;
+    constexpr std::size_t num_columns = 5;
+    /// The volume of composed notes.
+    constexpr double default_volume = 0.8;
+
+    /// Append a signed value to a column as a zigzag-encoded varint.  Zigzag encoding maps
+    /// small negative numbers to small positive numbers: 0, -1, 1, -2, ... → 0, 1, 2, 3, ...
+    void put_varint(std::string& column, std::int64_t x)
+    {
+        auto u = (static_cast<std::uint64_t>(x) << 1) ^ static_cast<std::uint64_t>(x >> 63);
+        while (u >= 0x80)
+        {
+            column.push_back(static_cast<char>(0x80 | (u & 0x7f)));
+            u >>= 7;
+        }
+        column.push_back(static_cast<char>(u));
+    }
+
+    /// Sequential reader for a span of bytes.  Throws Bad_Notes_File on overrun.
+    class Cursor
+    {
+    public:
+        Cursor(std::span<const unsigned char> data)
+            : m_data(data)
+        {}
+
+        template <typename T> T get_be()
+        {
+            auto bytes = take(sizeof(T));
+            T x = 0;
+            for (auto b : bytes)
+                x = (x << 8) | b;
+            return x;
+        }
+
+        std::int64_t get_varint()
+        {
+            std::uint64_t u = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                auto b = take(1)[0];
+                u |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                    return static_cast<std::int64_t>(u >> 1) ^ -static_cast<std::int64_t>(u & 1);
+            }
+            throw Bad_Notes_File("varint too long");
+        }
+
+        std::span<const unsigned char> take(std::size_t n)
+        {
+            if (n > m_data.size() - m_pos)
+                throw Bad_Notes_File("unexpected end of data");
+            auto out = m_data.subspan(m_pos, n);
+            m_pos += n;
+            return out;
+        }
+
+    private:
+        std::span<const unsigned char> m_data;
+        std::size_t m_pos = 0;
+    };
+}
+
+void write_text_notes(std::ostream& os, std::span<const Note> notes, double tempo,
+                      int tonic)
+{
+    // Roughly 30 characters per line.
+    std::string text;
+    text.reserve(32*notes.size());
+    char buffer[32];
+    auto put = [&](auto x, char sep) {
+        std::to_chars_result result;
+        if constexpr (std::is_floating_point_v<decltype(x)>)
+            // The same as printf's %g and the default for streams.
+            result = std::to_chars(buffer, buffer + sizeof buffer, x,
+                                   std::chars_format::general, 6);
+        else
+            result = std::to_chars(buffer, buffer + sizeof buffer, x);
+        text.append(buffer, result.ptr);
+        text.push_back(sep);
+    };
+    for (const auto& n : notes)
+    {
+        put(n.time*60.0/tempo, ' ');
+        put((n.time + n.duration)*60.0/tempo, ' ');
+        put(tonic + n.pitch, ' ');
+        put(n.generation, '\n');
+    }
+    os.write(text.data(), text.size());
+}
+
+std::vector<Note> read_text_notes(std::string_view text, double tempo, int tonic,
+                                  std::uint16_t divisions)
+{
+    auto to_beats = [&](double sec) {
+        return std::round(sec*tempo/60.0*divisions)/divisions;
+    };
+
+    std::vector<Note> notes;
+    // Start with an estimate of the number of lines.
+    notes.reserve(text.size()/24);
+    auto p = text.data();
+    auto end = text.data() + text.size();
+    auto get = [&](auto& x) {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        auto [next, ec] = std::from_chars(p, end, x);
+        if (ec != std::errc())
+            throw Bad_Notes_File("can't parse line " + std::to_string(notes.size() + 1));
+        p = next;
+    };
+    while (p < end)
+    {
+        if (*p == '\n' || *p == '\r')
+        {
+            ++p;
+            continue;
+        }
+        double start, stop, pitch;
+        int generation;
+        get(start);
+        get(stop);
+        get(pitch);
+        get(generation);
+        auto time = to_beats(start);
+        notes.emplace_back(time, to_beats(stop) - time, default_volume, pitch - tonic,
+                           generation);
+    }
+    return notes;
+}
+
+void write_binary_notes(std::ostream& os, std::span<const Note> notes, double tempo,
+                        int tonic, std::uint16_t divisions)
+{
+    std::string columns[num_columns];
+    std::int64_t last[num_columns] = {};
+    for (auto& column : columns)
+        column.reserve(notes.size());
+    for (const auto& n : notes)
+    {
+        std::int64_t values[num_columns] = {
+            std::llround(n.time*divisions),
+            std::llround(n.duration*divisions),
+            std::llround(tonic + n.pitch),
+            std::llround(n.volume*1000),
+            n.generation};
+        for (std::size_t i = 0; i < num_columns; ++i)
+        {
+            put_varint(columns[i], values[i] - last[i]);
+            last[i] = values[i];
+        }
+    }
+
+    write_be(os, notes_magic);
+    write_be(os, notes_format);
+    write_be(os, divisions);
+    write_be(os, std::bit_cast<std::uint64_t>(tempo));
+    write_be(os, static_cast<std::uint16_t>(tonic));
+    write_be(os, static_cast<std::uint32_t>(notes.size()));
+    for (const auto& column : columns)
+    {
+        write_be(os, static_cast<std::uint32_t>(column.size()));
+        os.write(column.data(), column.size());
+    }
+}
+
+Note_File read_binary_notes(std::span<const unsigned char> data)
+{
+    Cursor in(data);
+    if (in.get_be<std::uint32_t>() != notes_magic)
+        throw Bad_Notes_File("wrong magic number");
+    if (in.get_be<std::uint16_t>() != notes_format)
+        throw Bad_Notes_File("unknown format");
+    double divisions = in.get_be<std::uint16_t>();
+    if (divisions == 0)
+        throw Bad_Notes_File("zero divisions");
+
+    Note_File file;
+    file.tempo = std::bit_cast<double>(in.get_be<std::uint64_t>());
+    file.tonic = static_cast<std::int16_t>(in.get_be<std::uint16_t>());
+    auto size = in.get_be<std::uint32_t>();
+    // Each value takes at least one byte.  Check before allocating.
+    if (size > data.size())
+        throw Bad_Notes_File("too many notes");
+
+    // Decode each column in place, then fill in the corresponding Note member.
+    file.notes.resize(size);
+    for (std::size_t i = 0; i < num_columns; ++i)
+    {
+        Cursor column(in.take(in.get_be<std::uint32_t>()));
+        std::int64_t value = 0;
+        for (auto& n : file.notes)
+        {
+            value += column.get_varint();
+            switch (i)
+            {
+            case 0: n.time = value/divisions; break;
+            case 1: n.duration = value/divisions; break;
+            case 2: n.pitch = value - file.tonic; break;
+            case 3: n.volume = value/1000.0; break;
+            case 4: n.generation = static_cast<int>(value); break;
+            }
+        }
+    }
+    return file;
+}
+
+Note_File load_binary_notes(const std::filesystem::path& file)
+{
+    Mapped_File mapped(file);
+    return read_binary_notes(mapped.data());
+}
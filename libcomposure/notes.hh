@@ -0,0 +1,85 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_NOTES_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_NOTES_HH_INCLUDED
+
+#include "phrase.hh"
+
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+/// Exception thrown when a notes file can't be decoded.
+class Bad_Notes_File : public std::runtime_error
+{
+public:
+    Bad_Notes_File(const std::string& what)
+        : std::runtime_error("Bad notes file: " + what)
+    {}
+};
+
+/// The contents of a binary notes file.
+struct Note_File
+{
+    double tempo; ///< Beats per minute.
+    int tonic; ///< MIDI note number of the tonic.
+    std::vector<Note> notes; ///< Pitches are relative to the tonic, as in Phrase.
+};
+
+/// Write notes as text, one line per note: start and stop time in seconds, MIDI note
+/// number (tonic + pitch), and generation.  Numbers are formatted like std::ostream does
+/// by default.  The text is built in memory and written with a single call.
+void write_text_notes(std::ostream& os, std::span<const Note> notes, double tempo,
+                      int tonic);
+
+/// Read notes written by write_text_notes().  Times are converted to beats and rounded
+/// to ticks.  Since the text has 6 significant digits, this recovers the original times
+/// of composed notes.  The volume isn't in the file.  It's set to the default for
+/// composed notes.  Throws Bad_Notes_File if a line can't be parsed.
+std::vector<Note> read_text_notes(std::string_view text, double tempo, int tonic,
+                                  std::uint16_t divisions = 96);
+
+/// Write notes in the binary columnar format.  The layout, with all fixed-length values
+/// most significant byte first, is
+///
+///     "CNOT"           magic
+///     u16              format version, currently 1
+///     u16              divisions: ticks per beat
+///     u64              tempo: IEEE 754 double, beats per minute
+///     i16              tonic: MIDI note number
+///     u32              number of notes
+///     5 × (u32, bytes) columns: byte length then data
+///
+/// The columns are start time and duration in ticks, MIDI note number (tonic + pitch),
+/// volume in thousandths, and generation.  Each column holds the differences between
+/// consecutive values, starting from 0, zigzag-encoded and packed as little-endian base-128
+/// varints.  Times are rounded to ticks, pitches to whole half steps, and volumes to
+/// thousandths.  Composed notes always fall on ticks at the default resolution.
+void write_binary_notes(std::ostream& os, std::span<const Note> notes, double tempo,
+                        int tonic, std::uint16_t divisions = 96);
+
+/// Decode notes from data in the format written by write_binary_notes().  Throws
+/// Bad_Notes_File if the data is malformed.
+Note_File read_binary_notes(std::span<const unsigned char> data);
+/// Map a binary notes file into memory and decode it.  Throws File_Not_Mapped if the
+/// file can't be read, or Bad_Notes_File if it's malformed.
+Note_File load_binary_notes(const std::filesystem::path& file);
+
+#endif // COMPOSURE_COMPOSURE_NOTES_HH_INCLUDED
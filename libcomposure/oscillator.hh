@@ -0,0 +1,59 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_OSCILLATOR_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_OSCILLATOR_HH_INCLUDED
+
+#include <cstddef>
+#include <span>
+
+/// An exponentially decaying sine wave that sounds from begin to end.  Its value at time
+/// t is amplitude·exp(-decay·(t - begin))·sin(2π·frequency·(t - origin)).
+struct Partial
+{
+    double begin; ///< seconds
+    double end; ///< seconds
+    double origin; ///< The time of zero phase in seconds.
+    double frequency; ///< Hz
+    double amplitude; ///< The envelope at the start.
+    double decay; ///< Decay rate in 1/seconds.
+};
+
+/// Instruction sets for the oscillator bank.
+enum class Simd
+{
+    scalar,
+    avx2, ///< 8 oscillators at a time.
+    avx512, ///< 16 oscillators at a time.
+};
+
+/// @return The widest instruction set supported by the CPU.
+Simd best_simd();
+/// @return True if the CPU can run the given instruction set.
+bool simd_supported(Simd simd);
+
+/// Add the sum of the partials to samples from first to first + out.size().  The bank is
+/// advanced in chunks.  At the start of each chunk the state of each sounding partial is
+/// computed exactly.  Within a chunk each one is a complex rotation with a decay factor,
+/// and several are advanced in parallel with vector instructions.  Since chunks start on
+/// multiples of the chunk size, the samples don't depend on how the output is split into
+/// calls.  Partials that don't overlap the range are skipped, but it's faster to leave
+/// them out.
+/// @param first The index of the first sample, counting from time 0.
+/// @param simd The instruction set to use.  It must be supported.
+void render_partials(std::span<const Partial> partials, double sample_rate,
+                     std::size_t first, std::span<float> out, Simd simd = best_simd());
+
+#endif // COMPOSURE_COMPOSURE_OSCILLATOR_HH_INCLUDED
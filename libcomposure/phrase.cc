@@ -13,9 +13,13 @@
 // You should have received a copy of the GNU General Public License along with Composure.
 // If not, see <http://www.gnu.org/licenses/>.
 
+#include "audio.hh"
+#include "mapped_file.hh"
 #include "midi.hh"
+#include "notes.hh"
 #include "phrase.hh"
 #include "random.hh"
+#include "thread_pool.hh"
 
 #include <algorithm>
 #include <cassert>
@@ -23,8 +27,11 @@
 #include <deque>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory_resource>
+#include <limits>
 #include <optional>
-#include <set>
+#include <queue>
 
 using Vd = std::vector<double>;
 using VNote = std::vector<Note>;
@@ -33,6 +40,13 @@ namespace
 {
     /// The number of notes to take from a point of interest in compose().
     constexpr std::size_t note_bin_size = 36;
+    /// The number of windows measured by each task in edit().  Phrases with fewer notes
+    /// are measured on the calling thread.
+    constexpr std::size_t consonance_grain = 4096;
+    /// The duration of the longest composed note in beats.
+    constexpr double longest_note = 4.0;
+    /// compose_segments() gives up after this many segments in a row with no notes.
+    constexpr int max_empty_segments = 8;
 
     /// Half steps from tonic for a major scale.
     const std::vector<double> major_scale = {0, 2, 4, 5, 7, 9, 11};
@@ -119,7 +133,7 @@ namespace
     }
 
     /// @return A measure of the dissonance in a chord.
-    double discord(const std::deque<Note>& notes)
+    double discord(std::span<const Note> notes)
     {
         double sum = 0.0;
         for (std::size_t i = 0; i < notes.size(); ++i)
@@ -138,6 +152,252 @@ namespace
                                   static_cast<int>(pitch[j]));
         return sum;
     }
+
+    /// Read notes from a .notes, .bnotes, or MIDI file.
+    VNote load_notes(const std::filesystem::path& file, double tempo, int tonic)
+    {
+        auto ext = file.extension();
+        if (ext == ".notes")
+        {
+            Mapped_File mapped(file);
+            auto data = mapped.data();
+            return read_text_notes({reinterpret_cast<const char*>(data.data()), data.size()},
+                                   tempo, tonic);
+        }
+        if (ext == ".bnotes")
+        {
+            auto notes_file = load_binary_notes(file);
+            for (auto& n : notes_file.notes)
+                n.pitch += notes_file.tonic - tonic;
+            return notes_file.notes;
+        }
+        if (ext == ".midi" || ext == ".mid")
+        {
+            VNote notes;
+            for (const auto& n : Midi_Reader(file).notes())
+                notes.emplace_back(n.time, n.duration, n.velocity/127.0,
+                                   double(n.pitch - tonic), 0);
+            return notes;
+        }
+        throw Bad_Notes_File("unknown file type: " + file.string());
+    }
+}
+
+namespace
+{
+    /// Turns notes into note-on and note-off events for a Midi_File or Midi_Stream.  Notes
+    /// are added one at a time in time order, and each event is passed on as soon as
+    /// nothing can come before it.  Only the sounding notes are held.
+    template <typename Track>
+    class Event_Scheduler
+    {
+    public:
+        /// @param memory Where the pending note-offs are allocated.
+        Event_Scheduler(Track& track, int tonic, bool monophonic,
+                        std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+            : m_track(track),
+              m_tonic(tonic),
+              m_monophonic(monophonic),
+              m_offs(Later(), std::pmr::vector<Off>(memory))
+        {}
+
+        /// Add a note.  A note with zero duration is a note-off event.
+        void add(const Note& note)
+        {
+            if (note.time < 0.0)
+                return;
+            bool on = note.duration != 0.0;
+            if (on && m_monophonic && m_held)
+            {
+                // Only one note at a time.  The held note ends when the next one starts.
+                if (note.time == m_held->time)
+                    return;
+                schedule_off(*m_held, note.time);
+            }
+            flush(note.time);
+            m_track.add_note(note.time, on, m_tonic + note.pitch, note.volume);
+            if (!on)
+                return;
+            if (m_monophonic)
+                m_held = note;
+            else
+                schedule_off(note, note.time + note.duration);
+        }
+
+        /// Pass on the remaining note-offs.
+        void finish()
+        {
+            if (m_held)
+                schedule_off(*m_held, m_held->time + m_held->duration);
+            m_held.reset();
+            flush(std::numeric_limits<double>::infinity());
+        }
+
+    private:
+        struct Off
+        {
+            double time;
+            std::size_t order; ///< Simultaneous note-offs are passed on in this order.
+            Note note;
+        };
+        struct Later
+        {
+            bool operator()(const Off& o1, const Off& o2) const
+            {
+                return o1.time > o2.time || (o1.time == o2.time && o1.order > o2.order);
+            }
+        };
+
+        void schedule_off(const Note& note, double time)
+        {
+            m_offs.push({time, m_order++, note});
+        }
+
+        /// Pass on note-offs before time.  Note-offs at time come after note-ons.
+        void flush(double time)
+        {
+            while (!m_offs.empty() && m_offs.top().time < time)
+            {
+                const auto& off = m_offs.top();
+                m_track.add_note(off.time, false, m_tonic + off.note.pitch, off.note.volume);
+                m_offs.pop();
+            }
+        }
+
+        Track& m_track;
+        int m_tonic;
+        bool m_monophonic;
+        std::priority_queue<Off, std::pmr::vector<Off>, Later> m_offs;
+        std::size_t m_order = 0;
+        std::optional<Note> m_held; ///< The sounding note in monophonic mode.
+    };
+
+    /// Add note-on and note-off events for notes to a Midi_File or Midi_Stream.
+    template <typename Track>
+    void add_events(std::span<const Note> notes, int tonic, bool monophonic, Track& midi,
+                    std::pmr::memory_resource* memory)
+    {
+        auto by_time = [](const Note& n1, const Note& n2) { return n1.time < n2.time; };
+        Event_Scheduler scheduler(midi, tonic, monophonic, memory);
+        if (std::is_sorted(notes.begin(), notes.end(), by_time))
+            for (const auto& n : notes)
+                scheduler.add(n);
+        else
+        {
+            std::pmr::vector<Note> sorted(notes.begin(), notes.end(), memory);
+            std::stable_sort(sorted.begin(), sorted.end(), by_time);
+            for (const auto& n : sorted)
+                scheduler.add(n);
+        }
+        scheduler.finish();
+    }
+}
+
+namespace
+{
+    /// A track for Event_Scheduler that pairs note-on and note-off events into notes for
+    /// the audio renderer, the same way a synthesizer would play the MIDI file.
+    class Audio_Track
+    {
+    public:
+        Audio_Track(double tempo)
+            : m_tempo(tempo)
+        {}
+
+        void add_note(double time, bool on, double pitch, double velocity)
+        {
+            auto sec = time*60.0/m_tempo;
+            auto& sounding = m_sounding[pitch];
+            if (on)
+            {
+                sounding.push_back(m_notes.size());
+                m_notes.push_back({sec, sec, midi_frequency(pitch), velocity});
+            }
+            else if (!sounding.empty())
+            {
+                m_notes[sounding.front()].stop = sec;
+                sounding.pop_front();
+            }
+        }
+
+        std::vector<Audio_Note> take_notes()
+        {
+            return std::move(m_notes);
+        }
+
+    private:
+        double m_tempo;
+        std::vector<Audio_Note> m_notes;
+        /// Indexes of notes waiting for note-offs by pitch, oldest first.
+        std::map<double, std::deque<std::size_t>> m_sounding;
+    };
+}
+
+namespace
+{
+    /// A track for Event_Scheduler that plays notes on an Audio_Stream as the events come
+    /// in.
+    class Stream_Track
+    {
+    public:
+        Stream_Track(Audio_Stream& stream, double tempo)
+            : m_stream(stream),
+              m_tempo(tempo)
+        {}
+
+        void add_note(double time, bool on, double pitch, double velocity)
+        {
+            auto sec = time*60.0/m_tempo;
+            auto& sounding = m_sounding[pitch];
+            if (on)
+                sounding.push_back(m_stream.start(sec, midi_frequency(pitch), velocity));
+            else if (!sounding.empty())
+            {
+                m_stream.stop(sounding.front(), sec);
+                sounding.pop_front();
+            }
+        }
+
+    private:
+        Audio_Stream& m_stream;
+        double m_tempo;
+        /// IDs of notes waiting for note-offs by pitch, oldest first.
+        std::map<double, std::deque<std::size_t>> m_sounding;
+    };
+}
+
+namespace
+{
+    /// A track for Event_Scheduler that collects MIDI messages for live output.
+    class Message_Track
+    {
+    public:
+        Message_Track(double tempo)
+            : m_tempo(tempo)
+        {}
+
+        void add_note(double time, bool on, double pitch, double velocity)
+        {
+            // The same bytes as the standard encoding in Note_Encoder on channel 0.
+            m_messages.push_back({time*60.0/m_tempo,
+                                  {std::uint8_t(on ? 0x90 : 0x80), std::uint8_t(pitch),
+                                   std::uint8_t(velocity*127)}});
+        }
+
+        /// @return The messages since the last call to clear().
+        const std::vector<Midi_Message>& messages() const
+        {
+            return m_messages;
+        }
+        void clear()
+        {
+            m_messages.clear();
+        }
+
+    private:
+        double m_tempo;
+        std::vector<Midi_Message> m_messages;
+    };
 }
 
 /// Compare notes by time.
@@ -146,13 +406,80 @@ bool operator< (const Note& n1, const Note& n2)
     return n1.time < n2.time;
 }
 
-Phrase::Phrase(double tempo)
-    : m_tempo(tempo)
+Phrase::Phrase(double tempo, std::pmr::memory_resource* memory)
+    : m_tempo(tempo),
+      m_notes(memory)
 {
 }
 
-void Phrase::compose(int tonic, int voices, int max_range, bool chromatic)
+Phrase::Phrase(double tempo, std::span<const Note> notes, std::pmr::memory_resource* memory)
+    : m_tempo(tempo),
+      m_notes(notes.begin(), notes.end(), memory)
 {
+    for (const auto& n : m_notes)
+        m_generation = std::max(m_generation, n.generation + 1);
+}
+
+Phrase::Phrase(const std::filesystem::path& file, double tempo, int tonic,
+               std::pmr::memory_resource* memory)
+    : Phrase(tempo, load_notes(file, tempo, tonic), memory)
+{
+}
+
+void Phrase::compose(int voices, int max_range, bool chromatic, const Note_Budget& budget)
+{
+    // Reserve space for the budget, allowing for the last step going over.
+    auto room = std::min(budget.pass,
+                         budget.total > m_notes.size() ? budget.total - m_notes.size() : 0);
+    if (room < m_notes.max_size()/2)
+        m_notes.reserve(m_notes.size() + room + voices);
+    for (const auto& note : compose_notes(voices, max_range, chromatic, budget))
+        m_notes.push_back(note);
+    std::sort(m_notes.begin(), m_notes.end());
+    ++m_generation;
+}
+
+Generator<Note> Phrase::generate(int voices, int max_range, bool chromatic,
+                                 Note_Budget budget) const
+{
+    // Each step of compose_notes() puts a note at the end time, and notes for the other
+    // voices up to lag beats before it.  The end time increases with each step, so no note
+    // comes more than lag beats before the latest one so far.
+    const double lag = (voices - 1)*longest_note*(voices + 1)/4;
+
+    struct Pending
+    {
+        Note note;
+        std::size_t order;
+    };
+    auto later = [](const Pending& p1, const Pending& p2) {
+        return p1.note.time > p2.note.time
+            || (p1.note.time == p2.note.time && p1.order > p2.order);
+    };
+    std::priority_queue<Pending, std::pmr::vector<Pending>, decltype(later)> pending(
+        later, std::pmr::vector<Pending>(m_notes.get_allocator().resource()));
+    std::size_t order = 0;
+    auto latest = -std::numeric_limits<double>::infinity();
+    for (const auto& note : compose_notes(voices, max_range, chromatic, budget))
+    {
+        latest = std::max(latest, note.time);
+        pending.push({note, order++});
+        while (!pending.empty() && pending.top().note.time <= latest - lag)
+        {
+            co_yield pending.top().note;
+            pending.pop();
+        }
+    }
+    for (; !pending.empty(); pending.pop())
+        co_yield pending.top().note;
+}
+
+Generator<Note> Phrase::compose_notes(int voices, int max_range, bool chromatic,
+                                      Note_Budget budget) const
+{
+    // Pitches are relative to the tonic.
+    constexpr double tonic = 0.0;
+
     // Initialize pitch with the last notes in the phrase.  Note that the last notes
     // aren't necessarily latest in time.
     Vd pitch(voices, tonic);
@@ -166,12 +493,18 @@ void Phrase::compose(int tonic, int voices, int max_range, bool chromatic)
     Vd repetitions(voices + 1, 0.0);
     repetitions.back() = voices;
 
-    // Add notes to the phrase until the range exceeds max_range, or we get 1000 notes.
+    // Add notes to the phrase until the range exceeds max_range or the budget is spent.
     double end_time = m_notes.empty() ? 0.0 : m_notes.back().time + m_notes.back().duration;
-    for (double span = 0.0; span < max_range && m_notes.size() < 1000; span = range(pitch))
+    auto size = m_notes.size();
+    std::size_t added = 0;
+    Vd discord;
+    discord.reserve(voices);
+    for (double span = 0.0;
+         span < max_range && size < budget.total && added < budget.pass;
+         span = range(pitch))
     {
         // Move the "most discordant" note by -2, -1, 0, 1, or 2 scale degrees.
-        std::vector<double> discord;
+        discord.clear();
         for (std::size_t i = 0; i < pitch.size(); ++i)
             discord.push_back(weight_discord(pitch, i));
         auto move_idx = pick(discord);
@@ -187,11 +520,11 @@ void Phrase::compose(int tonic, int voices, int max_range, bool chromatic)
 
         // Pick a random duration for the note: 1/4, 1/8, 1/16.  Favor shorter notes when
         // the pitch range is large.
-        double dur = subdivide(4.0, pick(0, 2, max_range - span, span));
+        double dur = subdivide(longest_note, pick(0, 2, max_range - span, span));
         double delta_t = dur*(voices+1)/4;
         if (end_time > pitch.size()*delta_t)
-            for (std::size_t j = 0; j < pitch.size(); j++)
-                m_notes.emplace_back(end_time - j*delta_t, dur, 0.8, pitch[j], m_generation);
+            for (std::size_t j = 0; j < pitch.size(); j++, size++, added++)
+                co_yield Note{end_time - j*delta_t, dur, 0.8, pitch[j], m_generation};
         end_time += dur;
 
         // Update the ages of notes that weren't changed.
@@ -201,9 +534,6 @@ void Phrase::compose(int tonic, int voices, int max_range, bool chromatic)
         if (old_idx != voices)
             repetitions[old_idx] = 0;
     }
-
-    std::sort(m_notes.begin(), m_notes.end());
-    ++m_generation;
 }
 
 void Phrase::edit()
@@ -211,9 +541,12 @@ void Phrase::edit()
     if (m_notes.empty())
         return;
 
+    // Temporaries come from the same memory as the notes.
+    auto memory = m_notes.get_allocator().resource();
+
     // Return a vector of indices where consonance peaks after crossing the midpoint.
-    auto points_of_interest = [](Vd& in) {
-        std::vector<std::size_t> ps;
+    auto points_of_interest = [memory](const std::pmr::vector<double>& in) {
+        std::pmr::vector<std::size_t> ps(memory);
         auto [min, max] = std::minmax_element(in.begin(), in.end() - in.size()/2);
         if (min == in.end() || max == in.end())
             return ps;
@@ -232,23 +565,19 @@ void Phrase::edit()
         return ps;
     };
 
-    // Make a running consonance measure.
-    Vd time, pitch, cons;
-    std::deque<Note> notes;
+    // Make a running consonance measure over windows of bin notes.  Each window is
+    // independent, so long phrases are measured in parallel.
     const std::size_t bin = std::min(m_notes.size()/4, std::size_t(note_bin_size));
-    for (const auto& n : m_notes)
-    {
-        notes.push_back(n);
-        if (notes.size() < bin)
-            continue;
-        time.push_back(n.time);
-        pitch.push_back(n.pitch);
-        cons.push_back(-discord(notes));
-        notes.pop_front();
-    }
+    const auto window = std::max(bin, std::size_t(1));
+    std::pmr::vector<double> cons(m_notes.size() - window + 1, memory);
+    Thread_Pool::current().parallel_for(
+        cons.size(), consonance_grain, [&](std::size_t begin, std::size_t end) {
+            for (auto i = begin; i < end; ++i)
+                cons[i] = -discord(std::span(m_notes).subspan(i, window));
+        });
 
     auto poi = points_of_interest(cons);
-    VNote edited;
+    VNote edited(memory);
     double end_time = 0.0;
     for (std::size_t ip = 0; ip < poi.size(); ++ip)
     {
@@ -261,50 +590,236 @@ void Phrase::edit()
         }
         end_time = edited.back().time;
     }
-    m_notes = edited;
+    m_notes = std::move(edited);
 }
 
-const VNote& Phrase::notes() const
+std::span<const Note> Phrase::notes() const
 {
     return m_notes;
 }
 
-void Phrase::append_notes(const VNote& notes)
+void Phrase::append_notes(std::span<const Note> notes)
 {
+    auto start = m_notes.size();
     m_notes.insert(m_notes.end(), notes.begin(), notes.end());
-    std::sort(m_notes.begin(), m_notes.end());
+    std::stable_sort(m_notes.begin() + start, m_notes.end());
+    merge_from(start);
 }
 
-std::ostream& Phrase::write_midi(std::ostream& os, bool monophonic)
+void Phrase::append_notes(std::pmr::vector<Note>&& notes)
 {
-    Midi_File midi(m_tempo, 96);
+    std::stable_sort(notes.begin(), notes.end());
+    if (m_notes.empty() && notes.get_allocator() == m_notes.get_allocator())
+        m_notes = std::move(notes);
+    else
+        append_sorted_notes(notes);
+}
 
-    std::multiset<Note> waiting(m_notes.begin(), m_notes.end());
+void Phrase::append_sorted_notes(std::span<const Note> notes)
+{
+    assert(std::is_sorted(notes.begin(), notes.end()));
+    auto start = m_notes.size();
+    m_notes.insert(m_notes.end(), notes.begin(), notes.end());
+    merge_from(start);
+}
 
-    auto note_off_time = [this, waiting, monophonic](const Note& note) {
-        if (monophonic)
-            for (auto& n : waiting)
-                if (n.duration != 0.0 && n.time > note.time)
-                    return n.time;
-        return note.time + note.duration;
-    };
+void Phrase::merge_from(std::size_t start)
+{
+    auto middle = m_notes.begin() + start;
+    // Nothing to do if the new notes all come after the old ones.
+    if (start > 0 && middle != m_notes.end() && *middle < *(middle - 1))
+        std::inplace_merge(m_notes.begin(), middle, m_notes.end());
+}
 
-    double last_time = -1.0;
-    while (!waiting.empty())
+std::size_t Phrase::write_midi(std::ostream& os, int tonic, bool monophonic, bool compact)
+{
+    Midi_File midi(m_tempo, 96, 0, compact);
+    add_events(m_notes, tonic, monophonic, midi, m_notes.get_allocator().resource());
+    midi.write(os);
+    return midi.compact_savings();
+}
+
+std::size_t Phrase::stream_midi(const std::filesystem::path& file, int tonic,
+                                bool monophonic, bool compact)
+{
+    Midi_Stream midi(file, m_tempo, 96, 0, compact);
+    add_events(m_notes, tonic, monophonic, midi, m_notes.get_allocator().resource());
+    midi.close();
+    return midi.compact_savings();
+}
+
+namespace
+{
+    /// The body of compose_segments().  Random numbers continue from the given state.  It's
+    /// swapped into the generator of the thread that resumes the coroutine while a segment
+    /// is composed.
+    Generator<std::vector<Note>> compose_segments_from(Random_State random, double tempo,
+                                                       int voices, int max_range,
+                                                       bool chromatic, int passes,
+                                                       double beats, Note_Budget budget)
     {
-        const auto& note = waiting.extract(waiting.begin()).value();
-        bool on = note.duration != 0.0;
-       if (note.time < 0.0 || (monophonic && on && note.time == last_time))
-            continue;
-        midi.add_note(note.time, on, note.pitch, note.volume);
-        if (on)
+        VNote history;
+        double start = 0.0;
+        int empty = 0;
+        while (start < beats && empty < max_empty_segments)
         {
-            // Insert a note-off event.
-            waiting.emplace(note_off_time(note), 0.0, note.volume, note.pitch);
-            last_time = note.time;
+            // The history notes give compose() its starting pitches.  Mark them with a
+            // negative generation so they can be dropped after editing.  Passes are
+            // numbered from 0.  Each segment's memory is released at once when it's done.
+            for (auto& n : history)
+                n.generation = -1;
+            std::pmr::monotonic_buffer_resource arena;
+            Phrase phrase(tempo, history, &arena);
+            auto thread_random = random_state();
+            set_random_state(random);
+            for (int i = 0; i < passes; ++i)
+            {
+                phrase.compose(voices, max_range, chromatic, budget);
+                phrase.edit();
+            }
+            random = random_state();
+            set_random_state(thread_random);
+
+            VNote segment;
+            for (const auto& n : phrase.notes())
+                if (n.generation >= 0)
+                    segment.push_back(n);
+            std::stable_sort(segment.begin(), segment.end());
+            empty = segment.empty() ? empty + 1 : 0;
+
+            // Keep the last notes for the next segment with times starting from 0.
+            auto keep = std::min(segment.size(), static_cast<std::size_t>(voices));
+            history.assign(segment.end() - keep, segment.end());
+            auto first = history.empty() ? 0.0 : history.front().time;
+            for (auto& n : history)
+                n.time -= first;
+
+            double end = 0.0;
+            for (auto& n : segment)
+            {
+                end = std::max(end, n.time + n.duration);
+                n.time += start;
+            }
+            std::erase_if(segment, [beats](const Note& n) { return n.time >= beats; });
+            start += end;
+            if (!segment.empty())
+                co_yield std::move(segment);
         }
     }
+}
 
-    midi.write(os);
-    return os;
+Generator<std::vector<Note>> compose_segments(double tempo, int voices, int max_range,
+                                              bool chromatic, int passes, double beats,
+                                              Note_Budget budget)
+{
+    return compose_segments_from(random_state(), tempo, voices, max_range, chromatic,
+                                 passes, beats, budget);
+}
+
+std::size_t stream_midi(Generator<Note> notes, const std::filesystem::path& file,
+                        double tempo, int tonic, bool monophonic, bool compact)
+{
+    Midi_Stream midi(file, tempo, 96, 0, compact);
+    Event_Scheduler scheduler(midi, tonic, monophonic);
+    for (const auto& note : notes)
+        scheduler.add(note);
+    scheduler.finish();
+    midi.close();
+    return midi.compact_savings();
+}
+
+Generator<Midi_Message> stream_events(Generator<Note> notes, double tempo, int tonic,
+                                      bool monophonic)
+{
+    Message_Track track(tempo);
+    Event_Scheduler scheduler(track, tonic, monophonic);
+    for (const auto& note : notes)
+    {
+        // Events come out of the scheduler in time order once nothing can precede them.
+        scheduler.add(note);
+        for (const auto& message : track.messages())
+            co_yield message;
+        track.clear();
+    }
+    scheduler.finish();
+    for (const auto& message : track.messages())
+        co_yield message;
+}
+
+Generator<std::span<const float>> stream_audio(Generator<Note> notes, double tempo,
+                                               int tonic, bool monophonic,
+                                               unsigned sample_rate, std::size_t block_size)
+{
+    Audio_Stream stream(sample_rate);
+    Stream_Track track(stream, tempo);
+    Event_Scheduler scheduler(track, tonic, monophonic);
+    std::vector<float> block(block_size);
+    for (const auto& note : notes)
+    {
+        scheduler.add(note);
+        // Every later event is at this note's time or after.  Samples before then are
+        // done.
+        auto done = note.time*60.0/tempo*sample_rate;
+        while (stream.position() + block_size <= done)
+        {
+            stream.render(block);
+            co_yield block;
+        }
+    }
+    scheduler.finish();
+    while (stream.sounding())
+    {
+        stream.render(block);
+        co_yield block;
+    }
+}
+
+std::vector<Audio_Note> Phrase::audio_notes(int tonic, bool monophonic) const
+{
+    Audio_Track track(m_tempo);
+    add_events(m_notes, tonic, monophonic, track, m_notes.get_allocator().resource());
+    return track.take_notes();
+}
+
+void Phrase::write_wav(std::ostream& os, int tonic, bool monophonic, unsigned bits,
+                       unsigned sample_rate) const
+{
+    ::write_wav(os, render_notes(audio_notes(tonic, monophonic), sample_rate), sample_rate,
+                bits);
+}
+
+std::size_t Phrase::write_midi_tracks(std::ostream& os, int tonic, bool monophonic,
+                                      bool compact)
+{
+    // Split the notes by generation.  Each generation's notes are in the same order as in
+    // the phrase.
+    std::pmr::map<int, VNote> generations(m_notes.get_allocator().resource());
+    for (const auto& n : m_notes)
+        generations[n.generation].push_back(n);
+
+    std::vector<const VNote*> track_notes;
+    std::vector<Midi_File> tracks;
+    std::size_t channel = 0;
+    for (const auto& [generation, notes] : generations)
+    {
+        // Skip channel 10, which is for percussion in General MIDI.
+        if (channel == 9)
+            ++channel;
+        track_notes.push_back(&notes);
+        tracks.emplace_back(m_tempo, 96, channel, compact);
+        channel = (channel + 1) % 16;
+    }
+
+    // Encode the tracks in parallel.
+    Thread_Pool::current().parallel_for(tracks.size(), [&](std::size_t i) {
+        // The phrase's memory isn't shared between threads.
+        std::pmr::monotonic_buffer_resource arena;
+        add_events(*track_notes[i], tonic, monophonic, tracks[i], &arena);
+    });
+
+    std::size_t savings = 0;
+    for (const auto& track : tracks)
+        savings += track.compact_savings();
+    Midi_File::write_tracks(os, tracks);
+    return savings;
 }
@@ -16,56 +16,176 @@
 #ifndef COMPOSURE_COMPOSURE_PHRASE_HH_INCLUDED
 #define COMPOSURE_COMPOSURE_PHRASE_HH_INCLUDED
 
+#include "generator.hh"
+
+#include <filesystem>
 #include <iosfwd>
+#include <limits>
+#include <memory_resource>
+#include <span>
 #include <string>
 #include <vector>
 
+struct Audio_Note;
+struct Midi_Message;
+
 /// A single musical note.
 struct Note
 {
     double time; ///< The time when the note starts, in beats.
     double duration; ///< beats
     double volume; ///< 0 to 1
-    double pitch;  ///< MIDI note: 60 + (half steps from middle C).
+    double pitch;  ///< Half steps from the tonic.  Add the MIDI note of the tonic to get the
+                   ///< MIDI note of the pitch.
     int generation; ///< Incremented for each "compose" pass.
 };
 
+/// Limits on the number of notes composed.  Composition stops at the end of the step
+/// where a limit is reached, so a limit may be exceeded by up to one note per voice.
+struct Note_Budget
+{
+    /// The most notes a single call to Phrase::compose() adds.
+    std::size_t pass = std::numeric_limits<std::size_t>::max();
+    /// Phrase::compose() adds no more notes once the phrase has this many.
+    std::size_t total = 1000;
+};
+
 /// A sequence of notes, possibly overlapping in time.
 class Phrase
 {
-    using VNote = std::vector<Note>;
+    using VNote = std::pmr::vector<Note>;
 
 public:
-    Phrase(double tempo);
+    /// @param memory Where the notes, the temporaries of compose() and edit(), and the
+    ///     event queues of the MIDI writers are allocated.  With a per-composition
+    ///     std::pmr::monotonic_buffer_resource, all of it is released at once.  It must
+    ///     outlive the phrase and must not be shared with other threads.
+    Phrase(double tempo, std::pmr::memory_resource* memory = std::pmr::get_default_resource());
+    /// Start with existing notes, e.g. a previously composed phrase.
+    /// @param notes Notes sorted by time.  They are copied in the given order.
+    Phrase(double tempo, std::span<const Note> notes,
+           std::pmr::memory_resource* memory = std::pmr::get_default_resource());
+    /// Load notes from a file: .notes or .bnotes as written by composure, or a standard
+    /// MIDI file (.midi or .mid).  Throws Bad_Notes_File if the type isn't recognized or
+    /// a notes file can't be parsed, or Bad_Midi_File if a MIDI file can't be parsed.
+    /// @param tempo The tempo of the phrase.  For a .notes file, this must be the tempo it
+    ///     was written at, since its times are in seconds.
+    /// @param tonic The MIDI note number of the tonic.  Pitches are stored relative to it.
+    Phrase(const std::filesystem::path& file, double tempo, int tonic,
+           std::pmr::memory_resource* memory = std::pmr::get_default_resource());
 
-    /// Generate notes and add them to a Phrase.
-    /// @param phrase A set of notes to add to, using the notes at the end as a starting
-    ///     point.  If phrase is empty, copies of tonic are used as the starting point.
-    /// @param tonic A the MIDI note number for the tonic of the key.  60 is middle C, 61 is a
-    ///     half step higher, etc.  All generated notes are in the key.
+    /// Generate notes and add them to a Phrase.  The notes at the end of the phrase are
+    /// used as a starting point.  If the phrase is empty, copies of tonic are used as the
+    /// starting point.  Composition doesn't depend on the key.  Pitches are relative to the
+    /// tonic, and the key is chosen when the phrase is rendered.
     /// @param voices The number of voices in the generated phrase.
     /// @param max_range Note generation stops when the number of half steps between the
     ///    highest and lowest note in the voices exceeds this value.
-    /// @return A Phrase with generated notes.
-    void compose(int tonic, int voices, int max_range, bool chromatic);
+    /// @param chromatic If false, all generated notes are in the key.
+    /// @param budget Limits on the number of notes.  Space for them is reserved up front
+    ///     unless the budget is unlimited.
+    void compose(int voices, int max_range, bool chromatic, const Note_Budget& budget = {});
+    /// Generate the notes that compose() would add, without adding them.  Each note is
+    /// yielded in time order as soon as no later note can start before it, so consumers
+    /// can start after the first few beats.  Notes with the same start time may come in a
+    /// different order than after compose().  The phrase must outlive the generator.
+    Generator<Note> generate(int voices, int max_range, bool chromatic,
+                             Note_Budget budget = {}) const;
 
     /// A fitness function determines points of interest in the Phrase.  Sections that start
     /// at those points are extracted, spliced and returned.  The sections may overlap.
     void edit();
 
-    /// Append notes to the end of the phrase.
-    void append_notes(const VNote& notes);
+    /// Add notes to the phrase.  The new notes are sorted by time and merged in.  Notes
+    /// with the same time as existing notes go after them.  The cost is O(k log k + n) for
+    /// k new notes and n existing ones.
+    void append_notes(std::span<const Note> notes);
+    /// Add notes to the phrase.  They're sorted in place.  If the phrase is empty and uses
+    /// the same memory resource, the buffer is taken over without copying.
+    void append_notes(std::pmr::vector<Note>&& notes);
+    /// Add notes that are already sorted by time.  They're merged in without sorting.
+    void append_sorted_notes(std::span<const Note> notes);
     /// Read-only note access.
-    const VNote& notes() const;
+    std::span<const Note> notes() const;
 
     /// Write the phrase to a file in MIDI format.
-    std::ostream& write_midi(std::ostream& os, bool monophonic);
+    /// @param tonic The MIDI note number for the tonic of the key.  60 is middle C, 61 is a
+    ///     half step higher, etc.
+    /// @param compact If true, use running status for all note events.  See Midi_File.
+    /// @return The number of bytes the compact encoding saves, or would save.
+    std::size_t write_midi(std::ostream& os, int tonic, bool monophonic,
+                           bool compact = false);
+    /// Write the phrase to a MIDI file as the events are generated.  The file is the same
+    /// as the one write_midi() gives.  Throws Midi_Not_Written on failure.
+    std::size_t stream_midi(const std::filesystem::path& file, int tonic, bool monophonic,
+                            bool compact = false);
+    /// @return The notes as a synthesizer playing the output of write_midi() would hold
+    ///     them, with times in seconds, for rendering audio.
+    std::vector<Audio_Note> audio_notes(int tonic, bool monophonic) const;
+    /// Render the phrase to a mono PCM WAV file with the built-in voice.  Notes are held
+    /// as they would be by a synthesizer playing the output of write_midi().  See
+    /// render_notes() and ::write_wav().
+    void write_wav(std::ostream& os, int tonic, bool monophonic, unsigned bits = 16,
+                   unsigned sample_rate = 44100) const;
+    /// Write the phrase to a file in multi-track MIDI format.  Each generation gets its
+    /// own track and channel.  The tracks are encoded in parallel.
+    std::size_t write_midi_tracks(std::ostream& os, int tonic, bool monophonic,
+                                  bool compact = false);
 
 private:
+    /// Yield notes for compose() in the order they're composed.  Each step of the
+    /// algorithm gives one note per voice, going back in time from the end of the phrase.
+    Generator<Note> compose_notes(int voices, int max_range, bool chromatic,
+                                  Note_Budget budget) const;
+    /// Merge the sorted notes from index start to the end into the sorted notes before
+    /// them.
+    void merge_from(std::size_t start);
+
     double m_tempo; ///< Tempo in beat/min.
     VNote m_notes; ///< The notes in the composition so far.
     std::string m_log; ///< Messages for the log file.
     int m_generation = 0; ///< A count of the number of calls to compose()>
 };
 
+/// Compose a piece of any length in segments.  Each segment is a phrase composed and
+/// edited with the given number of passes, like a whole piece.  The first pass continues
+/// from the last few notes of the previous segment.  Only the current segment and that
+/// history are held in memory, so memory use doesn't depend on the length of the piece.
+/// Random numbers continue from the calling thread's generator as it is when this is
+/// called.  The state is kept between segments, so the generator can be resumed on any
+/// thread, and the generators of the threads that resume it aren't changed.
+/// @param beats Notes that start at or after this time aren't yielded.
+/// @param budget Limits on the number of notes in each segment.
+/// @return Segments of notes in time order.  Times are from the start of the piece.
+///     Generation is the pass within the segment.  Stops early if several segments in a row
+///     come out empty.
+Generator<std::vector<Note>> compose_segments(double tempo, int voices, int max_range,
+                                              bool chromatic, int passes, double beats,
+                                              Note_Budget budget = {});
+
+/// Write notes to a MIDI file as they're generated.  Events are scheduled incrementally,
+/// so only the sounding notes are held in memory.  Throws Midi_Not_Written on failure.
+/// @param notes Notes in time order, e.g. from Phrase::generate().
+/// @return See Phrase::write_midi().
+std::size_t stream_midi(Generator<Note> notes, const std::filesystem::path& file,
+                        double tempo, int tonic, bool monophonic, bool compact = false);
+
+/// Turn notes into MIDI messages as they're generated.  The messages are the events
+/// stream_midi() would write, with times in seconds instead of ticks.  A message is
+/// yielded as soon as no later note can come before it.
+/// @param notes Notes in time order.
+Generator<Midi_Message> stream_events(Generator<Note> notes, double tempo, int tonic,
+                                      bool monophonic);
+
+/// Render notes to audio as they're generated.  Notes are held as they would be by a
+/// synthesizer playing the output of stream_midi().  A block is yielded as soon as no
+/// later note can change it, so composition can run between blocks.
+/// @param notes Notes in time order.
+/// @return Blocks of block_size samples, until the last note has decayed.  The span is
+///     valid until the generator is advanced.
+Generator<std::span<const float>> stream_audio(Generator<Note> notes, double tempo,
+                                               int tonic, bool monophonic,
+                                               unsigned sample_rate = 44100,
+                                               std::size_t block_size = 1024);
+
 #endif // COMPOSURE_COMPOSURE_PHRASE_HH_INCLUDED
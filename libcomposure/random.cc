@@ -19,8 +19,8 @@
 #include <random>
 #include <stdexcept>
 
-std::random_device random_device;
-std::mt19937 random_generator(random_device());
+// Each thread has its own generator, so pieces can be composed in parallel.
+thread_local Random_State random_generator(std::random_device{}());
 
 class Bad_Weights : public std::runtime_error
 {
@@ -35,6 +35,16 @@ void set_random_seed(unsigned int s)
     random_generator.seed(s);
 }
 
+Random_State random_state()
+{
+    return random_generator;
+}
+
+void set_random_state(const Random_State& state)
+{
+    random_generator = state;
+}
+
 int pick(int low, int high, int low_weight, int high_weight)
 {
     std::vector<double> pool(high - low + 1);
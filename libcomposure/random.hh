@@ -17,11 +17,20 @@
 #define COMPOSURE_COMPOSURE_RANDOM_HH_INCLUDED
 
 #include <functional>
+#include <random>
 #include <vector>
 
-/// Set a seed for reproducible output.
+/// Set a seed for reproducible output.  Each thread has its own generator, and the seed
+/// only affects the calling thread.
 void set_random_seed(unsigned int s);
 
+/// The state of a thread's random generator.
+using Random_State = std::mt19937;
+/// @return A copy of the calling thread's generator.
+Random_State random_state();
+/// Replace the calling thread's generator, e.g. to continue a sequence on another thread.
+void set_random_state(const Random_State& state);
+
 /// @return A random integer from low to high, inclusive, with linear weighting.
 int pick(int low, int high, int low_weight = 1, int high_weight = 1);
 /// @return A random number from 0 to weights.size() - 1, weighted by the elements in
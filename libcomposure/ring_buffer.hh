@@ -0,0 +1,88 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_RING_BUFFER_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_RING_BUFFER_HH_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+/// A fixed-size queue for passing values from one producer thread to one consumer thread
+/// without locks.  The producer only writes the head and the consumer only writes the
+/// tail.  Each side publishes its index with release ordering after copying the values,
+/// and reads the other side's index with acquire ordering before copying.
+template <typename T>
+class Spsc_Ring
+{
+public:
+    /// @param capacity The most values the ring holds.  Rounded up to a power of 2.
+    explicit Spsc_Ring(std::size_t capacity)
+        : m_data(std::bit_ceil(std::max<std::size_t>(capacity, 1))),
+          m_mask(m_data.size() - 1)
+    {}
+
+    /// Copy as many values as there's room for.  Only call from the producer thread.
+    /// @return The number of values copied.
+    std::size_t push(std::span<const T> values)
+    {
+        auto head = m_head.load(std::memory_order_relaxed);
+        auto tail = m_tail.load(std::memory_order_acquire);
+        auto n = std::min(values.size(), capacity() - (head - tail));
+        for (std::size_t i = 0; i < n; ++i)
+            m_data[(head + i) & m_mask] = values[i];
+        m_head.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    /// Copy out as many values as are available, up to out.size().  Only call from the
+    /// consumer thread.
+    /// @return The number of values copied.
+    std::size_t pop(std::span<T> out)
+    {
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        auto head = m_head.load(std::memory_order_acquire);
+        auto n = std::min(out.size(), head - tail);
+        for (std::size_t i = 0; i < n; ++i)
+            out[i] = m_data[(tail + i) & m_mask];
+        m_tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    /// @return The number of values in the ring.  It may change as soon as it's read.
+    std::size_t size() const
+    {
+        // Read the tail first so the size can't come out negative.
+        auto tail = m_tail.load(std::memory_order_acquire);
+        return m_head.load(std::memory_order_acquire) - tail;
+    }
+    std::size_t capacity() const
+    {
+        return m_data.size();
+    }
+
+private:
+    std::vector<T> m_data;
+    std::size_t m_mask; ///< Indexes wrap with a mask instead of modulo.
+    /// The indexes count up without wrapping.  They're on separate cache lines so the two
+    /// threads don't contend for them.
+    alignas(64) std::atomic<std::size_t> m_head = 0; ///< The next value to write.
+    alignas(64) std::atomic<std::size_t> m_tail = 0; ///< The next value to read.
+};
+
+#endif // COMPOSURE_COMPOSURE_RING_BUFFER_HH_INCLUDED
@@ -0,0 +1,214 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "server.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+    /// The longest request accepted.  A connection that sends a longer line is closed.
+    constexpr std::size_t max_request_size = 1 << 16;
+    /// The number of connections that can wait for a worker.
+    constexpr int backlog = 64;
+
+    std::string error_text(const std::string& what)
+    {
+        return what + ": " + std::strerror(errno);
+    }
+
+    /// Wait until fd is readable or the server is stopping.
+    /// @return False if the server is stopping.
+    bool wait_readable(int fd, int stop_fd)
+    {
+        pollfd fds[] = {{fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+        while (::poll(fds, 2, -1) < 0)
+            if (errno != EINTR)
+                return false;
+        return fds[1].revents == 0;
+    }
+
+    /// Send all of a buffer.  The connection's reader going away is an error, not a signal.
+    /// @return True on success.
+    bool send_all(int fd, const std::string& data)
+    {
+        for (std::size_t sent = 0; sent < data.size();)
+        {
+            auto n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+}
+
+Socket_Server::Socket_Server(const std::filesystem::path& path, Handler handler,
+                             unsigned workers)
+    : m_path(path),
+      m_handler(std::move(handler)),
+      m_workers(workers > 0 ? workers : std::max(1u, std::thread::hardware_concurrency()))
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.native().size() >= sizeof(address.sun_path))
+        throw Server_Error("socket path is too long: " + path.string());
+    std::strcpy(address.sun_path, path.c_str());
+
+    // Replace a socket left by a server that didn't shut down, but not other files.
+    struct stat info;
+    if (::lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+        ::unlink(path.c_str());
+
+    // Non-blocking so run() can empty it.
+    if (::pipe2(m_stop_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+        throw Server_Error(error_text("pipe"));
+    m_socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_socket < 0
+        || ::bind(m_socket, reinterpret_cast<sockaddr*>(&address), sizeof address) != 0
+        || ::listen(m_socket, backlog) != 0)
+    {
+        auto what = error_text(path.string());
+        for (auto fd : {m_socket, m_stop_pipe[0], m_stop_pipe[1]})
+            if (fd >= 0)
+                ::close(fd);
+        throw Server_Error(what);
+    }
+}
+
+Socket_Server::~Socket_Server()
+{
+    for (auto fd : {m_socket, m_stop_pipe[0], m_stop_pipe[1]})
+        ::close(fd);
+    ::unlink(m_path.c_str());
+}
+
+void Socket_Server::run()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = false;
+    }
+    std::vector<std::jthread> workers;
+    for (unsigned i = 0; i < m_workers; ++i)
+        workers.emplace_back([this] { work(); });
+
+    while (wait_readable(m_socket, m_stop_pipe[0]))
+    {
+        auto fd = ::accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        {
+            std::lock_guard lock(m_mutex);
+            m_connections.push_back(fd);
+        }
+        m_ready.notify_one();
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+        for (auto fd : m_connections)
+            ::close(fd);
+        m_connections.clear();
+    }
+    m_ready.notify_all();
+
+    // Once the workers are done, empty the pipe so the server can be run again.
+    workers.clear();
+    char bytes[16];
+    while (::read(m_stop_pipe[0], bytes, sizeof bytes) > 0)
+        ;
+}
+
+void Socket_Server::stop()
+{
+    // Only async-signal-safe calls here.  The pipe stays readable, so every wait wakes.
+    char byte = 0;
+    [[maybe_unused]] auto n = ::write(m_stop_pipe[1], &byte, 1);
+}
+
+unsigned Socket_Server::workers() const
+{
+    return m_workers;
+}
+
+void Socket_Server::work()
+{
+    while (true)
+    {
+        int fd;
+        {
+            std::unique_lock lock(m_mutex);
+            m_ready.wait(lock, [this] { return m_stopping || !m_connections.empty(); });
+            if (m_stopping)
+                return;
+            fd = m_connections.front();
+            m_connections.pop_front();
+        }
+        serve(fd);
+        ::close(fd);
+    }
+}
+
+void Socket_Server::serve(int fd)
+{
+    std::string buffer;
+    char block[4096];
+    while (wait_readable(fd, m_stop_pipe[0]))
+    {
+        auto n = ::recv(fd, block, sizeof block, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buffer.append(block, n);
+
+        // Answer each complete line.
+        std::size_t start = 0;
+        for (auto end = buffer.find('\n'); end != std::string::npos;
+             end = buffer.find('\n', start))
+        {
+            std::string response;
+            try
+            {
+                response = m_handler(buffer.substr(start, end - start));
+            }
+            catch (...)
+            {
+                return;
+            }
+            if (!send_all(fd, response))
+                return;
+            start = end + 1;
+        }
+        buffer.erase(0, start);
+        if (buffer.size() > max_request_size)
+            return;
+    }
+}
@@ -0,0 +1,85 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_SERVER_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_SERVER_HH_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+/// Exception thrown if the server's socket can't be set up.
+class Server_Error : public std::runtime_error
+{
+public:
+    Server_Error(const std::string& what)
+        : std::runtime_error("Server error: " + what)
+    {}
+};
+
+/// A server for requests on a UNIX domain socket.  Each request is a line of text, and the
+/// response is whatever the handler returns for it.  A connection may send any number of
+/// requests.  The worker threads are started once by run() and wait for connections, so
+/// a request doesn't pay for starting a process or a thread.  Each connection is served
+/// by one worker until it's closed, so the number of workers limits the number of
+/// connections served at once.  Others wait in the accept queue.
+class Socket_Server
+{
+public:
+    /// Called on a worker thread with a request without its newline.  Exceptions close the
+    /// connection.
+    using Handler = std::function<std::string(const std::string& request)>;
+
+    /// Create and bind the socket.  A socket file left at the path by an earlier server
+    /// is replaced.  Throws Server_Error if the socket can't be created.
+    /// @param workers The number of worker threads.  0 for one per core.
+    Socket_Server(const std::filesystem::path& path, Handler handler, unsigned workers = 0);
+    /// Close the socket and remove the file.
+    ~Socket_Server();
+    Socket_Server(const Socket_Server&) = delete;
+    Socket_Server& operator=(const Socket_Server&) = delete;
+
+    /// Accept connections until stop() is called.  Returns when the workers have finished
+    /// the requests they're handling.  Open connections are closed.  The server may be
+    /// run again after it returns.
+    void run();
+    /// Make run() return.  Safe to call from any thread or from a signal handler.
+    void stop();
+
+    /// @return The number of worker threads.
+    unsigned workers() const;
+
+private:
+    /// Take connections from the queue until the server stops.
+    void work();
+    /// Answer requests on a connection until it's closed or the server stops.
+    void serve(int fd);
+
+    std::filesystem::path m_path;
+    Handler m_handler;
+    unsigned m_workers;
+    int m_socket = -1;
+    int m_stop_pipe[2] = {-1, -1}; ///< Readable when the server is stopping.
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<int> m_connections; ///< Accepted connections waiting for a worker.
+    bool m_stopping = false;
+};
+
+#endif // COMPOSURE_COMPOSURE_SERVER_HH_INCLUDED
@@ -0,0 +1,491 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "soundfont.hh"
+#include "mapped_file.hh"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cmath>
+#include <map>
+#include <optional>
+#include <string_view>
+
+namespace
+{
+    /// Generator numbers from the SoundFont 2.01 specification.
+    enum Generator_Type
+    {
+        start_offset = 0,
+        end_offset = 1,
+        loop_start_offset = 2,
+        loop_end_offset = 3,
+        start_coarse_offset = 4,
+        end_coarse_offset = 12,
+        delay_vol_env = 33,
+        attack_vol_env = 34,
+        hold_vol_env = 35,
+        decay_vol_env = 36,
+        sustain_vol_env = 37,
+        release_vol_env = 38,
+        instrument = 41,
+        key_range = 43,
+        velocity_range = 44,
+        loop_start_coarse_offset = 45,
+        attenuation = 48,
+        loop_end_coarse_offset = 50,
+        coarse_tune = 51,
+        fine_tune = 52,
+        sample_id = 53,
+        sample_modes = 54,
+        scale_tuning = 56,
+        root_key = 58,
+        num_generators = 61
+    };
+
+    /// Record sizes in bytes.
+    constexpr std::size_t phdr_size = 38;
+    constexpr std::size_t bag_size = 4;
+    constexpr std::size_t gen_size = 4;
+    constexpr std::size_t inst_size = 22;
+    constexpr std::size_t shdr_size = 46;
+    /// The envelope has dropped this far when a note is silent.
+    constexpr double silence_db = 96.0;
+    /// The envelope is evaluated every this many samples and interpolated in between.
+    constexpr std::size_t control_period = 32;
+
+    std::uint16_t get_u16(std::span<const unsigned char> data, std::size_t pos)
+    {
+        return data[pos] | (data[pos + 1] << 8);
+    }
+
+    std::uint32_t get_u32(std::span<const unsigned char> data, std::size_t pos)
+    {
+        return get_u16(data, pos) | (std::uint32_t(get_u16(data, pos + 2)) << 16);
+    }
+
+    std::string_view get_id(std::span<const unsigned char> data, std::size_t pos)
+    {
+        return {reinterpret_cast<const char*>(data.data() + pos), 4};
+    }
+
+    /// @return The chunks in a list by ID.  Throws Bad_Soundfont if a chunk overruns.
+    std::map<std::string_view, std::span<const unsigned char>>
+    read_chunks(std::span<const unsigned char> data)
+    {
+        std::map<std::string_view, std::span<const unsigned char>> chunks;
+        for (std::size_t pos = 0; pos + 8 <= data.size();)
+        {
+            auto id = get_id(data, pos);
+            auto size = get_u32(data, pos + 4);
+            if (size > data.size() - pos - 8)
+                throw Bad_Soundfont("chunk overruns its list");
+            chunks[id] = data.subspan(pos + 8, size);
+            // Chunks are padded to an even length.
+            pos += 8 + size + (size & 1);
+        }
+        return chunks;
+    }
+
+    /// @return A table from a chunk that ends with a terminal record.  Throws
+    ///     Bad_Soundfont if the table is missing or the wrong size.
+    std::span<const unsigned char> get_table(
+        const std::map<std::string_view, std::span<const unsigned char>>& chunks,
+        std::string_view id, std::size_t record_size)
+    {
+        auto it = chunks.find(id);
+        if (it == chunks.end())
+            throw Bad_Soundfont("no " + std::string(id) + " chunk");
+        if (it->second.size() % record_size != 0 || it->second.size() < record_size)
+            throw Bad_Soundfont("bad " + std::string(id) + " chunk size");
+        return it->second;
+    }
+
+    /// @return Time in seconds from SoundFont timecents.
+    double seconds(int timecents)
+    {
+        return std::pow(2.0, timecents/1200.0);
+    }
+}
+
+/// The generator values for a zone.
+struct Soundfont::Zone
+{
+    std::array<std::uint16_t, num_generators> amount{};
+    std::bitset<num_generators> set;
+
+    /// @return A generator's value, or the default if it's not set.
+    int get(int type, int default_value = 0) const
+    {
+        return set[type] ? static_cast<std::int16_t>(amount[type]) : default_value;
+    }
+    /// @return True if a key or velocity range generator includes x.
+    bool in_range(int type, int x) const
+    {
+        return !set[type]
+            || ((amount[type] & 0xff) <= x && x <= (amount[type] >> 8));
+    }
+    /// Fill in generators that aren't set from a global zone.
+    void inherit(const Zone& global)
+    {
+        for (int i = 0; i < num_generators; ++i)
+            if (!set[i] && global.set[i])
+            {
+                amount[i] = global.amount[i];
+                set[i] = true;
+            }
+    }
+};
+
+struct Soundfont::Instrument
+{
+    std::vector<Zone> zones; ///< Zones with a sample.  Global values are merged in.
+};
+
+struct Soundfont::Preset
+{
+    int program;
+    int bank;
+    std::vector<Zone> zones; ///< Zones with an instrument.  Global values are merged in.
+};
+
+struct Soundfont::Sample
+{
+    std::uint32_t start;
+    std::uint32_t end;
+    std::uint32_t loop_start;
+    std::uint32_t loop_end;
+    std::uint32_t rate;
+    int root_key;
+    int correction; ///< cents
+    bool rom; ///< The sample data isn't in the file.
+};
+
+/// A sample playing a note with an envelope.  Times are in seconds from the start of the
+/// note and positions are in sample frames.
+struct Soundfont::Voice
+{
+    double start; ///< seconds from the start of the piece
+    double held; ///< When the key is released.
+    double length; ///< When the voice is silent.
+    double step; ///< Frames per output sample.
+    double first; ///< The first frame.
+    double last; ///< One past the last frame.
+    double loop_start;
+    double loop_end;
+    int mode; ///< 0: no loop, 1: loop, 3: loop until released.
+    double gain;
+    double delay;
+    double attack;
+    double hold;
+    double decay; ///< The time to drop 96 dB.
+    double sustain_db; ///< Attenuation while held.
+    double release; ///< The time to drop 96 dB after release.
+
+    /// @return The envelope's amplitude at time x.
+    double envelope(double x) const
+    {
+        auto held_level = [this](double x) {
+            if (x < delay)
+                return 0.0;
+            x -= delay;
+            if (x < attack)
+                return x/attack;
+            x -= attack;
+            if (x < hold)
+                return 1.0;
+            x -= hold;
+            auto db = std::min(silence_db*x/decay, sustain_db);
+            return std::pow(10.0, -db/20.0);
+        };
+        if (x < held)
+            return held_level(x);
+        return held_level(held)*std::pow(10.0, -silence_db*(x - held)/release/20.0);
+    }
+
+    /// @return True if the sample loops at time x.
+    bool looping(double x) const
+    {
+        return mode == 1 || (mode == 3 && x < held);
+    }
+
+    /// @return The sample position at output sample n from the start of the note.
+    double position(double n, double sample_rate) const
+    {
+        auto wrap = [this](double p) {
+            return p < loop_end ? p : loop_start + std::fmod(p - loop_start, loop_end - loop_start);
+        };
+        if (mode == 0)
+            return first + n*step;
+        if (looping(n/sample_rate))
+            return wrap(first + n*step);
+        auto n_held = held*sample_rate;
+        return wrap(first + n_held*step) + (n - n_held)*step;
+    }
+};
+
+Soundfont::Soundfont(const std::filesystem::path& file)
+    : m_file(std::make_unique<Mapped_File>(file)),
+      m_data(m_file->data())
+{
+    decode();
+}
+
+Soundfont::Soundfont(std::span<const unsigned char> data)
+    : m_data(data)
+{
+    decode();
+}
+
+Soundfont::~Soundfont() = default;
+
+void Soundfont::decode()
+{
+    if (m_data.size() < 12 || get_id(m_data, 0) != "RIFF" || get_id(m_data, 8) != "sfbk")
+        throw Bad_Soundfont("not a SoundFont 2 file");
+    auto riff_end = 8 + std::min<std::size_t>(get_u32(m_data, 4), m_data.size() - 8);
+    // The top-level chunks are LIST chunks named by the first 4 bytes of their data.  Gather
+    // the chunks in all of them.
+    std::map<std::string_view, std::span<const unsigned char>> chunks;
+    for (std::size_t pos = 12; pos + 8 <= riff_end;)
+    {
+        auto size = get_u32(m_data, pos + 4);
+        if (size > riff_end - pos - 8)
+            throw Bad_Soundfont("chunk overruns the file");
+        if (get_id(m_data, pos) == "LIST" && size >= 4)
+            chunks.merge(read_chunks(m_data.subspan(pos + 12, size - 4)));
+        pos += 8 + size + (size & 1);
+    }
+
+    auto smpl = chunks.find("smpl");
+    if (smpl == chunks.end())
+        throw Bad_Soundfont("no sample data");
+    m_samples = smpl->second;
+    auto frames = m_samples.size()/2;
+
+    auto pgen = get_table(chunks, "pgen", gen_size);
+    auto igen = get_table(chunks, "igen", gen_size);
+    // Read zones from bag and generator tables.  Zones without the given generator are
+    // global and their values are merged into the others.
+    auto read_zones = [](std::span<const unsigned char> bags,
+                         std::span<const unsigned char> gens,
+                         std::size_t bag_begin, std::size_t bag_end, int key_generator) {
+        if (bag_begin > bag_end || bag_end >= bags.size()/bag_size)
+            throw Bad_Soundfont("bad zone index");
+        std::vector<Zone> zones;
+        std::optional<Zone> global;
+        for (auto b = bag_begin; b < bag_end; ++b)
+        {
+            std::size_t gen_begin = get_u16(bags, b*bag_size);
+            std::size_t gen_end = get_u16(bags, (b + 1)*bag_size);
+            if (gen_begin > gen_end || gen_end > gens.size()/gen_size)
+                throw Bad_Soundfont("bad generator index");
+            Zone zone;
+            for (auto g = gen_begin; g < gen_end; ++g)
+            {
+                auto type = get_u16(gens, g*gen_size);
+                if (type < num_generators)
+                {
+                    zone.amount[type] = get_u16(gens, g*gen_size + 2);
+                    zone.set[type] = true;
+                }
+            }
+            if (zone.set[key_generator])
+                zones.push_back(zone);
+            else if (b == bag_begin)
+                global = zone;
+        }
+        if (global)
+            for (auto& zone : zones)
+                zone.inherit(*global);
+        return zones;
+    };
+
+    auto phdr = get_table(chunks, "phdr", phdr_size);
+    auto pbag = get_table(chunks, "pbag", bag_size);
+    for (std::size_t i = 0; i + 1 < phdr.size()/phdr_size; ++i)
+    {
+        auto record = phdr.subspan(i*phdr_size);
+        m_presets.push_back({get_u16(record, 20), get_u16(record, 22),
+                             read_zones(pbag, pgen, get_u16(record, 24),
+                                        get_u16(record, 24 + phdr_size), instrument)});
+    }
+
+    auto inst = get_table(chunks, "inst", inst_size);
+    auto ibag = get_table(chunks, "ibag", bag_size);
+    for (std::size_t i = 0; i + 1 < inst.size()/inst_size; ++i)
+    {
+        auto record = inst.subspan(i*inst_size);
+        m_instruments.push_back({read_zones(ibag, igen, get_u16(record, 20),
+                                            get_u16(record, 20 + inst_size), sample_id)});
+    }
+
+    auto shdr = get_table(chunks, "shdr", shdr_size);
+    for (std::size_t i = 0; i + 1 < shdr.size()/shdr_size; ++i)
+    {
+        auto record = shdr.subspan(i*shdr_size);
+        Sample sample{get_u32(record, 20), get_u32(record, 24), get_u32(record, 28),
+                      get_u32(record, 32), get_u32(record, 36), record[40],
+                      static_cast<std::int8_t>(record[41]),
+                      (get_u16(record, 44) & 0x8000) != 0};
+        if (sample.start > sample.end || sample.end > frames || sample.rate == 0)
+            throw Bad_Soundfont("bad sample header " + std::to_string(i));
+        m_sample_headers.push_back(sample);
+    }
+}
+
+void Soundfont::add_voices(const Preset& preset, const Audio_Note& note,
+                           unsigned sample_rate, std::vector<Voice>& voices) const
+{
+    auto key = 69.0 + 12.0*std::log2(note.frequency/440.0);
+    auto midi_key = static_cast<int>(std::lround(key));
+    auto velocity = static_cast<int>(std::lround(std::clamp(note.amplitude, 0.0, 1.0)*127));
+    for (const auto& pzone : preset.zones)
+    {
+        auto index = static_cast<std::size_t>(pzone.amount[instrument]);
+        if (!pzone.in_range(key_range, midi_key) || !pzone.in_range(velocity_range, velocity)
+            || index >= m_instruments.size())
+            continue;
+        for (const auto& izone : m_instruments[index].zones)
+        {
+            auto sample_index = static_cast<std::size_t>(izone.amount[sample_id]);
+            if (!izone.in_range(key_range, midi_key)
+                || !izone.in_range(velocity_range, velocity)
+                || sample_index >= m_sample_headers.size())
+                continue;
+            const auto& sample = m_sample_headers[sample_index];
+            if (sample.rom)
+                continue;
+            // Preset values are added to instrument values.
+            auto get = [&](int type, int default_value = 0) {
+                return izone.get(type, default_value) + pzone.get(type);
+            };
+            auto offset = [&](int fine, int coarse) {
+                return izone.get(fine) + 32768.0*izone.get(coarse);
+            };
+
+            Voice voice;
+            voice.start = note.start;
+            voice.held = note.stop - note.start;
+            auto frames = m_samples.size()/2.0;
+            voice.first = std::clamp(sample.start + offset(start_offset, start_coarse_offset),
+                                     0.0, frames);
+            voice.last = std::clamp(sample.end + offset(end_offset, end_coarse_offset),
+                                    voice.first, frames);
+            voice.loop_start = std::clamp(
+                sample.loop_start + offset(loop_start_offset, loop_start_coarse_offset),
+                voice.first, voice.last);
+            voice.loop_end = std::clamp(
+                sample.loop_end + offset(loop_end_offset, loop_end_coarse_offset),
+                voice.first, voice.last);
+            voice.mode = izone.get(sample_modes) & 3;
+            if (voice.mode == 2 || voice.loop_end - voice.loop_start < 1.0)
+                voice.mode = 0;
+
+            auto root = izone.get(root_key, -1);
+            if (root < 0)
+                root = sample.root_key;
+            auto cents = (key - root)*get(scale_tuning, 100) + 100.0*get(coarse_tune)
+                + get(fine_tune) + sample.correction;
+            voice.step = std::pow(2.0, cents/1200.0)*sample.rate/sample_rate;
+
+            // Attenuation is in centibels.  Velocity scales the amplitude like the
+            // default velocity-to-attenuation curve, roughly.
+            auto v = velocity/127.0;
+            voice.gain = std::pow(10.0, -std::max(get(attenuation), 0)/200.0)*v*v;
+            voice.delay = seconds(get(delay_vol_env, -12000));
+            voice.attack = seconds(get(attack_vol_env, -12000));
+            voice.hold = seconds(get(hold_vol_env, -12000));
+            voice.decay = seconds(get(decay_vol_env, -12000));
+            voice.sustain_db = std::clamp(get(sustain_vol_env), 0, 1440)/10.0;
+            voice.release = seconds(get(release_vol_env, -12000));
+
+            voice.length = voice.held + voice.release;
+            if (voice.mode == 0)
+                voice.length = std::min(voice.length,
+                                        (voice.last - voice.first)/voice.step/sample_rate);
+            if (voice.length > 0.0 && voice.gain > 0.0)
+                voices.push_back(voice);
+        }
+    }
+}
+
+void Soundfont::render_voice(const Voice& voice, unsigned sample_rate, std::size_t first,
+                             std::span<float> out) const
+{
+    auto frame = [this](std::size_t i) {
+        return static_cast<std::int16_t>(get_u16(m_samples, 2*i))/32768.0;
+    };
+    auto start = static_cast<std::size_t>(std::ceil(voice.start*sample_rate));
+    auto end = static_cast<std::size_t>(std::ceil((voice.start + voice.length)*sample_rate));
+    auto begin = std::max(first, start);
+    end = std::min(end, first + out.size());
+    double env0 = 0.0;
+    double slope = 0.0;
+    for (auto i = begin; i < end; ++i)
+    {
+        auto n = static_cast<double>(i - start);
+        // Evaluate the envelope at control points and interpolate linearly.
+        auto phase = (i - start) % control_period;
+        if (i == begin || phase == 0)
+        {
+            auto n0 = n - phase;
+            env0 = voice.envelope(n0/sample_rate);
+            slope = (voice.envelope((n0 + control_period)/sample_rate) - env0)/control_period;
+            env0 += slope*phase;
+        }
+        auto p = voice.position(n, sample_rate);
+        auto x = n/sample_rate;
+        auto limit = voice.looping(x) ? voice.loop_end : voice.last;
+        if (p >= limit)
+            break;
+        auto k = static_cast<std::size_t>(p);
+        auto frac = p - k;
+        auto next = k + 1 < limit ? frame(k + 1)
+            : voice.looping(x) ? frame(static_cast<std::size_t>(voice.loop_start)) : 0.0;
+        out[i - first] += voice.gain*env0*((1.0 - frac)*frame(k) + frac*next);
+        env0 += slope;
+    }
+}
+
+std::vector<float> Soundfont::render(std::span<const Audio_Note> notes, int program,
+                                     int bank, unsigned sample_rate, unsigned threads) const
+{
+    auto preset = std::find_if(m_presets.begin(), m_presets.end(), [&](const auto& p) {
+        return p.program == program && p.bank == bank;
+    });
+    if (preset == m_presets.end())
+        throw Bad_Soundfont("no preset " + std::to_string(bank) + ':'
+                            + std::to_string(program));
+
+    std::vector<Voice> voices;
+    double end = 0.0;
+    for (const auto& note : notes)
+        add_voices(*preset, note, sample_rate, voices);
+    for (const auto& voice : voices)
+        end = std::max(end, voice.start + voice.length);
+    std::vector<float> samples(static_cast<std::size_t>(std::ceil(end*sample_rate)));
+
+    render_blocks(samples, threads, [&](std::size_t first, std::span<float> out) {
+        auto t1 = double(first)/sample_rate;
+        auto t2 = double(first + out.size())/sample_rate;
+        for (const auto& voice : voices)
+            if (voice.start < t2 && voice.start + voice.length > t1)
+                render_voice(voice, sample_rate, first, out);
+    });
+    normalize(samples);
+    return samples;
+}
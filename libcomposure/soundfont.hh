@@ -0,0 +1,90 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_SOUNDFONT_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_SOUNDFONT_HH_INCLUDED
+
+#include "audio.hh"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class Mapped_File;
+
+/// Exception thrown when a SoundFont file can't be decoded or doesn't have a preset.
+class Bad_Soundfont : public std::runtime_error
+{
+public:
+    Bad_Soundfont(const std::string& what)
+        : std::runtime_error("Bad soundfont: " + what)
+    {}
+};
+
+/// Sampled instruments from a SoundFont 2 file.  The preset and instrument tables are
+/// decoded when the file is opened.  The sample data is read in place from the mapped
+/// file, so opening a large font is fast and only the samples that are played are paged
+/// in.
+///
+/// The supported generators are key and velocity ranges, sample address offsets, loop
+/// modes, root key, coarse and fine tuning, scale tuning, attenuation, and the volume
+/// envelope.  Modulators, filters, LFOs, effects, and 24-bit samples are ignored.
+class Soundfont
+{
+public:
+    /// Map a file and decode its tables.  Throws File_Not_Mapped if the file can't be
+    /// read, or Bad_Soundfont if it's malformed.
+    Soundfont(const std::filesystem::path& file);
+    /// Decode a font in memory.  The data must outlive the object.
+    Soundfont(std::span<const unsigned char> data);
+    ~Soundfont();
+
+    /// Render notes with a preset.  Each note's frequency selects the key, and its
+    /// amplitude the velocity.  Samples are linearly interpolated.  Blocks of time are
+    /// rendered in parallel, and the mix is scaled so the peak is at -1 dBFS.  Throws
+    /// Bad_Soundfont if the font doesn't have the preset.
+    /// @param threads The most blocks rendered at once.  0 for the pool's concurrency.
+    std::vector<float> render(std::span<const Audio_Note> notes, int program, int bank,
+                              unsigned sample_rate, unsigned threads = 0) const;
+
+private:
+    // Defined in soundfont.cc
+    struct Zone;
+    struct Instrument;
+    struct Preset;
+    struct Sample;
+    struct Voice;
+
+    void decode();
+    /// Add the voices that play a note.
+    void add_voices(const Preset& preset, const Audio_Note& note, unsigned sample_rate,
+                    std::vector<Voice>& voices) const;
+    /// Add a voice's samples from first to first + out.size() to out.
+    void render_voice(const Voice& voice, unsigned sample_rate, std::size_t first,
+                      std::span<float> out) const;
+
+    std::unique_ptr<Mapped_File> m_file; ///< Keeps the data mapped if the font owns it.
+    std::span<const unsigned char> m_data;
+    std::span<const unsigned char> m_samples; ///< The smpl chunk: 16-bit little-endian.
+    std::vector<Preset> m_presets;
+    std::vector<Instrument> m_instruments;
+    std::vector<Sample> m_sample_headers;
+};
+
+#endif // COMPOSURE_COMPOSURE_SOUNDFONT_HH_INCLUDED
@@ -0,0 +1,229 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "thread_pool.hh"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+namespace
+{
+    /// The pool the calling thread is running tasks for, if any.
+    thread_local Thread_Pool* t_pool = nullptr;
+    /// The index of the calling thread's deque in t_pool.
+    thread_local std::size_t t_queue = 0;
+    /// The group of the task the calling thread is running, if any.
+    thread_local const void* t_group = nullptr;
+}
+
+Thread_Pool::Thread_Pool(unsigned concurrency)
+    : m_concurrency(concurrency > 0 ? concurrency
+                    : std::max(1u, std::thread::hardware_concurrency()))
+{
+    for (unsigned i = 0; i < m_concurrency; ++i)
+        m_queues.push_back(std::make_unique<Queue>());
+    for (unsigned i = 0; i + 1 < m_concurrency; ++i)
+        m_threads.emplace_back([this, i] { work(i); });
+}
+
+Thread_Pool::~Thread_Pool()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_changed.notify_all();
+}
+
+unsigned Thread_Pool::concurrency() const
+{
+    return m_concurrency;
+}
+
+void Thread_Pool::parallel_for(std::size_t count, std::size_t grain,
+                               const std::function<void(std::size_t, std::size_t)>& body)
+{
+    grain = std::max<std::size_t>(grain, 1);
+    auto tasks = (count + grain - 1)/grain;
+    if (tasks == 0)
+        return;
+
+    // Nested calls from the tasks go to this pool.  A thread that isn't one of the
+    // workers uses the shared deque.
+    auto outer_pool = t_pool;
+    auto outer_queue = t_queue;
+    if (t_pool != this)
+    {
+        t_pool = this;
+        t_queue = m_queues.size() - 1;
+    }
+    struct Restore
+    {
+        Thread_Pool* pool;
+        std::size_t queue;
+        ~Restore()
+        {
+            t_pool = pool;
+            t_queue = queue;
+        }
+    } restore{outer_pool, outer_queue};
+
+    if (tasks == 1 || m_concurrency == 1)
+    {
+        for (std::size_t begin = 0; begin < count; begin += grain)
+            body(begin, std::min(begin + grain, count));
+        return;
+    }
+
+    Group group{body, static_cast<const Group*>(t_group), tasks, {}, {}};
+    {
+        // Queue the parts in reverse so this thread takes the first part and thieves
+        // take the last ones.
+        auto& queue = *m_queues[t_queue];
+        std::lock_guard lock(queue.mutex);
+        for (auto t = tasks; t-- > 0;)
+            queue.tasks.push_back({&group, t*grain, std::min((t + 1)*grain, count)});
+        m_queued += tasks;
+    }
+    {
+        std::lock_guard lock(m_mutex);
+        ++m_pushes;
+    }
+    m_changed.notify_all();
+
+    // Help until the group is done.  Tasks from other groups are left to the workers.
+    while (group.remaining > 0)
+    {
+        std::size_t pushes;
+        {
+            std::lock_guard lock(m_mutex);
+            pushes = m_pushes;
+        }
+        if (auto task = find_task(t_queue, &group))
+        {
+            run(*task);
+            continue;
+        }
+        std::unique_lock lock(m_mutex);
+        m_changed.wait(lock, [&] { return group.remaining == 0 || m_pushes != pushes; });
+    }
+    if (group.error)
+        std::rethrow_exception(group.error);
+}
+
+void Thread_Pool::parallel_for(std::size_t count, const std::function<void(std::size_t)>& body)
+{
+    parallel_for(count, 1, [&](std::size_t begin, std::size_t end) {
+        for (auto i = begin; i < end; ++i)
+            body(i);
+    });
+}
+
+Thread_Pool& Thread_Pool::standard()
+{
+    static Thread_Pool pool;
+    return pool;
+}
+
+Thread_Pool& Thread_Pool::current()
+{
+    return t_pool ? *t_pool : standard();
+}
+
+void Thread_Pool::work(std::size_t index)
+{
+    t_pool = this;
+    t_queue = index;
+    while (true)
+    {
+        if (auto task = find_task(index))
+        {
+            run(*task);
+            continue;
+        }
+        std::unique_lock lock(m_mutex);
+        m_changed.wait(lock, [this] { return m_stopping || m_queued > 0; });
+        if (m_stopping)
+            return;
+    }
+}
+
+std::optional<Thread_Pool::Task> Thread_Pool::find_task(std::size_t index,
+                                                        const Group* within)
+{
+    if (m_queued == 0)
+        return std::nullopt;
+    auto wanted = [within](const Task& task) {
+        // A nested group's ancestors are still waiting, so the chain is valid.
+        for (const Group* group = task.group; within && group != within;
+             group = group->parent)
+            if (!group)
+                return false;
+        return true;
+    };
+    {
+        auto& own = *m_queues[index];
+        std::lock_guard lock(own.mutex);
+        auto it = std::find_if(own.tasks.rbegin(), own.tasks.rend(), wanted);
+        if (it != own.tasks.rend())
+        {
+            auto task = *it;
+            own.tasks.erase(std::next(it).base());
+            --m_queued;
+            return task;
+        }
+    }
+    // Start with the next deque so thieves spread out.
+    for (std::size_t i = 1; i < m_queues.size(); ++i)
+    {
+        auto& other = *m_queues[(index + i) % m_queues.size()];
+        std::lock_guard lock(other.mutex);
+        auto it = std::find_if(other.tasks.begin(), other.tasks.end(), wanted);
+        if (it != other.tasks.end())
+        {
+            auto task = *it;
+            other.tasks.erase(it);
+            --m_queued;
+            return task;
+        }
+    }
+    return std::nullopt;
+}
+
+void Thread_Pool::run(const Task& task)
+{
+    auto& group = *task.group;
+    auto outer_group = std::exchange(t_group, &group);
+    try
+    {
+        group.body(task.begin, task.end);
+    }
+    catch (...)
+    {
+        std::lock_guard lock(group.mutex);
+        if (!group.error)
+            group.error = std::current_exception();
+    }
+    t_group = outer_group;
+    // The group may be gone as soon as the count reaches 0.
+    if (group.remaining.fetch_sub(1) == 1)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+        }
+        m_changed.notify_all();
+    }
+}
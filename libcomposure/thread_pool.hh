@@ -0,0 +1,117 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPOSURE_COMPOSURE_THREAD_POOL_HH_INCLUDED
+#define COMPOSURE_COMPOSURE_THREAD_POOL_HH_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+/// A work-stealing task scheduler.  Each worker thread has its own deque of tasks.  A
+/// worker takes the newest task from its own deque, and when that's empty, steals the
+/// oldest task from another's.  Tasks added by threads that aren't workers go to a shared
+/// deque that workers steal from too.
+///
+/// The thread that calls parallel_for() runs tasks while it waits, so parallel_for() can
+/// be called from inside a task without tying up a worker.  Batch composition, track
+/// encoding, rendering, and edit analysis nest this way, and all share a pool.  A waiting
+/// thread only runs tasks from its own call or calls nested in them, so a task never
+/// starts in the middle of an unrelated one and changes its thread-local state, e.g. the
+/// random generator.
+class Thread_Pool
+{
+public:
+    /// Start the worker threads.
+    /// @param concurrency The number of threads that run tasks, counting the one that
+    ///     calls parallel_for().  0 for one per core.  With 1, no threads are started
+    ///     and tasks run on the calling thread.
+    Thread_Pool(unsigned concurrency = 0);
+    /// Stop the workers.  Must not be called while parallel_for() is running.
+    ~Thread_Pool();
+    Thread_Pool(const Thread_Pool&) = delete;
+    Thread_Pool& operator=(const Thread_Pool&) = delete;
+
+    /// @return The number of threads that run tasks.
+    unsigned concurrency() const;
+
+    /// Split a range into tasks and run them in parallel.  Returns when they're all done.
+    /// If any throw, the first exception is rethrown after the rest are done.
+    /// @param count The size of the range.
+    /// @param grain The size of each task's part of the range.  The last may be smaller.
+    /// @param body Called with the beginning and end of a part.  It's called
+    ///     concurrently, so parts must not write to shared data.
+    void parallel_for(std::size_t count, std::size_t grain,
+                      const std::function<void(std::size_t, std::size_t)>& body);
+    /// Call body(i) for each i from 0 to count - 1 in parallel.
+    void parallel_for(std::size_t count, const std::function<void(std::size_t)>& body);
+
+    /// @return A pool with one thread per core, started when it's first used.
+    static Thread_Pool& standard();
+    /// @return The pool that's running the calling thread's task, or the standard pool if
+    ///     the thread isn't running a task.  Library functions use this pool so that
+    ///     their tasks run in the caller's pool.
+    static Thread_Pool& current();
+
+private:
+    /// The tasks of one call to parallel_for().
+    struct Group
+    {
+        const std::function<void(std::size_t, std::size_t)>& body;
+        /// The group of the task that called parallel_for(), if any.
+        const Group* parent;
+        std::atomic<std::size_t> remaining;
+        std::mutex mutex;
+        std::exception_ptr error;
+    };
+    struct Task
+    {
+        Group* group;
+        std::size_t begin;
+        std::size_t end;
+    };
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    /// A worker thread's loop.
+    void work(std::size_t index);
+    /// Take the newest task from a deque, or steal the oldest from another.
+    /// @param within If not null, only take tasks from this group or groups nested in it.
+    std::optional<Task> find_task(std::size_t index, const Group* within = nullptr);
+    void run(const Task& task);
+
+    unsigned m_concurrency;
+    /// One deque per worker and one for threads that aren't workers, at the end.
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::atomic<std::size_t> m_queued = 0; ///< Tasks in all the deques.
+    std::mutex m_mutex;
+    std::size_t m_pushes = 0; ///< Times tasks were queued.  Guarded by m_mutex.
+    /// Notified when tasks are queued, when a group finishes, and when stopping.
+    std::condition_variable m_changed;
+    bool m_stopping = false;
+    std::vector<std::jthread> m_threads;
+};
+
+#endif // COMPOSURE_COMPOSURE_THREAD_POOL_HH_INCLUDED
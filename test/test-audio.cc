@@ -0,0 +1,265 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "audio.hh"
+#include "phrase.hh"
+#include "random.hh"
+
+#include "doctest.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <vector>
+
+namespace
+{
+    std::uint32_t get_le(const std::string& s, std::size_t pos, std::size_t bytes)
+    {
+        std::uint32_t x = 0;
+        for (std::size_t i = 0; i < bytes; ++i)
+            x |= std::uint32_t(std::uint8_t(s[pos + i])) << 8*i;
+        return x;
+    }
+}
+
+TEST_CASE("frequency")
+{
+    CHECK(midi_frequency(69) == doctest::Approx(440.0));
+    CHECK(midi_frequency(81) == doctest::Approx(880.0));
+    CHECK(midi_frequency(60) == doctest::Approx(261.626).epsilon(1e-5));
+}
+
+TEST_CASE("render")
+{
+    const unsigned rate = 8000;
+    SUBCASE("empty")
+    {
+        CHECK(render_notes({}, rate).empty());
+    }
+    SUBCASE("one note")
+    {
+        std::vector<Audio_Note> notes{{0.5, 1.0, 440.0, 0.8}};
+        auto samples = render_notes(notes, rate);
+        CHECK(samples.size() == std::size_t(std::ceil((1.0 + release_time())*rate)));
+        // Silent before the start.
+        CHECK(std::all_of(samples.begin(), samples.begin() + rate/2,
+                          [](auto x) { return x == 0.0f; }));
+        // Normalized to the peak level.
+        auto peak = std::ranges::max(samples, {}, [](auto x) { return std::abs(x); });
+        CHECK(std::abs(peak) == doctest::Approx(0.89));
+        // Nearly silent at the end of the release.
+        CHECK(std::abs(samples.back()) < 0.01);
+    }
+    SUBCASE("threads")
+    {
+        // Long enough for several blocks.
+        std::vector<Audio_Note> notes;
+        for (int i = 0; i < 20; ++i)
+            notes.push_back({0.6*i, 0.6*i + 1.5, midi_frequency(60 + i), 0.5});
+        auto one = render_notes(notes, rate, 1);
+        auto many = render_notes(notes, rate, 4);
+        CHECK(one == many);
+    }
+}
+
+TEST_CASE("wav")
+{
+    std::vector<float> samples{0.0f, 1.0f, -1.0f, 0.5f, 2.0f};
+    std::ostringstream os;
+    SUBCASE("16-bit")
+    {
+        write_wav(os, samples, 44100, 16);
+        auto s = os.str();
+        REQUIRE(s.size() == 44 + 2*samples.size());
+        CHECK(s.substr(0, 4) == "RIFF");
+        CHECK(get_le(s, 4, 4) == s.size() - 8);
+        CHECK(s.substr(8, 8) == "WAVEfmt ");
+        CHECK(get_le(s, 16, 4) == 16);
+        CHECK(get_le(s, 20, 2) == 1);
+        CHECK(get_le(s, 22, 2) == 1);
+        CHECK(get_le(s, 24, 4) == 44100);
+        CHECK(get_le(s, 28, 4) == 2*44100);
+        CHECK(get_le(s, 32, 2) == 2);
+        CHECK(get_le(s, 34, 2) == 16);
+        CHECK(s.substr(36, 4) == "data");
+        CHECK(get_le(s, 40, 4) == 2*samples.size());
+        CHECK(get_le(s, 44, 2) == 0);
+        CHECK(get_le(s, 46, 2) == 0x7fff);
+        CHECK(get_le(s, 48, 2) == 0x8001);
+        CHECK(get_le(s, 50, 2) == 0x4000);
+        // Clipped
+        CHECK(get_le(s, 52, 2) == 0x7fff);
+    }
+    SUBCASE("24-bit")
+    {
+        write_wav(os, samples, 48000, 24);
+        auto s = os.str();
+        REQUIRE(s.size() == 44 + 3*samples.size());
+        CHECK(get_le(s, 28, 4) == 3*48000);
+        CHECK(get_le(s, 32, 2) == 3);
+        CHECK(get_le(s, 34, 2) == 24);
+        CHECK(get_le(s, 47, 3) == 0x7fffff);
+        CHECK(get_le(s, 50, 3) == 0x800001);
+    }
+    SUBCASE("bad format")
+    {
+        CHECK_THROWS_AS(write_wav(os, samples, 44100, 8), Bad_Audio_Format);
+        CHECK_THROWS_AS(write_wav(os, samples, 44100, 32), Bad_Audio_Format);
+    }
+}
+
+TEST_CASE("phrase wav")
+{
+    set_random_seed(1);
+    Phrase phrase(120.0);
+    phrase.compose(4, 24, false, {100, 100});
+    std::ostringstream os;
+    phrase.write_wav(os, 60, false, 16, 8000);
+    auto s = os.str();
+    REQUIRE(s.size() > 44);
+    // The last note plus its release at 120 bpm.
+    auto notes = phrase.notes();
+    double end = 0.0;
+    for (const auto& n : notes)
+        end = std::max(end, n.time + n.duration);
+    CHECK(get_le(s, 40, 4)/2 >= std::size_t(end*0.5*8000));
+}
+
+TEST_CASE("audio stream")
+{
+    const unsigned rate = 8000;
+    std::vector<Audio_Note> notes{{0.0, 0.5, 220.0, 0.5},
+                                  {0.25, 2.0, 330.0, 0.8},
+                                  {0.5, 0.75, 440.0, 0.3},
+                                  {1.9, 2.5, 550.0, 0.6}};
+    auto expected = render_notes(notes, rate, 1);
+    // Undo the normalization.
+    auto peak = std::ranges::max(expected, {}, [](auto x) { return std::abs(x); });
+
+    // Start and stop notes as the events come in, rendering as far as possible each time.
+    Audio_Stream stream(rate);
+    std::vector<float> out;
+    std::vector<float> block(100);
+    auto render_to = [&](double time) {
+        while (stream.position() + block.size() <= time*rate)
+        {
+            stream.render(block);
+            out.insert(out.end(), block.begin(), block.end());
+        }
+    };
+    auto id0 = stream.start(0.0, 220.0, 0.5);
+    render_to(0.25);
+    auto id1 = stream.start(0.25, 330.0, 0.8);
+    render_to(0.5);
+    stream.stop(id0, 0.5);
+    auto id2 = stream.start(0.5, 440.0, 0.3);
+    render_to(0.75);
+    stream.stop(id2, 0.75);
+    render_to(1.9);
+    auto id3 = stream.start(1.9, 550.0, 0.6);
+    render_to(2.0);
+    stream.stop(id1, 2.0);
+    render_to(2.5);
+    stream.stop(id3, 2.5);
+    while (stream.sounding())
+    {
+        stream.render(block);
+        out.insert(out.end(), block.begin(), block.end());
+    }
+
+    REQUIRE(out.size() >= expected.size());
+    auto stream_peak = std::ranges::max(out, {}, [](auto x) { return std::abs(x); });
+    for (std::size_t i = 0; i < expected.size(); ++i)
+        CHECK(out[i]/std::abs(stream_peak) == doctest::Approx(expected[i]/std::abs(peak))
+              .epsilon(1e-4).scale(1.0));
+    CHECK(std::all_of(out.begin() + expected.size(), out.end(),
+                      [](auto x) { return x == 0.0f; }));
+}
+
+TEST_CASE("stream phrase audio")
+{
+    const unsigned rate = 8000;
+    set_random_seed(2);
+    Phrase phrase(120.0);
+    phrase.compose(4, 24, false, {100, 100});
+    std::vector<Note> notes;
+    for (const auto& note : phrase.generate(4, 24, false))
+        notes.push_back(note);
+    REQUIRE(!notes.empty());
+    // Render the same notes with the phrase's voice.  24-bit samples keep the rounding
+    // well under the tolerance.
+    std::ostringstream os;
+    Phrase(120.0, notes).write_wav(os, 60, false, 24, rate);
+    auto wav = os.str();
+    std::vector<float> expected((wav.size() - 44)/3);
+    for (std::size_t i = 0; i < expected.size(); ++i)
+        expected[i] = static_cast<std::int32_t>(get_le(wav, 44 + 3*i, 3) << 8) >> 8;
+    auto peak = std::ranges::max(expected, {}, [](auto x) { return std::abs(x); });
+
+    auto replay = [&]() -> Generator<Note> {
+        for (const auto& note : notes)
+            co_yield note;
+    };
+    std::vector<float> out;
+    for (auto block : stream_audio(replay(), 120.0, 60, false, rate, 256))
+    {
+        CHECK(block.size() == 256);
+        out.insert(out.end(), block.begin(), block.end());
+    }
+
+    // The streamed samples are the same as rendering the whole phrase, up to
+    // normalization.
+    REQUIRE(out.size() >= expected.size());
+    auto stream_peak = std::ranges::max(out, {}, [](auto x) { return std::abs(x); });
+    for (std::size_t i = 0; i < expected.size(); ++i)
+        CHECK(out[i]/std::abs(stream_peak) == doctest::Approx(expected[i]/std::abs(peak))
+              .epsilon(1e-4).scale(1.0));
+    CHECK(std::all_of(out.begin() + expected.size(), out.end(),
+                      [](auto x) { return x == 0.0f; }));
+}
+
+TEST_CASE("pcm")
+{
+    auto blocks = []() -> Generator<std::span<const float>> {
+        std::vector<float> block{0.0f, 0.25f, -0.5f, 2.0f};
+        for (int i = 0; i < 1000; ++i)
+            co_yield block;
+    };
+    auto file = std::tmpfile();
+    auto stats = play_pcm(blocks(), fileno(file), 44100, 2.0, false);
+    CHECK(stats.samples == 4000);
+    CHECK(stats.underruns == 0);
+    CHECK(stats.max_fill <= stats.capacity);
+
+    std::vector<unsigned char> bytes(8001);
+    std::rewind(file);
+    REQUIRE(std::fread(bytes.data(), 1, bytes.size(), file) == 8000);
+    std::fclose(file);
+    auto sample = [&](std::size_t i) {
+        return static_cast<std::int16_t>(bytes[2*i] | (bytes[2*i + 1] << 8));
+    };
+    for (std::size_t i = 0; i < 4000; i += 4)
+    {
+        CHECK(sample(i) == 0);
+        CHECK(sample(i + 1) == 16384);
+        CHECK(sample(i + 2) == -32767);
+        // Clipped
+        CHECK(sample(i + 3) == 32767);
+    }
+}
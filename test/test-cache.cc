@@ -0,0 +1,188 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "cache.hh"
+#include "random.hh"
+
+#include "doctest.h"
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <latch>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    Cache_Entry make_entry()
+    {
+        Cache_Entry entry;
+        entry.passes.push_back({12, 4.5, 8, 3.25});
+        entry.passes.push_back({20, 9.0, 16, 7.75});
+        entry.notes.emplace_back(0.0, 1.0, 0.8, 60, 0);
+        entry.notes.emplace_back(0.25, 0.5, 0.8, 67, 1);
+        entry.notes.emplace_back(0.25, 0.5, 0.8, 64, 1);
+        return entry;
+    }
+
+    bool same(const Cache_Entry& e1, const Cache_Entry& e2)
+    {
+        if (e1.passes.size() != e2.passes.size() || e1.notes.size() != e2.notes.size())
+            return false;
+        for (std::size_t i = 0; i < e1.passes.size(); ++i)
+        {
+            const auto& p1 = e1.passes[i];
+            const auto& p2 = e2.passes[i];
+            if (p1.compose_size != p2.compose_size || p1.compose_beats != p2.compose_beats
+                || p1.edit_size != p2.edit_size || p1.edit_beats != p2.edit_beats)
+                return false;
+        }
+        for (std::size_t i = 0; i < e1.notes.size(); ++i)
+        {
+            const auto& n1 = e1.notes[i];
+            const auto& n2 = e2.notes[i];
+            if (n1.time != n2.time || n1.duration != n2.duration || n1.volume != n2.volume
+                || n1.pitch != n2.pitch || n1.generation != n2.generation)
+                return false;
+        }
+        return true;
+    }
+}
+
+TEST_CASE("cache entry")
+{
+    auto entry = make_entry();
+    std::stringstream ss;
+    write_cache_entry(ss, "seed=1", entry);
+    SUBCASE("round trip")
+    {
+        auto read = read_cache_entry(ss, "seed=1");
+        REQUIRE(read);
+        CHECK(same(*read, entry));
+    }
+    SUBCASE("wrong key")
+    {
+        CHECK(!read_cache_entry(ss, "seed=2"));
+    }
+    SUBCASE("truncated")
+    {
+        auto data = ss.str();
+        std::stringstream short_ss(data.substr(0, data.size() - 1));
+        CHECK(!read_cache_entry(short_ss, "seed=1"));
+    }
+    SUBCASE("bad counts")
+    {
+        // Counts larger than the rest of the file are rejected without allocating for
+        // them.
+        auto data = ss.str();
+        auto passes_offset = 4 + 2 + 4 + std::string("seed=1").size();
+        for (auto offset : {passes_offset, passes_offset + 4 + 2*24})
+        {
+            auto bad = data;
+            bad.replace(offset, 4, "\xff\xff\xff\xf0");
+            std::stringstream bad_ss(bad);
+            CHECK(!read_cache_entry(bad_ss, "seed=1"));
+        }
+    }
+}
+
+TEST_CASE("cache directory")
+{
+    auto dir = std::filesystem::temp_directory_path() / "composure-test-cache";
+    std::filesystem::remove_all(dir);
+    Composition_Cache cache(dir);
+    CHECK(!cache.load("seed=1"));
+    CHECK(cache.store("seed=1", make_entry()));
+    auto read = cache.load("seed=1");
+    REQUIRE(read);
+    CHECK(same(*read, make_entry()));
+    CHECK(!cache.load("seed=2"));
+    CHECK(cache.path("seed=1") != cache.path("seed=2"));
+    // No temporary files are left.
+    CHECK(std::distance(std::filesystem::directory_iterator(dir),
+                        std::filesystem::directory_iterator()) == 1);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("shared composer")
+{
+    const Compose_Settings settings{60.0, 4, 16, false, {}};
+    auto compose = [&](int passes) {
+        set_random_seed(21);
+        Shared_Composer composer;
+        return composer.compose("seed=21", passes, settings);
+    };
+    auto three = compose(3);
+    CHECK(three.passes.size() == 3);
+    CHECK(three.notes.size() == three.passes.back().edit_size);
+    CHECK(compose(0).notes.empty());
+
+    // Fewer passes are a snapshot of the same run.
+    auto two = compose(2);
+    CHECK(two.passes.size() == 2);
+    CHECK(two.passes[1].edit_size == three.passes[1].edit_size);
+    CHECK(two.passes[1].edit_beats == three.passes[1].edit_beats);
+
+    SUBCASE("concurrent")
+    {
+        // Whether or not the requests overlap, each one gets the same result as composing
+        // by itself.
+        Shared_Composer composer;
+        std::vector<Cache_Entry> results(6);
+        std::latch start(results.size());
+        std::vector<std::jthread> threads;
+        for (std::size_t i = 0; i < results.size(); ++i)
+            threads.emplace_back([&, i] {
+                set_random_seed(21);
+                start.arrive_and_wait();
+                results[i] = composer.compose("seed=21", i % 2 == 0 ? 2 : 3, settings);
+            });
+        threads.clear();
+        for (std::size_t i = 0; i < results.size(); ++i)
+            CHECK(same(results[i], i % 2 == 0 ? two : three));
+        CHECK(composer.shared() < results.size());
+    }
+    SUBCASE("overlapping")
+    {
+        // A short request doesn't wait for the passes of a long one that joined it.  The
+        // long one takes over and gets the same result as composing by itself.
+        auto ten = compose(10);
+        auto thirty = compose(30);
+        Shared_Composer composer;
+        Cache_Entry short_result, long_result;
+        std::chrono::duration<double> short_time, long_time;
+        auto request = [&](int passes, Cache_Entry& result,
+                           std::chrono::duration<double>& time) {
+            set_random_seed(21);
+            auto start = std::chrono::steady_clock::now();
+            result = composer.compose("seed=21", passes, settings);
+            time = std::chrono::steady_clock::now() - start;
+        };
+        {
+            std::jthread short_request(request, 10, std::ref(short_result),
+                                       std::ref(short_time));
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            std::jthread long_request(request, 30, std::ref(long_result),
+                                      std::ref(long_time));
+        }
+        CHECK(same(short_result, ten));
+        CHECK(same(long_result, thirty));
+        CHECK(composer.shared() == 1);
+        CHECK(2*short_time < long_time);
+    }
+}
@@ -0,0 +1,93 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "file_writer.hh"
+
+#include "doctest.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    std::string read_file(const std::filesystem::path& file)
+    {
+        std::ifstream is(file, std::ios::binary);
+        return {std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>()};
+    }
+}
+
+TEST_CASE("file writer")
+{
+    auto dir = std::filesystem::temp_directory_path() / "composure-test-writer";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+    auto file = [&](int i) { return (dir / ("out-" + std::to_string(i))).string(); };
+    // More files than the ring holds at once, from several threads.  One is empty and
+    // one is large.
+    auto data = [](int i) {
+        return i == 7 ? std::string(1 << 20, 'x') : std::string(i % 5*100, char('a' + i % 26));
+    };
+    auto check = [&](File_Writer& writer) {
+        std::vector<std::jthread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.emplace_back([&, t] {
+                for (int i = t; i < 200; i += 4)
+                    writer.write(file(i), data(i));
+            });
+        threads.clear();
+        writer.wait();
+        for (int i = 0; i < 200; ++i)
+            CHECK(read_file(file(i)) == data(i));
+
+        // Files are replaced.
+        writer.write(file(7), "short");
+        writer.wait();
+        CHECK(read_file(file(7)) == "short");
+
+        // Errors are reported once, after the other files are written.
+        writer.write((dir / "no-such-dir" / "x").string(), "data");
+        writer.write(file(8), "after");
+        CHECK_THROWS_AS(writer.wait(), Output_Not_Written);
+        CHECK(read_file(file(8)) == "after");
+        CHECK_NOTHROW(writer.wait());
+    };
+
+    SUBCASE("io_uring")
+    {
+        // Falls back to threads where io_uring isn't available.
+        File_Writer writer;
+        check(writer);
+    }
+    SUBCASE("threads")
+    {
+        File_Writer writer(File_Writer::Backend::threads);
+        CHECK(writer.backend() == File_Writer::Backend::threads);
+        check(writer);
+    }
+    SUBCASE("destructor waits")
+    {
+        {
+            File_Writer writer;
+            writer.write(file(1), "done");
+        }
+        CHECK(read_file(file(1)) == "done");
+    }
+    std::filesystem::remove_all(dir);
+}
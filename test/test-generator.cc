@@ -0,0 +1,68 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include <generator.hh>
+
+#include "doctest.h"
+
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    Generator<int> count(int n)
+    {
+        for (int i = 0; i < n; ++i)
+            co_yield i;
+    }
+
+    Generator<int> fail_after(int n)
+    {
+        for (int i = 0; i < n; ++i)
+            co_yield i;
+        throw std::runtime_error("done");
+    }
+}
+
+TEST_CASE("generator")
+{
+    SUBCASE("values")
+    {
+        std::vector<int> values;
+        for (auto x : count(4))
+            values.push_back(x);
+        CHECK(values == std::vector<int>{0, 1, 2, 3});
+    }
+    SUBCASE("empty")
+    {
+        auto gen = count(0);
+        CHECK(gen.begin() == gen.end());
+    }
+    SUBCASE("lazy")
+    {
+        auto gen = count(1000000);
+        auto it = gen.begin();
+        CHECK(*it == 0);
+        ++it;
+        CHECK(*it == 1);
+    }
+    SUBCASE("exception")
+    {
+        auto gen = fail_after(2);
+        auto it = gen.begin();
+        ++it;
+        CHECK_THROWS_AS(++it, std::runtime_error);
+    }
+}
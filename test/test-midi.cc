@@ -17,12 +17,19 @@
 
 #include "doctest.h"
 
+#include <chrono>
 #include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <thread>
 #include <vector>
 
+#include <unistd.h>
+
 bool bits(std::ostringstream& os, std::vector<std::uint8_t> xs)
 {
     bool ok = os.str() == std::string(xs.begin(), xs.end());
@@ -116,3 +123,311 @@ TEST_CASE("variable length")
         CHECK_THROWS_AS(write_var_be(os, 0xffffffff), Variable_Length_Value_Too_Large);
     }
 }
+
+TEST_CASE("tempo patch")
+{
+    auto file = std::filesystem::temp_directory_path() / "composure-test-tempo.midi";
+    {
+        Midi_File midi(120, 96);
+        midi.add_note(0.0, true, 60, 0.8);
+        midi.add_note(1.0, false, 60, 0.8);
+        std::ofstream os(file);
+        midi.write(os);
+    }
+    auto size = std::filesystem::file_size(file);
+    CHECK(read_midi_tempo(file) == doctest::Approx(120));
+    CHECK(write_midi_tempo(file, 80) == doctest::Approx(120));
+    CHECK(read_midi_tempo(file) == doctest::Approx(80));
+    CHECK(std::filesystem::file_size(file) == size);
+
+    std::ofstream(file) << "not a MIDI file";
+    CHECK_THROWS_AS(read_midi_tempo(file), Unexpected_Midi_Layout);
+    CHECK_THROWS_AS(write_midi_tempo(file, 80), Unexpected_Midi_Layout);
+    std::filesystem::remove(file);
+    CHECK_THROWS_AS(read_midi_tempo(file), Unexpected_Midi_Layout);
+}
+
+TEST_CASE("read notes")
+{
+    Midi_File midi(120, 96);
+    midi.add_note(0.0, true, 60, 0.5);
+    midi.add_note(0.0, true, 64, 0.5);
+    midi.add_note(1.0, false, 60, 0.5);
+    midi.add_note(1.5, false, 64, 0.5);
+    midi.add_note(2.0, true, 67, 1.0);
+    midi.add_note(2.25, false, 67, 1.0);
+    std::stringstream ss;
+    midi.write(ss);
+
+    SUBCASE("written")
+    {
+        auto notes = read_midi_notes(ss);
+        REQUIRE(notes.size() == 3);
+        CHECK(notes[0].time == 0.0);
+        CHECK(notes[0].duration == 1.0);
+        CHECK(notes[0].pitch == 60);
+        CHECK(notes[0].velocity == 63);
+        CHECK(notes[1].pitch == 64);
+        CHECK(notes[1].duration == 1.5);
+        CHECK(notes[2].time == 2.0);
+        CHECK(notes[2].duration == 0.25);
+        CHECK(notes[2].velocity == 127);
+    }
+    SUBCASE("zero velocity")
+    {
+        // Note-on with zero velocity under running status ends the note.
+        std::istringstream is(std::string("MThd\0\0\0\6\0\0\0\1\0\x60"
+                                          "MTrk\0\0\0\x0b"
+                                          "\0\x91\x3c\x40" "\x60\x3c\0" "\0\xff\x2f\0", 33));
+        auto notes = read_midi_notes(is);
+        REQUIRE(notes.size() == 1);
+        CHECK(notes[0].duration == 1.0);
+        CHECK(notes[0].channel == 1);
+    }
+    SUBCASE("malformed")
+    {
+        std::istringstream not_midi("MTrk");
+        CHECK_THROWS_AS(read_midi_notes(not_midi), Bad_Midi_File);
+        std::istringstream truncated(ss.str().substr(0, ss.str().size() - 5));
+        CHECK_THROWS_AS(read_midi_notes(truncated), Bad_Midi_File);
+    }
+}
+
+TEST_CASE("reader")
+{
+    Midi_File midi(120, 48);
+    midi.add_note(0.0, true, 60, 0.5);
+    midi.add_note(0.5, false, 60, 0.5);
+    std::ostringstream os;
+    midi.write(os);
+    auto data = os.str();
+    std::span<const unsigned char> bytes(reinterpret_cast<const unsigned char*>(data.data()),
+                                         data.size());
+
+    SUBCASE("header")
+    {
+        Midi_Reader reader(bytes);
+        CHECK(reader.format() == 0);
+        CHECK(reader.divisions() == 48);
+        CHECK(reader.tracks() == 1);
+    }
+    SUBCASE("events")
+    {
+        std::vector<Midi_Event> events;
+        Midi_Reader(bytes).for_each_event([&](const Midi_Event& e) { events.push_back(e); });
+        // Midi_File pads the end of the track with zeros, which reads as a note-off for
+        // note 0 under running status.
+        REQUIRE(events.size() == 3);
+        CHECK(events[0].ticks == 0);
+        CHECK(events[0].status == 0x90);
+        CHECK(events[0].data1 == 60);
+        CHECK(events[1].ticks == 24);
+        CHECK(events[1].status == 0x80);
+        CHECK(events[2].status == 0x80);
+        CHECK(events[2].data1 == 0);
+    }
+    SUBCASE("mapped")
+    {
+        auto file = std::filesystem::temp_directory_path() / "composure-test-reader.midi";
+        std::ofstream(file, std::ios::binary) << data;
+        auto notes = Midi_Reader(file).notes();
+        REQUIRE(notes.size() == 1);
+        CHECK(notes[0].duration == 0.5);
+        std::filesystem::remove(file);
+    }
+    SUBCASE("malformed")
+    {
+        CHECK_THROWS_AS(Midi_Reader(bytes.first(10)), Bad_Midi_File);
+        CHECK_THROWS_AS(Midi_Reader(bytes.first(bytes.size() - 1)), Bad_Midi_File);
+    }
+}
+
+TEST_CASE("tracks")
+{
+    std::vector<Midi_File> tracks;
+    tracks.emplace_back(90, 96, 0);
+    tracks.emplace_back(90, 96, 3);
+    tracks[0].add_note(0.0, true, 60, 0.5);
+    tracks[0].add_note(1.0, false, 60, 0.5);
+    tracks[1].add_note(0.5, true, 64, 0.5);
+    tracks[1].add_note(2.0, false, 64, 0.5);
+    std::ostringstream os;
+    CHECK(Midi_File::write_tracks(os, tracks));
+    auto data = os.str();
+    std::span<const unsigned char> bytes(reinterpret_cast<const unsigned char*>(data.data()),
+                                         data.size());
+
+    Midi_Reader reader(bytes);
+    CHECK(reader.format() == 1);
+    CHECK(reader.tracks() == 3);
+    auto notes = reader.notes();
+    REQUIRE(notes.size() == 2);
+    CHECK(notes[0].channel == 0);
+    CHECK(notes[0].duration == 1.0);
+    CHECK(notes[1].channel == 3);
+    CHECK(notes[1].time == 0.5);
+    CHECK(notes[1].duration == 1.5);
+
+    // The tempo is where write_midi_tempo() expects it.
+    auto file = std::filesystem::temp_directory_path() / "composure-test-tracks.midi";
+    std::ofstream(file, std::ios::binary) << data;
+    CHECK(read_midi_tempo(file) == doctest::Approx(90));
+    std::filesystem::remove(file);
+}
+
+TEST_CASE("compact")
+{
+    auto write = [](bool compact, std::size_t& savings) {
+        Midi_File midi(120, 96, 2, compact);
+        midi.add_note(0.0, true, 60, 0.5);
+        midi.add_note(0.0, true, 64, 0.5);
+        midi.add_note(1.0, false, 60, 0.5);
+        midi.add_note(1.5, false, 64, 0.5);
+        midi.add_note(2.0, true, 67, 1.0);
+        midi.add_note(2.25, false, 67, 1.0);
+        savings = midi.compact_savings();
+        std::stringstream ss;
+        midi.write(ss);
+        return ss.str();
+    };
+    std::size_t standard_savings;
+    std::size_t compact_savings;
+    auto standard = write(false, standard_savings);
+    auto compact = write(true, compact_savings);
+
+    // The standard encoding has 4 status bytes, the compact encoding has 1.
+    CHECK(standard_savings == 3);
+    CHECK(compact_savings == 3);
+    CHECK(standard.size() - compact.size() == 3);
+
+    std::istringstream standard_is(standard);
+    std::istringstream compact_is(compact);
+    auto standard_notes = read_midi_notes(standard_is);
+    auto compact_notes = read_midi_notes(compact_is);
+    REQUIRE(compact_notes.size() == 3);
+    REQUIRE(standard_notes.size() == compact_notes.size());
+    for (std::size_t i = 0; i < compact_notes.size(); ++i)
+    {
+        CHECK(compact_notes[i].time == standard_notes[i].time);
+        CHECK(compact_notes[i].duration == standard_notes[i].duration);
+        CHECK(compact_notes[i].pitch == standard_notes[i].pitch);
+        CHECK(compact_notes[i].velocity == standard_notes[i].velocity);
+        CHECK(compact_notes[i].channel == 2);
+    }
+}
+
+TEST_CASE("stream")
+{
+    auto file = std::filesystem::temp_directory_path() / "composure-test-stream.midi";
+    auto read_file = [&file] {
+        std::ifstream is(file, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(is), {});
+    };
+
+    for (auto compact : {false, true})
+    {
+        // Enough events for several blocks.
+        Midi_File midi(100, 96, 1, compact);
+        Midi_Stream stream(file, 100, 96, 1, compact);
+        for (int i = 0; i < 40000; ++i)
+        {
+            midi.add_note(i*0.5, true, 60 + i % 12, 0.5);
+            stream.add_note(i*0.5, true, 60 + i % 12, 0.5);
+            midi.add_note(i*0.5 + 0.25, false, 60 + i % 12, 0.5);
+            stream.add_note(i*0.5 + 0.25, false, 60 + i % 12, 0.5);
+        }
+        stream.close();
+        CHECK(stream.size() == midi.size());
+        CHECK(stream.compact_savings() == midi.compact_savings());
+
+        std::ostringstream os;
+        midi.write(os);
+        auto data = read_file();
+        CHECK(data.size() > 1 << 16);
+        CHECK(data == os.str());
+        CHECK(read_midi_tempo(file) == doctest::Approx(100));
+    }
+    SUBCASE("empty")
+    {
+        {
+            Midi_Stream stream(file, 100, 96);
+        }
+        std::ostringstream os;
+        Midi_File(100, 96).write(os);
+        CHECK(read_file() == os.str());
+    }
+    SUBCASE("not written")
+    {
+        CHECK_THROWS_AS(Midi_Stream(file / "no-such-dir", 100, 96), Midi_Not_Written);
+    }
+    std::filesystem::remove(file);
+}
+
+TEST_CASE("live")
+{
+    auto messages = [](std::vector<double> times) -> Generator<Midi_Message> {
+        std::uint8_t pitch = 60;
+        for (auto t : times)
+            co_yield Midi_Message{t, {0x90, pitch++, 100}};
+    };
+    auto read = [](std::FILE* file) {
+        std::vector<unsigned char> bytes(1024);
+        std::rewind(file);
+        bytes.resize(std::fread(bytes.data(), 1, bytes.size(), file));
+        std::fclose(file);
+        return bytes;
+    };
+
+    SUBCASE("bytes")
+    {
+        auto file = std::tmpfile();
+        auto stats = play_midi(messages({0.0, 0.0, 1.0, 100.0}), fileno(file), false);
+        CHECK(stats.messages == 4);
+        CHECK(stats.missed == 0);
+        CHECK(stats.p99 == 0.0);
+        CHECK(read(file) == std::vector<unsigned char>{0x90, 60, 100, 0x90, 61, 100,
+                                                       0x90, 62, 100, 0x90, 63, 100});
+    }
+    SUBCASE("real time")
+    {
+        std::vector<double> times;
+        for (int i = 0; i < 50; ++i)
+            times.push_back(0.002*i);
+        auto file = std::tmpfile();
+        auto start = std::chrono::steady_clock::now();
+        auto stats = play_midi(messages(times), fileno(file));
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        CHECK(elapsed.count() >= times.back());
+        CHECK(stats.messages == 50);
+        CHECK(stats.missed == 0);
+        CHECK(stats.p50 <= stats.p99);
+        CHECK(stats.p99 <= stats.max);
+        // Generous for a loaded machine.  It's usually a few µs.
+        CHECK(stats.p99 < 0.01);
+        CHECK(read(file).size() == 150);
+    }
+    SUBCASE("missed")
+    {
+        // The second message isn't ready until long after it's due.
+        auto slow = []() -> Generator<Midi_Message> {
+            co_yield Midi_Message{0.0, {0x90, 60, 100}};
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            co_yield Midi_Message{0.001, {0x80, 60, 100}};
+        };
+        auto file = std::tmpfile();
+        auto stats = play_midi(slow(), fileno(file));
+        CHECK(stats.messages == 2);
+        CHECK(stats.missed == 1);
+        CHECK(stats.max > 0.02);
+        std::fclose(file);
+    }
+    SUBCASE("not written")
+    {
+        int fds[2];
+        REQUIRE(::pipe(fds) == 0);
+        ::close(fds[1]);
+        // Writing to the read end fails.
+        CHECK_THROWS_AS(play_midi(messages({0.0}), fds[0], false), Live_Midi_Not_Written);
+        ::close(fds[0]);
+    }
+}
@@ -0,0 +1,140 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "note_ring.hh"
+
+#include "doctest.h"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+    Published_Note note(int i)
+    {
+        return {0.25*i, 0.5f, float(60 + i % 12), 0.75f, i % 8};
+    }
+}
+
+TEST_CASE("note ring")
+{
+    SUBCASE("publish and read")
+    {
+        Note_Publisher publisher("test-composure-ring", 6);
+        CHECK(publisher.name() == "/test-composure-ring");
+        Note_Subscriber subscriber("/test-composure-ring");
+        CHECK(!subscriber.next());
+        CHECK(!subscriber.finished());
+        for (int i = 0; i < 3; ++i)
+            publisher.publish(note(i));
+        for (int i = 0; i < 3; ++i)
+        {
+            auto got = subscriber.next();
+            REQUIRE(got);
+            CHECK(got->time == 0.25*i);
+            CHECK(got->duration == 0.5f);
+            CHECK(got->pitch == float(60 + i));
+            CHECK(got->volume == 0.75f);
+            CHECK(got->generation == i);
+        }
+        CHECK(!subscriber.next());
+        publisher.finish();
+        CHECK(subscriber.finished());
+        CHECK(subscriber.lost() == 0);
+    }
+    SUBCASE("overrun")
+    {
+        // The capacity is rounded up to 8.
+        Note_Publisher publisher("test-composure-ring", 6);
+        Note_Subscriber subscriber("test-composure-ring");
+        for (int i = 0; i < 20; ++i)
+            publisher.publish(note(i));
+        auto got = subscriber.next();
+        REQUIRE(got);
+        CHECK(got->time == 0.25*12);
+        CHECK(subscriber.lost() == 12);
+        // A new reader starts with the oldest note in the ring.
+        Note_Subscriber late("test-composure-ring");
+        CHECK(late.next()->time == 0.25*12);
+    }
+    SUBCASE("several readers")
+    {
+        constexpr int count = 100000;
+        Note_Publisher publisher("test-composure-ring", 1 << 10);
+        std::vector<std::vector<Published_Note>> received(3);
+        std::vector<std::uint64_t> lost(received.size());
+        // Open before publishing so that no notes are missed without being counted.
+        std::vector<std::unique_ptr<Note_Subscriber>> subscribers;
+        for (std::size_t r = 0; r < received.size(); ++r)
+            subscribers.push_back(std::make_unique<Note_Subscriber>("test-composure-ring"));
+        std::vector<std::jthread> readers;
+        for (std::size_t r = 0; r < received.size(); ++r)
+            readers.emplace_back([&, r] {
+                auto& subscriber = *subscribers[r];
+                while (!subscriber.finished())
+                    if (auto got = subscriber.next())
+                        received[r].push_back(*got);
+                lost[r] = subscriber.lost();
+            });
+        for (int i = 0; i < count; ++i)
+            publisher.publish(note(i));
+        publisher.finish();
+        readers.clear();
+        for (std::size_t r = 0; r < received.size(); ++r)
+        {
+            // Every note is either received intact and in order, or counted as lost.
+            CHECK(received[r].size() + lost[r] == count);
+            bool in_order = true;
+            bool intact = true;
+            for (std::size_t i = 0; i < received[r].size(); ++i)
+            {
+                const auto& got = received[r][i];
+                in_order = in_order && (i == 0 || got.time > received[r][i - 1].time);
+                auto expected = note(int(got.time*4));
+                intact = intact && got.duration == expected.duration
+                    && got.pitch == expected.pitch && got.volume == expected.volume
+                    && got.generation == expected.generation;
+            }
+            CHECK(in_order);
+            CHECK(intact);
+        }
+    }
+}
+
+TEST_CASE("note ring errors")
+{
+    CHECK_THROWS_AS(Note_Subscriber("test-composure-no-such-ring"), Note_Ring_Error);
+    CHECK_THROWS_AS(Note_Publisher("test-composure-ring", std::size_t(1) << 40),
+                    Note_Ring_Error);
+
+    // Something else in shared memory with the same name.
+    auto fd = ::shm_open("/test-composure-not-a-ring", O_RDWR | O_CREAT, 0644);
+    REQUIRE(fd >= 0);
+    CHECK(::ftruncate(fd, 4096) == 0);
+    ::close(fd);
+    CHECK_THROWS_AS(Note_Subscriber("test-composure-not-a-ring"), Note_Ring_Error);
+    ::shm_unlink("/test-composure-not-a-ring");
+
+    // The name is removed when the publisher is destroyed.
+    {
+        Note_Publisher publisher("test-composure-ring", 8);
+    }
+    CHECK_THROWS_AS(Note_Subscriber("test-composure-ring"), Note_Ring_Error);
+}
@@ -0,0 +1,121 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "mapped_file.hh"
+#include "notes.hh"
+
+#include "doctest.h"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+    std::vector<Note> make_notes()
+    {
+        return {{0.0, 1.0, 0.8, 4, 0},
+                {0.25, 0.5, 0.8, -3, 0},
+                {0.25, 4.0, 0.4, 11, 1},
+                {1000.75, 0.25, 1.0, 0, 7}};
+    }
+
+    std::span<const unsigned char> bytes(const std::string& s)
+    {
+        return {reinterpret_cast<const unsigned char*>(s.data()), s.size()};
+    }
+}
+
+TEST_CASE("binary notes")
+{
+    auto notes = make_notes();
+    std::ostringstream os;
+    write_binary_notes(os, notes, 72.5, 61);
+    auto data = os.str();
+
+    SUBCASE("round trip")
+    {
+        auto file = read_binary_notes(bytes(data));
+        CHECK(file.tempo == 72.5);
+        CHECK(file.tonic == 61);
+        REQUIRE(file.notes.size() == notes.size());
+        for (std::size_t i = 0; i < notes.size(); ++i)
+        {
+            CHECK(file.notes[i].time == notes[i].time);
+            CHECK(file.notes[i].duration == notes[i].duration);
+            CHECK(file.notes[i].pitch == notes[i].pitch);
+            CHECK(file.notes[i].volume == notes[i].volume);
+            CHECK(file.notes[i].generation == notes[i].generation);
+        }
+    }
+    SUBCASE("compact")
+    {
+        // Header, 5 column lengths, and 1 or 2 bytes per value.
+        CHECK(data.size() < 24 + 5*4 + 2*5*notes.size());
+    }
+    SUBCASE("empty")
+    {
+        std::ostringstream empty;
+        write_binary_notes(empty, {}, 60, 60);
+        CHECK(read_binary_notes(bytes(empty.str())).notes.empty());
+    }
+    SUBCASE("malformed")
+    {
+        CHECK_THROWS_AS(read_binary_notes(bytes("CNO")), Bad_Notes_File);
+        CHECK_THROWS_AS(read_binary_notes(bytes("XNOT" + data.substr(4))), Bad_Notes_File);
+        CHECK_THROWS_AS(read_binary_notes(bytes(data.substr(0, data.size() - 1))),
+                        Bad_Notes_File);
+    }
+    SUBCASE("mapped")
+    {
+        auto path = std::filesystem::temp_directory_path() / "composure-test.bnotes";
+        std::ofstream(path, std::ios::binary) << data;
+        auto file = load_binary_notes(path);
+        CHECK(file.notes.size() == notes.size());
+        std::filesystem::remove(path);
+        CHECK_THROWS_AS(load_binary_notes(path), File_Not_Mapped);
+    }
+}
+
+TEST_CASE("text notes")
+{
+    auto notes = make_notes();
+    std::ostringstream expected;
+    for (const auto& n : notes)
+        expected << n.time*60.0/70 << ' ' << (n.time + n.duration)*60.0/70 << ' '
+                 << 61 + n.pitch << ' ' << n.generation << '\n';
+    std::ostringstream os;
+    write_text_notes(os, notes, 70, 61);
+    CHECK(os.str() == expected.str());
+}
+
+TEST_CASE("read text notes")
+{
+    auto notes = make_notes();
+    std::ostringstream os;
+    write_text_notes(os, notes, 70, 61);
+    auto read = read_text_notes(os.str(), 70, 61);
+    REQUIRE(read.size() == notes.size());
+    for (std::size_t i = 0; i < notes.size(); ++i)
+    {
+        CHECK(read[i].time == notes[i].time);
+        CHECK(read[i].duration == notes[i].duration);
+        CHECK(read[i].pitch == notes[i].pitch);
+        CHECK(read[i].generation == notes[i].generation);
+    }
+    CHECK(read_text_notes("", 60, 60).empty());
+    CHECK_THROWS_AS(read_text_notes("0 1 60\n", 60, 60), Bad_Notes_File);
+    CHECK_THROWS_AS(read_text_notes("0 1 x 0\n", 60, 60), Bad_Notes_File);
+}
@@ -0,0 +1,87 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "oscillator.hh"
+
+#include "doctest.h"
+
+#include <cmath>
+#include <numbers>
+#include <vector>
+
+namespace
+{
+    /// @return The exact sum of the partials at sample i.
+    double exact(const std::vector<Partial>& partials, double rate, std::size_t i)
+    {
+        double sum = 0.0;
+        auto t = i/rate;
+        for (const auto& p : partials)
+            if (i >= std::ceil(p.begin*rate) && i < std::ceil(p.end*rate))
+                sum += p.amplitude*std::exp(-p.decay*(t - p.begin))
+                    *std::sin(2.0*std::numbers::pi*p.frequency*(t - p.origin));
+        return sum;
+    }
+
+    std::vector<Partial> make_partials(int n)
+    {
+        std::vector<Partial> partials;
+        for (int k = 0; k < n; ++k)
+        {
+            double begin = 0.013*k;
+            partials.push_back({begin, begin + 0.05 + 0.007*k, begin - 0.001*k,
+                                110.0 + 37.0*k, 1.0/n, 2.0 + k % 7});
+        }
+        return partials;
+    }
+}
+
+TEST_CASE("oscillator bank")
+{
+    const double rate = 8000.0;
+    auto partials = make_partials(150);
+    const std::size_t first = 100;
+    const std::size_t size = 2000;
+
+    for (auto simd : {Simd::scalar, Simd::avx2, Simd::avx512})
+    {
+        if (!simd_supported(simd))
+            continue;
+        CAPTURE(static_cast<int>(simd));
+        std::vector<float> out(size);
+        render_partials(partials, rate, first, out, simd);
+        double error = 0.0;
+        for (std::size_t i = 0; i < size; ++i)
+            error = std::max(error, std::abs(out[i] - exact(partials, rate, first + i)));
+        CHECK(error < 1e-5);
+
+        // The output doesn't depend on how it's split up.
+        std::vector<float> split(size);
+        std::span<float> all(split);
+        render_partials(partials, rate, first, all.first(333), simd);
+        render_partials(partials, rate, first + 333, all.subspan(333), simd);
+        CHECK(split == out);
+    }
+}
+
+TEST_CASE("silent bank")
+{
+    std::vector<float> out(300, 0.5f);
+    render_partials({}, 44100, 0, out);
+    CHECK(out == std::vector<float>(300, 0.5f));
+    // Outside the range
+    render_partials(make_partials(3), 44100, 44100, out);
+    CHECK(out == std::vector<float>(300, 0.5f));
+}
@@ -13,10 +13,19 @@
 // You should have received a copy of the GNU General Public License along with Composure.
 // If not, see <http://www.gnu.org/licenses/>.
 
+#include <midi.hh>
 #include <phrase.hh>
+#include <random.hh>
 
 #include "doctest.h"
 
+#include <algorithm>
+#include <filesystem>
+#include <memory_resource>
+#include <sstream>
+#include <thread>
+#include <tuple>
+
 bool operator== (const Note& n1, const Note& n2)
 {
     return n1.time == n2.time
@@ -51,3 +60,308 @@ TEST_CASE("notes")
         CHECK(n[1] == n2);
     }
 }
+
+TEST_CASE("transpose")
+{
+    Phrase phrase(60);
+    phrase.append_notes({Note(0.0, 1.0, 0.8, 4, 0)});
+    std::ostringstream c, g;
+    phrase.write_midi(c, 60, false);
+    phrase.write_midi(g, 67, false);
+    CHECK(c.str().size() == g.str().size());
+    // The pitch follows the first delta time and status byte after the tempo and time
+    // signature events.
+    auto pitch_offset = c.str().find("\x90") + 1;
+    CHECK(c.str()[pitch_offset] == 64);
+    CHECK(g.str()[pitch_offset] == 71);
+}
+
+TEST_CASE("tracks by generation")
+{
+    Phrase phrase(60);
+    phrase.append_notes({Note(0.0, 1.0, 0.8, 0, 0),
+                         Note(0.5, 1.0, 0.8, 4, 1),
+                         Note(1.0, 1.0, 0.8, 7, 0)});
+    std::ostringstream os;
+    phrase.write_midi_tracks(os, 60, false);
+    auto data = os.str();
+    Midi_Reader reader({reinterpret_cast<const unsigned char*>(data.data()), data.size()});
+    CHECK(reader.tracks() == 3);
+    auto notes = reader.notes();
+    REQUIRE(notes.size() == 3);
+    CHECK(notes[0].channel == 0);
+    CHECK(notes[1].channel == 1);
+    CHECK(notes[1].pitch == 64);
+    CHECK(notes[2].channel == 0);
+}
+
+TEST_CASE("generate")
+{
+    auto in_order = [](const Note& n1, const Note& n2) {
+        return std::tie(n1.time, n1.pitch, n1.duration)
+            < std::tie(n2.time, n2.pitch, n2.duration);
+    };
+
+    set_random_seed(12);
+    Phrase composed(60);
+    composed.compose(6, 24, false);
+    std::vector<Note> expected(composed.notes().begin(), composed.notes().end());
+    std::sort(expected.begin(), expected.end(), in_order);
+
+    set_random_seed(12);
+    Phrase phrase(60);
+    std::vector<Note> generated;
+    for (const auto& note : phrase.generate(6, 24, false))
+        generated.push_back(note);
+    CHECK(phrase.notes().empty());
+    CHECK(std::is_sorted(generated.begin(), generated.end(),
+                         [](const Note& n1, const Note& n2) { return n1.time < n2.time; }));
+    std::sort(generated.begin(), generated.end(), in_order);
+    CHECK(generated == expected);
+
+    SUBCASE("stream")
+    {
+        auto file = std::filesystem::temp_directory_path() / "composure-test-generate.midi";
+        set_random_seed(12);
+        stream_midi(phrase.generate(6, 24, false), file, 60, 60, false);
+        auto notes = Midi_Reader(file).notes();
+        CHECK(notes.size() == expected.size());
+        std::filesystem::remove(file);
+    }
+}
+
+TEST_CASE("segments")
+{
+    set_random_seed(3);
+    double last_time = 0.0;
+    std::size_t segments = 0;
+    for (const auto& segment : compose_segments(60, 4, 16, false, 2, 200.0))
+    {
+        ++segments;
+        REQUIRE(!segment.empty());
+        CHECK(segment.front().time >= last_time);
+        for (const auto& note : segment)
+        {
+            CHECK(note.time >= last_time);
+            CHECK(note.time < 200.0);
+            CHECK(note.generation >= 0);
+            CHECK(note.generation < 2);
+            last_time = note.time;
+        }
+    }
+    CHECK(segments > 1);
+}
+
+TEST_CASE("segments on another thread")
+{
+    auto compose = [] {
+        std::vector<Note> notes;
+        for (const auto& segment : compose_segments(60, 4, 16, false, 2, 100.0))
+            notes.insert(notes.end(), segment.begin(), segment.end());
+        return notes;
+    };
+    set_random_seed(5);
+    auto here = compose();
+    set_random_seed(5);
+    std::vector<Note> there;
+    // The segments are composed on the thread that iterates, with the random numbers of
+    // the thread that called compose_segments().
+    auto segments = compose_segments(60, 4, 16, false, 2, 100.0);
+    std::thread([&] {
+        for (const auto& segment : segments)
+            there.insert(there.end(), segment.begin(), segment.end());
+    }).join();
+    REQUIRE(here.size() == there.size());
+    for (std::size_t i = 0; i < here.size(); ++i)
+    {
+        CHECK(here[i].time == there[i].time);
+        CHECK(here[i].pitch == there[i].pitch);
+    }
+
+    // Each segment may be resumed on a different thread.  The resuming threads'
+    // generators are left alone.
+    set_random_seed(5);
+    std::vector<Note> switching;
+    segments = compose_segments(60, 4, 16, false, 2, 100.0);
+    decltype(segments.begin()) it;
+    bool first = true;
+    while (true)
+    {
+        bool done = false;
+        std::thread([&] {
+            set_random_seed(99);
+            auto before = random_state();
+            if (first)
+                it = segments.begin();
+            else
+                ++it;
+            done = it == segments.end();
+            if (!done)
+                switching.insert(switching.end(), it->begin(), it->end());
+            CHECK(random_state() == before);
+        }).join();
+        first = false;
+        if (done)
+            break;
+    }
+    REQUIRE(here.size() == switching.size());
+    for (std::size_t i = 0; i < here.size(); ++i)
+    {
+        CHECK(here[i].time == switching[i].time);
+        CHECK(here[i].pitch == switching[i].pitch);
+    }
+}
+
+TEST_CASE("stream events")
+{
+    set_random_seed(9);
+    Phrase phrase(90.0);
+    phrase.compose(4, 24, false);
+    auto file = std::filesystem::temp_directory_path() / "test-stream-events.midi";
+    phrase.stream_midi(file, 60, false);
+    std::vector<Midi_Event> events;
+    Midi_Reader(file).for_each_event([&](const Midi_Event& e) { events.push_back(e); });
+    std::filesystem::remove(file);
+    // The padding before the end of the track reads as an event with running status.
+    REQUIRE(!events.empty());
+    CHECK(events.back().data1 == 0);
+    events.pop_back();
+
+    // The same events as the file with times in seconds.
+    auto replay = [&]() -> Generator<Note> {
+        for (const auto& note : phrase.notes())
+            co_yield note;
+    };
+    std::size_t i = 0;
+    double last = 0.0;
+    for (const auto& message : stream_events(replay(), 90.0, 60, false))
+    {
+        REQUIRE(i < events.size());
+        CHECK(message.time >= last);
+        CHECK(message.time == doctest::Approx(events[i].ticks/96.0*60.0/90.0).epsilon(0.01));
+        CHECK(message.bytes[0] == events[i].status);
+        CHECK(message.bytes[1] == events[i].data1);
+        CHECK(message.bytes[2] == events[i].data2);
+        last = message.time;
+        ++i;
+    }
+    CHECK(i == events.size());
+}
+
+TEST_CASE("budget")
+{
+    set_random_seed(7);
+    Phrase phrase(60);
+    SUBCASE("pass")
+    {
+        phrase.compose(4, 1000, false, {.pass = 50});
+        CHECK(phrase.notes().size() >= 50);
+        CHECK(phrase.notes().size() < 54);
+        phrase.compose(4, 1000, false, {.pass = 50});
+        CHECK(phrase.notes().size() >= 100);
+        CHECK(phrase.notes().size() < 108);
+    }
+    SUBCASE("total")
+    {
+        phrase.compose(4, 1000, false, {.total = 2000});
+        CHECK(phrase.notes().size() >= 2000);
+        CHECK(phrase.notes().size() < 2004);
+        phrase.compose(4, 1000, false, {.total = 2000});
+        CHECK(phrase.notes().size() < 2004);
+    }
+}
+
+namespace
+{
+    /// Counts allocations passed on to the default resource.
+    class Counting_Resource : public std::pmr::memory_resource
+    {
+    public:
+        std::size_t allocations = 0;
+
+    private:
+        void* do_allocate(std::size_t bytes, std::size_t alignment) override
+        {
+            ++allocations;
+            return std::pmr::get_default_resource()->allocate(bytes, alignment);
+        }
+        void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+        {
+            std::pmr::get_default_resource()->deallocate(p, bytes, alignment);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+}
+
+TEST_CASE("memory resource")
+{
+    auto compose = [](std::pmr::memory_resource* memory) {
+        set_random_seed(21);
+        Phrase phrase(60, memory);
+        for (int i = 0; i < 3; ++i)
+        {
+            phrase.compose(5, 20, false);
+            phrase.edit();
+        }
+        std::ostringstream os;
+        phrase.write_midi(os, 60, false);
+        return os.str();
+    };
+
+    Counting_Resource counter;
+    std::pmr::monotonic_buffer_resource arena(&counter);
+    CHECK(compose(&arena) == compose(std::pmr::get_default_resource()));
+    CHECK(counter.allocations > 0);
+}
+
+TEST_CASE("append")
+{
+    auto sorted = [](const Phrase& phrase) {
+        auto notes = phrase.notes();
+        return std::is_sorted(notes.begin(), notes.end(), [](const Note& n1, const Note& n2) {
+            return n1.time < n2.time;
+        });
+    };
+
+    Phrase phrase(60);
+    std::vector<Note> first{Note(2.0, 1.0, 0.8, 0, 0), Note(0.0, 1.0, 0.8, 1, 0)};
+    phrase.append_notes(first);
+    CHECK(sorted(phrase));
+    CHECK(phrase.notes()[0].pitch == 1);
+
+    SUBCASE("merge")
+    {
+        std::vector<Note> more{Note(3.0, 1.0, 0.8, 2, 1), Note(1.0, 1.0, 0.8, 3, 1),
+                               Note(2.0, 1.0, 0.8, 4, 1)};
+        phrase.append_notes(more);
+        REQUIRE(phrase.notes().size() == 5);
+        CHECK(sorted(phrase));
+        // Ties go after existing notes.
+        CHECK(phrase.notes()[2].pitch == 0);
+        CHECK(phrase.notes()[3].pitch == 4);
+    }
+    SUBCASE("presorted")
+    {
+        std::vector<Note> more{Note(0.5, 1.0, 0.8, 2, 1), Note(4.0, 1.0, 0.8, 3, 1)};
+        phrase.append_sorted_notes(more);
+        REQUIRE(phrase.notes().size() == 4);
+        CHECK(sorted(phrase));
+        CHECK(phrase.notes()[1].pitch == 2);
+        CHECK(phrase.notes()[3].pitch == 3);
+    }
+    SUBCASE("move")
+    {
+        Phrase empty(60);
+        std::pmr::vector<Note> buffer{Note(1.0, 1.0, 0.8, 2, 1), Note(0.5, 1.0, 0.8, 3, 1)};
+        auto data = buffer.data();
+        empty.append_notes(std::move(buffer));
+        CHECK(empty.notes().data() == data);
+        CHECK(sorted(empty));
+        phrase.append_notes(std::pmr::vector<Note>{Note(1.5, 1.0, 0.8, 5, 1)});
+        CHECK(phrase.notes().size() == 3);
+        CHECK(sorted(phrase));
+    }
+}
@@ -0,0 +1,77 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "ring_buffer.hh"
+
+#include "doctest.h"
+
+#include <numeric>
+#include <thread>
+#include <vector>
+
+TEST_CASE("ring buffer")
+{
+    Spsc_Ring<int> ring(6);
+    CHECK(ring.capacity() == 8);
+    CHECK(ring.size() == 0);
+
+    std::vector<int> in(10);
+    std::iota(in.begin(), in.end(), 0);
+    std::vector<int> out(10);
+    SUBCASE("full")
+    {
+        CHECK(ring.push(in) == 8);
+        CHECK(ring.size() == 8);
+        CHECK(ring.push(in) == 0);
+        CHECK(ring.pop(out) == 8);
+        CHECK(out == std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 0, 0});
+        CHECK(ring.pop(out) == 0);
+    }
+    SUBCASE("wrap")
+    {
+        CHECK(ring.push(std::span(in).first(5)) == 5);
+        CHECK(ring.pop(std::span(out).first(3)) == 3);
+        CHECK(ring.push(std::span(in).subspan(5)) == 5);
+        CHECK(ring.size() == 7);
+        CHECK(ring.pop(out) == 7);
+        CHECK(out == std::vector<int>{3, 4, 5, 6, 7, 8, 9, 0, 0, 0});
+    }
+}
+
+TEST_CASE("ring buffer threads")
+{
+    constexpr int count = 1'000'000;
+    Spsc_Ring<int> ring(1000);
+    std::thread producer([&] {
+        std::vector<int> block(37);
+        for (int next = 0; next < count;)
+        {
+            auto n = std::min<int>(block.size(), count - next);
+            std::iota(block.begin(), block.begin() + n, next);
+            for (std::span<const int> rest(block.data(), n); !rest.empty();)
+                rest = rest.subspan(ring.push(rest));
+            next += n;
+        }
+    });
+    std::vector<int> block(53);
+    int expected = 0;
+    bool in_order = true;
+    while (expected < count)
+        for (std::size_t i = 0, n = ring.pop(block); i < n; ++i)
+            in_order = in_order && block[i] == expected++;
+    producer.join();
+    CHECK(in_order);
+    CHECK(ring.size() == 0);
+}
@@ -0,0 +1,156 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "server.hh"
+
+#include "doctest.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+    /// Connect to the server.
+    /// @return The socket.
+    int connect_to(const std::filesystem::path& path)
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, path.c_str());
+        auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        REQUIRE(fd >= 0);
+        REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof address) == 0);
+        return fd;
+    }
+
+    /// Send requests and read until there are at least size bytes of response.
+    std::string exchange(int fd, const std::string& requests, std::size_t size)
+    {
+        REQUIRE(::write(fd, requests.data(), requests.size())
+                == static_cast<ssize_t>(requests.size()));
+        std::string response;
+        char block[256];
+        while (response.size() < size)
+        {
+            auto n = ::read(fd, block, sizeof block);
+            if (n <= 0)
+                break;
+            response.append(block, n);
+        }
+        return response;
+    }
+}
+
+TEST_CASE("server")
+{
+    auto path = std::filesystem::temp_directory_path() / "test-composure.sock";
+    Socket_Server server(path, [](const std::string& request) {
+        if (request == "throw")
+            throw std::runtime_error("bad request");
+        return "got " + request + '\n';
+    }, 2);
+    CHECK(server.workers() == 2);
+    CHECK(std::filesystem::is_socket(path));
+    std::jthread thread([&] { server.run(); });
+
+    SUBCASE("requests")
+    {
+        auto fd = connect_to(path);
+        // Two requests in one write, and one in pieces.
+        CHECK(exchange(fd, "a\nbc\n", 11) == "got a\ngot bc\n");
+        CHECK(exchange(fd, "d", 0).empty());
+        CHECK(exchange(fd, "ef\n", 8) == "got def\n");
+        ::close(fd);
+    }
+    SUBCASE("concurrent")
+    {
+        std::vector<std::string> responses(4);
+        std::vector<std::jthread> clients;
+        for (std::size_t i = 0; i < responses.size(); ++i)
+            clients.emplace_back([&, i] {
+                auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                sockaddr_un address{};
+                address.sun_family = AF_UNIX;
+                std::strcpy(address.sun_path, path.c_str());
+                if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof address) == 0)
+                {
+                    auto request = std::to_string(i) + '\n';
+                    if (::write(fd, request.data(), request.size()) > 0)
+                    {
+                        char block[16];
+                        auto n = ::read(fd, block, sizeof block);
+                        if (n > 0)
+                            responses[i].assign(block, n);
+                    }
+                }
+                ::close(fd);
+            });
+        clients.clear();
+        for (std::size_t i = 0; i < responses.size(); ++i)
+            CHECK(responses[i] == "got " + std::to_string(i) + '\n');
+    }
+    SUBCASE("handler throws")
+    {
+        auto fd = connect_to(path);
+        // The connection is closed without a response.
+        CHECK(exchange(fd, "throw\n", 1).empty());
+        ::close(fd);
+    }
+    SUBCASE("stop with an open connection")
+    {
+        auto fd = connect_to(path);
+        CHECK(exchange(fd, "x\n", 6) == "got x\n");
+        server.stop();
+        thread.join();
+        char byte;
+        CHECK(::read(fd, &byte, 1) == 0);
+        ::close(fd);
+    }
+    SUBCASE("run again")
+    {
+        server.stop();
+        thread.join();
+        std::jthread again([&] { server.run(); });
+        auto fd = connect_to(path);
+        CHECK(exchange(fd, "y\n", 6) == "got y\n");
+        ::close(fd);
+        server.stop();
+    }
+    server.stop();
+}
+
+TEST_CASE("server errors")
+{
+    auto handler = [](const std::string&) { return std::string(); };
+    CHECK_THROWS_AS(Socket_Server("/no-such-dir/composure.sock", handler), Server_Error);
+    CHECK_THROWS_AS(Socket_Server(std::string(200, 'x'), handler), Server_Error);
+
+    // Don't replace a file that isn't a socket.
+    auto path = std::filesystem::temp_directory_path() / "test-composure-not-a-socket";
+    {
+        std::ofstream(path) << "data";
+    }
+    CHECK_THROWS_AS(Socket_Server(path, handler), Server_Error);
+    CHECK(std::filesystem::is_regular_file(path));
+    std::filesystem::remove(path);
+}
@@ -0,0 +1,212 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "soundfont.hh"
+#include "mapped_file.hh"
+
+#include "doctest.h"
+
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <numbers>
+#include <string>
+#include <vector>
+
+namespace
+{
+    using Bytes = std::vector<unsigned char>;
+
+    void put(Bytes& out, std::uint32_t x, std::size_t bytes)
+    {
+        for (std::size_t i = 0; i < bytes; ++i)
+            out.push_back((x >> 8*i) & 0xff);
+    }
+
+    void put_name(Bytes& out, const std::string& name)
+    {
+        for (std::size_t i = 0; i < 20; ++i)
+            out.push_back(i < name.size() ? name[i] : 0);
+    }
+
+    Bytes chunk(const std::string& id, const Bytes& data)
+    {
+        Bytes out(id.begin(), id.end());
+        put(out, data.size(), 4);
+        out.insert(out.end(), data.begin(), data.end());
+        if (data.size() % 2)
+            out.push_back(0);
+        return out;
+    }
+
+    Bytes list(const std::string& type, const std::vector<Bytes>& chunks)
+    {
+        Bytes data(type.begin(), type.end());
+        for (const auto& c : chunks)
+            data.insert(data.end(), c.begin(), c.end());
+        return chunk("LIST", data);
+    }
+
+    /// The number of frames in one cycle of the test sample.  At 44 kHz it's 440 Hz.
+    constexpr int period = 100;
+    constexpr int sample_rate = 44000;
+
+    /// @return A font with one preset, program 5 in bank 0, that plays a looped sine wave
+    ///     with root key 69.  The instrument has a global zone with the loop mode.
+    Bytes make_font(int modes = 1)
+    {
+        Bytes smpl;
+        for (int i = 0; i < 10*period; ++i)
+            put(smpl, static_cast<std::int16_t>(
+                    std::lround(16000*std::sin(2*std::numbers::pi*i/period))), 2);
+        // 46 zero frames after each sample, as the spec requires.
+        put(smpl, 0, 2*46);
+
+        Bytes phdr;
+        put_name(phdr, "Sine");
+        put(phdr, 5, 2); // program
+        put(phdr, 0, 2); // bank
+        put(phdr, 0, 2); // bag index
+        put(phdr, 0, 12);
+        put_name(phdr, "EOP");
+        put(phdr, 0, 4);
+        put(phdr, 1, 2);
+        put(phdr, 0, 12);
+
+        Bytes pbag;
+        put(pbag, 0, 2); put(pbag, 0, 2);
+        put(pbag, 1, 2); put(pbag, 0, 2);
+        Bytes pgen;
+        put(pgen, 41, 2); put(pgen, 0, 2); // instrument 0
+        put(pgen, 0, 4);
+
+        Bytes inst;
+        put_name(inst, "Sine");
+        put(inst, 0, 2);
+        put_name(inst, "EOI");
+        put(inst, 2, 2);
+
+        Bytes ibag;
+        put(ibag, 0, 2); put(ibag, 0, 2); // global zone
+        put(ibag, 1, 2); put(ibag, 0, 2); // sample zone
+        put(ibag, 3, 2); put(ibag, 0, 2);
+        Bytes igen;
+        put(igen, 54, 2); put(igen, modes, 2); // loop mode
+        put(igen, 38, 2); put(igen, static_cast<std::uint16_t>(-3986), 2); // release 0.1 s
+        put(igen, 53, 2); put(igen, 0, 2); // sample 0
+        put(igen, 0, 4);
+
+        Bytes shdr;
+        put_name(shdr, "Sine");
+        put(shdr, 0, 4); // start
+        put(shdr, 10*period, 4); // end
+        put(shdr, 2*period, 4); // loop start
+        put(shdr, 8*period, 4); // loop end
+        put(shdr, sample_rate, 4);
+        shdr.push_back(69); // root key
+        shdr.push_back(0); // correction
+        put(shdr, 0, 2); // link
+        put(shdr, 1, 2); // mono
+        put_name(shdr, "EOS");
+        put(shdr, 0, 26);
+
+        auto sfbk = list("INFO", {chunk("ifil", {2, 0, 1, 0})});
+        auto sdta = list("sdta", {chunk("smpl", smpl)});
+        auto pdta = list("pdta", {chunk("phdr", phdr), chunk("pbag", pbag),
+                                  chunk("pmod", Bytes(10)), chunk("pgen", pgen),
+                                  chunk("inst", inst), chunk("ibag", ibag),
+                                  chunk("imod", Bytes(10)), chunk("igen", igen),
+                                  chunk("shdr", shdr)});
+        Bytes data{'s', 'f', 'b', 'k'};
+        for (const auto& l : {sfbk, sdta, pdta})
+            data.insert(data.end(), l.begin(), l.end());
+        return chunk("RIFF", data);
+    }
+
+    /// @return The number of times the samples go from negative to non-negative.
+    int crossings(const std::vector<float>& samples, std::size_t first, std::size_t last)
+    {
+        int n = 0;
+        for (auto i = first + 1; i < last; ++i)
+            n += samples[i - 1] < 0.0f && samples[i] >= 0.0f;
+        return n;
+    }
+}
+
+TEST_CASE("soundfont")
+{
+    auto data = make_font();
+    Soundfont font(data);
+    SUBCASE("pitch")
+    {
+        // A 440 for 1 second, then A 880.
+        std::vector<Audio_Note> notes{{0.0, 1.0, 440.0, 1.0}, {1.0, 2.0, 880.0, 1.0}};
+        auto samples = font.render(notes, 5, 0, sample_rate);
+        // Looped until released, then 0.1 s of release.
+        CHECK(samples.size() == doctest::Approx(2.1*sample_rate).epsilon(0.001));
+        CHECK(crossings(samples, 0, sample_rate) == doctest::Approx(440).epsilon(0.01));
+        CHECK(crossings(samples, sample_rate + 1000, 2*sample_rate)
+              == doctest::Approx(880*(1 - 1000.0/sample_rate)).epsilon(0.01));
+    }
+    SUBCASE("no loop")
+    {
+        auto one_shot = make_font(0);
+        Soundfont unlooped(one_shot);
+        // The sample runs out after 10 cycles.
+        std::vector<Audio_Note> notes{{0.0, 1.0, 440.0, 1.0}};
+        auto samples = unlooped.render(notes, 5, 0, sample_rate);
+        CHECK(samples.size() == 10*period);
+    }
+    SUBCASE("threads")
+    {
+        std::vector<Audio_Note> notes;
+        for (int i = 0; i < 12; ++i)
+            notes.push_back({0.3*i, 0.3*i + 0.5, 220.0*std::pow(2.0, i/12.0), 0.7});
+        CHECK(font.render(notes, 5, 0, sample_rate, 1)
+              == font.render(notes, 5, 0, sample_rate, 3));
+    }
+    SUBCASE("missing preset")
+    {
+        CHECK_THROWS_AS(font.render({}, 6, 0, sample_rate), Bad_Soundfont);
+        CHECK_THROWS_AS(font.render({}, 5, 128, sample_rate), Bad_Soundfont);
+    }
+}
+
+TEST_CASE("bad soundfont")
+{
+    auto data = make_font();
+    SUBCASE("magic")
+    {
+        data[8] = 'x';
+        CHECK_THROWS_AS(Soundfont{data}, Bad_Soundfont);
+    }
+    SUBCASE("truncated")
+    {
+        data.resize(data.size() - 50);
+        CHECK_THROWS_AS(Soundfont{data}, Bad_Soundfont);
+    }
+    SUBCASE("file")
+    {
+        auto file = std::filesystem::temp_directory_path() / "test-soundfont.sf2";
+        std::ofstream(file, std::ios::binary).write(reinterpret_cast<const char*>(data.data()),
+                                                    data.size());
+        Soundfont font(file);
+        std::filesystem::remove(file);
+        CHECK(!font.render(std::vector<Audio_Note>{{0.0, 0.1, 440.0, 1.0}}, 5, 0, 44100)
+              .empty());
+        CHECK_THROWS_AS(Soundfont("no-such-file.sf2"), File_Not_Mapped);
+    }
+}
@@ -0,0 +1,119 @@
+// Copyright © 2021 Sam Varner
+//
+// This file is part of Composure.
+//
+// Composure is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// Composure is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with Composure.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "random.hh"
+#include "thread_pool.hh"
+
+#include "doctest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+TEST_CASE("thread pool")
+{
+    SUBCASE("concurrency")
+    {
+        CHECK(Thread_Pool(3).concurrency() == 3);
+        CHECK(Thread_Pool().concurrency() >= 1);
+        CHECK(Thread_Pool::current().concurrency() == Thread_Pool::standard().concurrency());
+    }
+    SUBCASE("ranges")
+    {
+        for (unsigned concurrency : {1, 4})
+        {
+            Thread_Pool pool(concurrency);
+            std::vector<int> hits(1000);
+            pool.parallel_for(hits.size(), 7, [&](std::size_t begin, std::size_t end) {
+                CHECK(end - begin <= 7);
+                for (auto i = begin; i < end; ++i)
+                    ++hits[i];
+            });
+            CHECK(std::count(hits.begin(), hits.end(), 1) == 1000);
+            pool.parallel_for(0, [](std::size_t) { CHECK(false); });
+        }
+    }
+    SUBCASE("nested")
+    {
+        // Tasks that wait for their own tasks don't tie up the workers, even with more
+        // waiting tasks than threads.
+        Thread_Pool pool(2);
+        std::vector<std::atomic<int>> sums(16);
+        pool.parallel_for(sums.size(), [&](std::size_t i) {
+            CHECK(&Thread_Pool::current() == &pool);
+            pool.parallel_for(100, [&](std::size_t j) { sums[i] += j; });
+        });
+        for (const auto& sum : sums)
+            CHECK(sum == 4950);
+        // The calling thread goes back to the standard pool.
+        CHECK(&Thread_Pool::current() == &Thread_Pool::standard());
+    }
+    SUBCASE("thread state")
+    {
+        // Batch pieces seed their thread's generator and wait on nested tasks.  A piece
+        // that waits must not start another piece on its thread and lose its sequence.
+        auto piece = [](Thread_Pool* pool, unsigned seed) {
+            set_random_seed(seed);
+            std::vector<int> picks{pick(0, 1000)};
+            if (pool)
+                pool->parallel_for(4, [](std::size_t) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                });
+            picks.push_back(pick(0, 1000));
+            return picks;
+        };
+        std::vector<std::vector<int>> single;
+        for (unsigned i = 0; i < 24; ++i)
+            single.push_back(piece(nullptr, i));
+
+        Thread_Pool pool(4);
+        std::vector<std::vector<int>> batch(single.size());
+        pool.parallel_for(batch.size(), [&](std::size_t i) { batch[i] = piece(&pool, i); });
+        CHECK(batch == single);
+    }
+    SUBCASE("workers share")
+    {
+        // Slow tasks are spread over the workers.
+        Thread_Pool pool(4);
+        std::mutex mutex;
+        std::set<std::thread::id> ids;
+        pool.parallel_for(8, [&](std::size_t) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            std::lock_guard lock(mutex);
+            ids.insert(std::this_thread::get_id());
+        });
+        CHECK(ids.size() > 1);
+    }
+    SUBCASE("exceptions")
+    {
+        Thread_Pool pool(3);
+        std::atomic<int> done = 0;
+        CHECK_THROWS_AS(pool.parallel_for(50, [&](std::size_t i) {
+            if (i % 10 == 3)
+                throw std::runtime_error("task failed");
+            ++done;
+        }), std::runtime_error);
+        // The other tasks still run.
+        CHECK(done == 45);
+        // The pool is still usable.
+        pool.parallel_for(10, [&](std::size_t) { ++done; });
+        CHECK(done == 55);
+    }
+}